@@ -5,389 +5,9169 @@
 #include <cmath>
 #include <cctype>
 #include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <array>
+#include <limits>
+#include <map>
+#include <tuple>
+#include <charconv>
+#include <optional>
+#include <exception>
+#include <utility>
 
-class Calculator
-{
-    private:
-        std::string expr;
-        double result;
-
-        struct Token
-        {
-            enum Type {NUMBER, OPERATOR, PAREN_LEFT, PAREN_RIGHT} type;
-            double value;
-            char op;
-        };
-
-    public:
-        void inputExpr();
-        std::string getExpr() { return expr; }
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
-        int precedence(char op);
-        double applyOperation(double x, double y, char op);
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-        std::vector<Token> tokenize();
-        std::vector<Token> toPostfix(const std::vector<Token>& tokens);
-        double evaluatePostfix(const std::vector<Token>& postfix);
-        void debug(const std::vector<Token>& tokens, const std::string& stage);
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-        double evaluateExpr();
-        void displayResult() const;
-};
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#endif
 
 // ----------------------------
-// Input expression from user
+// Format a result for the line protocol
 // ----------------------------
-void Calculator::inputExpr()
+std::string formatResult(double value)
 {
-    std::getline(std::cin, expr);
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.15g", value);
+    return std::string(buf, n);
 }
 
 // ----------------------------
-// Operator precedence
-// 'u' is unary minus
+// Comparison and logical operators are one char in tokens:
+// < > l (<=) g (>=) = (==) n (!=), & (&&) | (||), ? and :
+// Comparisons give 1 or 0
 // ----------------------------
-int Calculator::precedence(char op)
+bool isComparison(char op)
+{
+    return op == '<' || op == '>' || op == 'l' || op == 'g' || op == '=' || op == 'n';
+}
+
+// Outcome of a comparison from the sign of x - y
+bool compareResult(int sign, char op)
 {
     switch(op)
     {
-        case '+':
-        case '-': return 1;
-        case '*':
-        case '/': return 2;
-        case 'u': return 3;  // unary minus
-        case '^': return 4;
-        case '%': return 5;
-        default: return 0;
+        case '<': return sign < 0;
+        case '>': return sign > 0;
+        case 'l': return sign <= 0;
+        case 'g': return sign >= 0;
+        case '=': return sign == 0;
+        default:  return sign != 0;
     }
 }
 
-// ----------------------------
-// Apply binary operations
-// ----------------------------
-double Calculator::applyOperation(double x, double y, char op)
+std::string operatorName(char op)
 {
     switch(op)
     {
-        case '+': return x + y;
-        case '-': return x - y;
-        case '*': return x * y;
-        case '/': 
-            if(y == 0)
-                throw std::runtime_error("Division by zero!");
-            return x / y;
-        case '^':
-            return pow(x, y);
-        default:
-            throw std::runtime_error(std::string("Unknown operator: ") + op);
+        case 'u': return "-";
+        case 'l': return "<=";
+        case 'g': return ">=";
+        case '=': return "==";
+        case 'n': return "!=";
+        case '&': return "&&";
+        case '|': return "||";
+        default:  return std::string(1, op);
     }
 }
 
 // ----------------------------
-// Tokenize the input expression
-// Handles numbers, operators, parentheses, unary minus
+// Two-lane double vector for the batch kernels
+// SSE2 where available, plain doubles otherwise; the kernels
+// are written once against this type
 // ----------------------------
-std::vector<Calculator::Token> Calculator::tokenize()
+struct Vec2d
 {
-    std::vector<Token> tokens;
-    size_t i = 0;
+#ifdef __SSE2__
+    __m128d v;
 
-    while(i < expr.size())
+    static Vec2d load(const double* p) { return {_mm_loadu_pd(p)}; }
+    void store(double* p) const { _mm_storeu_pd(p, v); }
+    static Vec2d set1(double x) { return {_mm_set1_pd(x)}; }
+
+    friend Vec2d operator+(Vec2d a, Vec2d b) { return {_mm_add_pd(a.v, b.v)}; }
+    friend Vec2d operator-(Vec2d a, Vec2d b) { return {_mm_sub_pd(a.v, b.v)}; }
+    friend Vec2d operator*(Vec2d a, Vec2d b) { return {_mm_mul_pd(a.v, b.v)}; }
+    friend Vec2d operator/(Vec2d a, Vec2d b) { return {_mm_div_pd(a.v, b.v)}; }
+
+    friend Vec2d min(Vec2d a, Vec2d b) { return {_mm_min_pd(a.v, b.v)}; }
+    friend Vec2d max(Vec2d a, Vec2d b) { return {_mm_max_pd(a.v, b.v)}; }
+    friend Vec2d sqrt(Vec2d a) { return {_mm_sqrt_pd(a.v)}; }
+    friend Vec2d abs(Vec2d a) { return {_mm_andnot_pd(_mm_set1_pd(-0.0), a.v)}; }
+
+    // Lane masks: all ones where the comparison holds
+    friend Vec2d operator<(Vec2d a, Vec2d b) { return {_mm_cmplt_pd(a.v, b.v)}; }
+    friend Vec2d operator>(Vec2d a, Vec2d b) { return {_mm_cmpgt_pd(a.v, b.v)}; }
+    friend Vec2d operator==(Vec2d a, Vec2d b) { return {_mm_cmpeq_pd(a.v, b.v)}; }
+    friend Vec2d select(Vec2d mask, Vec2d a, Vec2d b) { return {_mm_or_pd(_mm_and_pd(mask.v, a.v), _mm_andnot_pd(mask.v, b.v))}; }
+    bool all() const { return _mm_movemask_pd(v) == 3; }
+
+    // Nearest integer, for |x| < 2^31
+    static Vec2d roundInt(Vec2d x, __m128i& ints)
     {
-        char c = expr[i];
+        ints = _mm_cvtpd_epi32(x.v);
+        return {_mm_cvtepi32_pd(ints)};
+    }
 
-        // Skip whitespace
-        if(isspace(c)) { ++i; continue; }
+    // Widen the two int32 results of roundInt to 64-bit lanes
+    static __m128i widen(__m128i ints) { return _mm_unpacklo_epi32(ints, _mm_srai_epi32(ints, 31)); }
 
-        // ----------------------------
-        // Handle unary minus as 'u' operator
-        // Occurs at start, after operator, or after '('
-        // ----------------------------
-        if(c == '-' && (i == 0 || tokens.empty() || tokens.back().type == Token::OPERATOR || tokens.back().type == Token::PAREN_LEFT))
-        {
-            tokens.push_back({Token::OPERATOR, 0, 'u'});
-            ++i;
-            continue;
-        }
+    // 2^k for integer k in [-1022, 1023]
+    static Vec2d pow2(__m128i ints)
+    {
+        __m128i bits = _mm_slli_epi64(_mm_add_epi64(widen(ints), _mm_set1_epi64x(1023)), 52);
+        return {_mm_castsi128_pd(bits)};
+    }
 
-        // ----------------------------
-        // Parse numbers (integers or decimals)
-        // ----------------------------
-        if(isdigit(c) || (c == '.' && i + 1 < expr.size() && isdigit(expr[i + 1])))
-        {
-            std::string numStr;
-            bool hasDecimal = false;
+    // Lanes whose integer has the given bit set
+    static Vec2d bitMask(__m128i ints, int bit)
+    {
+        __m128i b = _mm_set1_epi32(bit);
+        __m128i m = _mm_cmpeq_epi32(_mm_and_si128(ints, b), b);
+        return {_mm_castsi128_pd(_mm_unpacklo_epi32(m, m))};
+    }
 
-            while(i < expr.size() && (isdigit(expr[i]) || expr[i] == '.'))
-            {
-                if(expr[i] == '.')
-                {
-                    if(hasDecimal)
-                    {
-                        throw std::runtime_error("Invalid number: multiple decimal points.");
-                    }
-                    hasDecimal = true;
-                }
+    // x = m * 2^e with m in [1, 2), for positive normal x
+    static void split(Vec2d x, Vec2d& m, Vec2d& e)
+    {
+        __m128i bits = _mm_castpd_si128(x.v);
+        __m128i exps = _mm_sub_epi32(_mm_srli_epi64(bits, 52), _mm_set1_epi64x(1023));
+        e = {_mm_cvtepi32_pd(_mm_shuffle_epi32(exps, _MM_SHUFFLE(3, 1, 2, 0)))};
 
-                numStr += expr[i++];
-            }
+        __m128i mant = _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi64x(0x000FFFFFFFFFFFFFLL)), _mm_set1_epi64x(0x3FF0000000000000LL));
+        m = {_mm_castsi128_pd(mant)};
+    }
+#else
+    double v[2];
 
-            tokens.push_back({Token::NUMBER, std::stod(numStr), 0});
-            continue;
-        }
+    static Vec2d load(const double* p) { return {{p[0], p[1]}}; }
+    void store(double* p) const { p[0] = v[0]; p[1] = v[1]; }
+    static Vec2d set1(double x) { return {{x, x}}; }
 
-        // ----------------------------
-        // Parse binary operators
-        // ----------------------------
-        if(c == '+' || c == '-' || c == '*' || c == '/' || c == '^' || c == '%')
-        {
-            tokens.push_back({Token::OPERATOR, 0, c});
-            ++i;
-            continue;
-        }
+    template<class F> static Vec2d map(Vec2d a, Vec2d b, F f) { return {{f(a.v[0], b.v[0]), f(a.v[1], b.v[1])}}; }
+    static double maskOf(bool c) { double d; uint64_t u = c ? ~0ULL : 0; memcpy(&d, &u, 8); return d; }
+    static bool isSet(double d) { uint64_t u; memcpy(&u, &d, 8); return u != 0; }
 
-        // ----------------------------
-        // Parse parentheses
-        // ----------------------------
-        if(c == '(')
-        {
-            tokens.push_back({Token::PAREN_LEFT, 0, 0});
-            ++i;
-            continue;
-        }
+    friend Vec2d operator+(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return x + y; }); }
+    friend Vec2d operator-(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return x - y; }); }
+    friend Vec2d operator*(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return x * y; }); }
+    friend Vec2d operator/(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return x / y; }); }
+
+    friend Vec2d min(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return x < y ? x : y; }); }
+    friend Vec2d max(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return x > y ? x : y; }); }
+    friend Vec2d sqrt(Vec2d a) { return {{std::sqrt(a.v[0]), std::sqrt(a.v[1])}}; }
+    friend Vec2d abs(Vec2d a) { return {{std::fabs(a.v[0]), std::fabs(a.v[1])}}; }
+
+    friend Vec2d operator<(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return maskOf(x < y); }); }
+    friend Vec2d operator>(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return maskOf(x > y); }); }
+    friend Vec2d operator==(Vec2d a, Vec2d b) { return map(a, b, [](double x, double y) { return maskOf(x == y); }); }
+    friend Vec2d select(Vec2d mask, Vec2d a, Vec2d b) { return {{isSet(mask.v[0]) ? a.v[0] : b.v[0], isSet(mask.v[1]) ? a.v[1] : b.v[1]}}; }
+    bool all() const { return isSet(v[0]) && isSet(v[1]); }
+
+    static Vec2d roundInt(Vec2d x, long long (&ints)[2])
+    {
+        ints[0] = std::llrint(x.v[0]);
+        ints[1] = std::llrint(x.v[1]);
+        return {{double(ints[0]), double(ints[1])}};
+    }
 
-        if(c == ')')
+    static Vec2d pow2(const long long (&ints)[2]) { return {{std::ldexp(1.0, int(ints[0])), std::ldexp(1.0, int(ints[1]))}}; }
+    static Vec2d bitMask(const long long (&ints)[2], int bit) { return {{maskOf(ints[0] & bit), maskOf(ints[1] & bit)}}; }
+
+    static void split(Vec2d x, Vec2d& m, Vec2d& e)
+    {
+        for(int i = 0; i < 2; ++i)
         {
-            tokens.push_back({Token::PAREN_RIGHT, 0, 0});
-            ++i;
-            continue;
+            int ex;
+            m.v[i] = std::frexp(x.v[i], &ex) * 2;
+            e.v[i] = ex - 1;
         }
-
-        throw std::runtime_error(std::string("Unknown character: ") + c);
-        // ++i REMOVED 166 166 166
     }
+#endif
+};
 
-    return tokens;
-}
+#ifdef __SSE2__
+using Vec2i = __m128i;
+#else
+using Vec2i = long long[2];
+#endif
 
 // ----------------------------
-// Convert tokens to postfix (RPN) using Shunting Yard
-// Handles operator precedence and right-associativity
+// Vector kernels
+// Errors measured against libm over random inputs (see --bench):
+// log within 1 ulp, exp within 2 ulp, sin and cos within 2 ulp
+// for |x| < 1e5 (libm beyond)
 // ----------------------------
-std::vector<Calculator::Token> Calculator::toPostfix(const std::vector<Token>& tokens)
+namespace kernels
 {
-    std::vector<Token> output;
-    std::stack<Token> opStack;
+    inline double sqrt1(double x) { return std::sqrt(x); }
+    inline double exp1(double x) { return std::exp(x); }
+    inline double log1(double x) { return std::log(x); }
+    inline double sin1(double x) { return std::sin(x); }
+    inline double cos1(double x) { return std::cos(x); }
+    inline double abs1(double x) { return std::fabs(x); }
+    inline double min2(double x, double y) { return x < y ? x : y; }
+    inline double max2(double x, double y) { return x > y ? x : y; }
 
-    auto isRightAssociative = [](char op) { return op == '^' || op == 'u' || op == '%'; };
-
-    for(const auto &tok : tokens)
+    // e^x: x = k*ln2 + r with |r| <= ln2/2, Taylor to r^13, scale by 2^k
+    inline Vec2d exp(Vec2d x)
     {
-        if(tok.type == Token::NUMBER) output.push_back(tok);
-
-        else if(tok.type == Token::OPERATOR)
-        {
-            while(!opStack.empty() && opStack.top().type == Token::OPERATOR)
-            {
-                char topOp = opStack.top().op;
-
-                if((!isRightAssociative(tok.op) && this->precedence(topOp) >= this->precedence(tok.op)) ||
-                   (isRightAssociative(tok.op) && this->precedence(topOp) > this->precedence(tok.op)))
-                {
-                    output.push_back(opStack.top()); opStack.pop();
-                }
-                else break;
-            }
+        const Vec2d hiLimit = Vec2d::set1(709.782712893384), loLimit = Vec2d::set1(-745.1332191019412);
+        Vec2d big = x > hiLimit, tiny = x < loLimit;
+        Vec2d xc = min(max(x, loLimit), hiLimit);
 
-            opStack.push(tok);
-        }
+        Vec2i k;
+        Vec2d kd = Vec2d::roundInt(xc * Vec2d::set1(1.4426950408889634), k);
+        Vec2d r = xc - kd * Vec2d::set1(6.93147180369123816490e-01) - kd * Vec2d::set1(1.90821492927058770002e-10);
 
-        else if(tok.type == Token::PAREN_LEFT) opStack.push(tok);
+        // Estrin's scheme: pairs of terms in parallel instead of one long Horner chain
+        auto c = [](double v) { return Vec2d::set1(v); };
+        Vec2d r2 = r * r, r4 = r2 * r2, r8 = r4 * r4;
+        Vec2d p01 = c(1.0) + r, p23 = c(0.5) + r * c(1.0 / 6.0), p45 = c(1.0 / 24.0) + r * c(1.0 / 120.0);
+        Vec2d p67 = c(1.0 / 720.0) + r * c(1.0 / 5040.0), p89 = c(1.0 / 40320.0) + r * c(1.0 / 362880.0);
+        Vec2d p1011 = c(1.0 / 3628800.0) + r * c(1.0 / 39916800.0), p1213 = c(1.0 / 479001600.0) + r * c(1.0 / 6227020800.0);
+        Vec2d p = (p01 + r2 * p23) + r4 * (p45 + r2 * p67) + r8 * ((p89 + r2 * p1011) + r4 * p1213);
 
-        else if(tok.type == Token::PAREN_RIGHT)
-        {
-            while(!opStack.empty() && opStack.top().type != Token::PAREN_LEFT)
-            {   
-                output.push_back(opStack.top());
-                opStack.pop();
-            }
+        // Scale in two halves so subnormal results survive
+        Vec2i half, rest;
+        Vec2d halfd = Vec2d::roundInt(kd * Vec2d::set1(0.5), half);
+        Vec2d::roundInt(kd - halfd, rest);
+        Vec2d result = p * Vec2d::pow2(half) * Vec2d::pow2(rest);
 
-            if(opStack.empty())
-                throw std::runtime_error("Mismatched parentheses: unexpected ')'");
-            
-            opStack.pop();
-        }
+        result = select(big, Vec2d::set1(std::numeric_limits<double>::infinity()), result);
+        result = select(tiny, Vec2d::set1(0.0), result);
+        return select(x == x, result, x);
     }
 
-    while(!opStack.empty())
+    // ln x: x = m * 2^e with m in [sqrt(1/2), sqrt(2))
+    inline Vec2d log(Vec2d x)
     {
-        if(opStack.top().type == Token::PAREN_LEFT)
-            throw std::runtime_error("Mismatched parentheses: unclosed '('");
+        const double inf = std::numeric_limits<double>::infinity();
 
-        output.push_back(opStack.top());
-        opStack.pop();
-    }
+        // Lift subnormals into the normal range first
+        Vec2d sub = x < Vec2d::set1(2.2250738585072014e-308);
+        Vec2d xs = select(sub, x * Vec2d::set1(18014398509481984.0), x);
 
-    return output;
-}
+        Vec2d m, e;
+        Vec2d::split(xs, m, e);
+        e = e - select(sub, Vec2d::set1(54.0), Vec2d::set1(0.0));
 
-// ----------------------------
-// Evaluate postfix expression
-// Handles unary minus 'u' and binary operators
-// ----------------------------
-double Calculator::evaluatePostfix(const std::vector<Token>& postfix)
-{
-    std::stack<double> st;
+        Vec2d high = m > Vec2d::set1(1.4142135623730951);
+        m = select(high, m * Vec2d::set1(0.5), m);
+        e = e + select(high, Vec2d::set1(1.0), Vec2d::set1(0.0));
 
-    for(const auto &tok : postfix)
-    {
-        if(tok.type == Token::NUMBER)
-        {
-            st.push(tok.value);
-            std::cout << "\nPush " << tok.value << " onto stack\n";
-        }
+        // fdlibm's minimax for ln(1 + f) = f - (f^2/2 - s (f^2/2 + R(s^2))), s = f / (2 + f)
+        Vec2d f = m - Vec2d::set1(1.0);
+        Vec2d s = f / (Vec2d::set1(2.0) + f);
+        Vec2d z = s * s, w = z * z;
+        Vec2d t1 = w * (Vec2d::set1(3.999999999940941908e-01) + w * (Vec2d::set1(2.222219843214978396e-01) + w * Vec2d::set1(1.531383769920937332e-01)));
+        Vec2d t2 = z * (Vec2d::set1(6.666666666666735130e-01) + w * (Vec2d::set1(2.857142874366239149e-01) +
+                   w * (Vec2d::set1(1.818357216161805012e-01) + w * Vec2d::set1(1.479819860511658591e-01))));
+        Vec2d hfsq = Vec2d::set1(0.5) * f * f;
+        Vec2d lnm = f - (hfsq - s * (hfsq + t1 + t2));
 
-        else if(tok.type == Token::OPERATOR)
-        {
-            if(tok.op == 'u')
-            {
-                if(st.empty())
-                    throw std::runtime_error("Invalid expression: missing operand for unary minus.");
+        Vec2d result = e * Vec2d::set1(6.93147180369123816490e-01) + (e * Vec2d::set1(1.90821492927058770002e-10) + lnm);
 
-                double x = st.top();
-                st.pop();
-                st.push(-x);
-                std::cout << "Unary minus applied: -" << x << " -> pushed " << -x << "\n";
-            }
+        result = select(x == Vec2d::set1(inf), x, result);
+        result = select(x == Vec2d::set1(0.0), Vec2d::set1(-inf), result);
+        result = select(x < Vec2d::set1(0.0), Vec2d::set1(std::numeric_limits<double>::quiet_NaN()), result);
+        return select(x == x, result, x);
+    }
 
-            else if(tok.op == '%')
-            {
-                if(st.empty())
-                    throw std::runtime_error("Invalid expression: missing operand for '%'.");
-                
-                double x = st.top();
-                st.pop();
+    // sin(x + q*pi/2) on the reduced argument, fdlibm kernel coefficients
+    inline Vec2d sincos(Vec2d x, int quadrantOffset)
+    {
+        Vec2i q;
+        Vec2d qd = Vec2d::roundInt(x * Vec2d::set1(0.63661977236758134308), q);
 
-                double r = x / 100.0;
-                st.push(r);
-                std::cout << "Percent applied: " << x << "% -> pushed " << r << "\n";
-            }
+        // Three-part pi/2: q * pio2_1 is exact for |q| < 2^20
+        Vec2d r = x - qd * Vec2d::set1(1.57079632673412561417e+00);
+        r = r - qd * Vec2d::set1(6.07710050630396597660e-11);
+        r = r - qd * Vec2d::set1(2.02226624871116645580e-21);
 
-            else
-            {
-                if(st.size() < 2)
-                    throw std::runtime_error("Invalid expression: missing operand for binary operator.");
+        Vec2d z = r * r;
+        Vec2d sinr = r + r * z * (Vec2d::set1(-1.66666666666666324348e-01) + z * (Vec2d::set1(8.33333333332248946124e-03) +
+                     z * (Vec2d::set1(-1.98412698298579493134e-04) + z * (Vec2d::set1(2.75573137070700676789e-06) +
+                     z * (Vec2d::set1(-2.50507602534068634195e-08) + z * Vec2d::set1(1.58969099521155010221e-10))))));
 
-                double y = st.top();
-                st.pop();
-                double x = st.top();
-                st.pop();
+        Vec2d hz = z * Vec2d::set1(0.5), w = Vec2d::set1(1.0) - hz;
+        Vec2d poly = z * (Vec2d::set1(4.16666666666666019037e-02) + z * (Vec2d::set1(-1.38888888888741095749e-03) +
+                     z * (Vec2d::set1(2.48015872894767294178e-05) + z * (Vec2d::set1(-2.75573143513906633035e-07) +
+                     z * (Vec2d::set1(2.08757232129817482790e-09) + z * Vec2d::set1(-1.13596475577881948265e-11))))));
+        Vec2d cosr = w + (((Vec2d::set1(1.0) - w) - hz) + z * poly);
 
-                double r = applyOperation(x, y, tok.op);
-                st.push(r);
-                std::cout << "Applying " << tok.op << " to " << x << " and " << y << " -> " << r << "\n";
-            }
-        }
+#ifdef __SSE2__
+        Vec2i quadrant = _mm_add_epi32(q, _mm_set1_epi32(quadrantOffset));
+#else
+        Vec2i quadrant = {q[0] + quadrantOffset, q[1] + quadrantOffset};
+#endif
+        Vec2d result = select(Vec2d::bitMask(quadrant, 1), cosr, sinr);
+        return select(Vec2d::bitMask(quadrant, 2), Vec2d::set1(0.0) - result, result);
     }
 
-    if(st.size() != 1)
-        throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+    // Lanes outside the reduction range (and NaN, inf) go through libm
+    template<double (*Fallback)(double)>
+    inline Vec2d trig(Vec2d x, int quadrantOffset)
+    {
+        Vec2d result = sincos(x, quadrantOffset);
+        if((abs(x) < Vec2d::set1(1e5)).all()) return result;
+
+        double lanes[2], out[2];
+        x.store(lanes);
+        result.store(out);
+        for(int i = 0; i < 2; ++i)
+            if(!(std::fabs(lanes[i]) < 1e5)) out[i] = Fallback(lanes[i]);
+        return Vec2d::load(out);
+    }
 
-    return st.top();
+    inline Vec2d sin(Vec2d x) { return trig<sin1>(x, 0); }
+    inline Vec2d cos(Vec2d x) { return trig<cos1>(x, 1); }
+    inline Vec2d vsqrt(Vec2d x) { return sqrt(x); }
+    inline Vec2d vabs(Vec2d x) { return abs(x); }
+    inline Vec2d vmin(Vec2d x, Vec2d y) { return min(x, y); }
+    inline Vec2d vmax(Vec2d x, Vec2d y) { return max(x, y); }
 }
 
 // ----------------------------
-// Evaluate the expression: tokenize -> postfix -> evaluate
+// Built-in function registry
+// Each entry has a scalar implementation (libm) and a batch
+// implementation over arrays, two lanes at a time
 // ----------------------------
-double Calculator::evaluateExpr()
+struct BuiltinFunction
 {
-    auto tokens = tokenize();
-    debug(tokens, "After Tokenization");
+    enum Id {SQRT, EXP, LOG, SIN, COS, ABS, MIN, MAX};
 
-    auto postfix = toPostfix(tokens);
-    debug(postfix, "Postfix Conversion");
+    const char* name;
+    Id id;
+    int arity;
+    double (*scalar)(const double* args);
+    void (*batch)(const double* const* args, double* out, size_t n);
+    const char* accuracy;   // of the batch implementation
+};
 
-    result = evaluatePostfix(postfix);
-    return result;
+// Two independent vectors per step so the polynomial chains overlap
+template<Vec2d (*Kernel)(Vec2d), double (*Scalar)(double)>
+void batchUnary(const double* const* args, double* out, size_t n)
+{
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        Vec2d a = Kernel(Vec2d::load(args[0] + i));
+        Vec2d b = Kernel(Vec2d::load(args[0] + i + 2));
+        a.store(out + i);
+        b.store(out + i + 2);
+    }
+    for(; i + 2 <= n; i += 2) Kernel(Vec2d::load(args[0] + i)).store(out + i);
+    for(; i < n; ++i) out[i] = Scalar(args[0][i]);
 }
 
-void Calculator::debug(const std::vector<Token>& tokens, const std::string& stage)
+template<Vec2d (*Kernel)(Vec2d, Vec2d), double (*Scalar)(double, double)>
+void batchBinary(const double* const* args, double* out, size_t n)
 {
-    std::cout << "\n--- Debug: " << stage << " ---\n";
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) Kernel(Vec2d::load(args[0] + i), Vec2d::load(args[1] + i)).store(out + i);
+    for(; i < n; ++i) out[i] = Scalar(args[0][i], args[1][i]);
+}
 
-    for(const auto &tok : tokens)
-    {
-        switch(tok.type)
-        {
-            case Token::NUMBER:
-                std::cout << "Number: " << tok.value << "\n";
-                break;
-            case Token::OPERATOR:
-                std::cout << "Operator: " << tok.op << "\n";
-                break;
-            case Token::PAREN_LEFT:
-                std::cout << "Paren: (\n";
-                break;
-            case Token::PAREN_RIGHT:
-                std::cout << "Paren: )\n";
-                break;
-        }
-    }
+inline const std::vector<BuiltinFunction>& builtinFunctions()
+{
+    using namespace kernels;
+    using F = BuiltinFunction;
 
-    std::cout << "-----------------------------------\n";
+    static const std::vector<BuiltinFunction> table =
+    {
+        {"sqrt", F::SQRT, 1, [](const double* a) { return sqrt1(a[0]); }, batchUnary<vsqrt, sqrt1>, "correctly rounded"},
+        {"exp",  F::EXP,  1, [](const double* a) { return exp1(a[0]); },  batchUnary<kernels::exp, exp1>,   "2 ulp of libm"},
+        {"log",  F::LOG,  1, [](const double* a) { return log1(a[0]); },  batchUnary<kernels::log, log1>,   "1 ulp of libm"},
+        {"sin",  F::SIN,  1, [](const double* a) { return sin1(a[0]); },  batchUnary<kernels::sin, sin1>,   "2 ulp of libm for |x| < 1e5, libm beyond"},
+        {"cos",  F::COS,  1, [](const double* a) { return cos1(a[0]); },  batchUnary<kernels::cos, cos1>,   "2 ulp of libm for |x| < 1e5, libm beyond"},
+        {"abs",  F::ABS,  1, [](const double* a) { return abs1(a[0]); },  batchUnary<vabs, abs1>,   "exact"},
+        {"min",  F::MIN,  2, [](const double* a) { return min2(a[0], a[1]); }, batchBinary<vmin, min2>, "exact"},
+        {"max",  F::MAX,  2, [](const double* a) { return max2(a[0], a[1]); }, batchBinary<vmax, max2>, "exact"},
+    };
+    return table;
 }
 
-void Calculator::displayResult() const
+inline int findBuiltin(std::string_view name)
 {
-    std::cout << "Answer: " << result << "\n";
+    const auto &table = builtinFunctions();
+    for(size_t i = 0; i < table.size(); ++i)
+        if(name == table[i].name) return int(i);
+    return -1;
 }
 
-struct Application
+// ----------------------------
+// Range aggregations: sum(i, from, to, expression), and product,
+// min and max of the same form. The kind is stored as one char:
+// + (sum), * (product), < (min), > (max)
+// ----------------------------
+inline char findAggregate(std::string_view name)
 {
-    Calculator calc;
+    if(name == "sum") return '+';
+    if(name == "product") return '*';
+    if(name == "min") return '<';
+    if(name == "max") return '>';
+    return 0;
+}
 
-    void run()
+inline const char* aggregateName(char kind)
+{
+    switch(kind)
     {
-        greet();
+        case '+': return "sum";
+        case '*': return "product";
+        case '<': return "min";
+        default:  return "max";
+    }
+}
 
-        while(true)
+// Compensated (Neumaier) summation: sum + comp is the running total
+inline void neumaierAdd(double& sum, double& comp, double x)
+{
+    double t = sum + x;
+    comp += std::fabs(sum) >= std::fabs(x) ? (sum - t) + x : (x - t) + sum;
+    sum = t;
+}
+
+// ----------------------------
+// Arbitrary precision integer
+// Values that fit in __int128 stay inline (fast path);
+// anything larger is promoted to 32-bit limbs
+// ----------------------------
+class BigInt
+{
+    private:
+        using Mag = std::vector<uint32_t>;
+        using u128 = unsigned __int128;
+
+        __int128 small = 0;        // the value while limbs is empty
+        bool negative = false;     // sign of a limb value
+        Mag limbs;                 // magnitude, least significant first
+
+        static constexpr __int128 smallMin = -static_cast<__int128>(~static_cast<u128>(0) >> 1);
+
+        static u128 absSmall(__int128 v) { return v < 0 ? -static_cast<u128>(v) : static_cast<u128>(v); }
+
+        Mag magnitude() const
         {
-            std::cout << "\nEnter your expression: ";
-            calc.inputExpr();
+            if(!limbs.empty()) return limbs;
 
-            if(calc.getExpr() == "exit")
+            Mag m;
+            for(u128 u = absSmall(small); u; u >>= 32) m.push_back(static_cast<uint32_t>(u));
+            return m;
+        }
+
+        // Demote to the inline form whenever the value fits
+        static BigInt fromMag(bool neg, Mag m)
+        {
+            while(!m.empty() && m.back() == 0) m.pop_back();
+
+            BigInt r;
+            if(m.size() <= 4 && (m.size() < 4 || m.back() < 0x80000000u))
             {
-                std::cout << "Program finished with exit code 0.\n\n";
-                break;
+                u128 u = 0;
+                for(size_t i = m.size(); i-- > 0;) u = (u << 32) | m[i];
+                r.small = neg ? -static_cast<__int128>(u) : static_cast<__int128>(u);
+                return r;
             }
 
-            if(calc.getExpr() == "help")
-            {
-                std::cout << "\nEnter any mathematical expression using numbers and any of the following operations: (), %, ^, *, /, +, -.";
-                std::cout << "\nType 'exit' to close program.\n";
+            r.negative = neg;
+            r.limbs = std::move(m);
+            return r;
+        }
+
+        static int magCompare(const Mag& a, const Mag& b)
+        {
+            if(a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+
+            for(size_t i = a.size(); i-- > 0;)
+                if(a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+            return 0;
+        }
+
+        static Mag magAdd(const Mag& a, const Mag& b)
+        {
+            const Mag& x = a.size() >= b.size() ? a : b;
+            const Mag& y = a.size() >= b.size() ? b : a;
+            Mag r(x.size() + 1);
+            uint64_t carry = 0;
+
+            for(size_t i = 0; i < x.size(); ++i)
+            {
+                carry += uint64_t(x[i]) + (i < y.size() ? y[i] : 0);
+                r[i] = static_cast<uint32_t>(carry);
+                carry >>= 32;
+            }
+            r[x.size()] = static_cast<uint32_t>(carry);
+            return r;
+        }
+
+        // a - b, requires a >= b
+        static Mag magSub(const Mag& a, const Mag& b)
+        {
+            Mag r(a.size());
+            int64_t borrow = 0;
+
+            for(size_t i = 0; i < a.size(); ++i)
+            {
+                int64_t t = int64_t(a[i]) - (i < b.size() ? b[i] : 0) - borrow;
+                borrow = t < 0;
+                r[i] = static_cast<uint32_t>(t);
+            }
+            return r;
+        }
+
+        static Mag magMul(const Mag& a, const Mag& b)
+        {
+            Mag r(a.size() + b.size());
+
+            for(size_t i = 0; i < a.size(); ++i)
+            {
+                uint64_t carry = 0;
+                for(size_t j = 0; j < b.size(); ++j)
+                {
+                    carry += uint64_t(a[i]) * b[j] + r[i + j];
+                    r[i + j] = static_cast<uint32_t>(carry);
+                    carry >>= 32;
+                }
+                r[i + b.size()] = static_cast<uint32_t>(carry);
+            }
+            return r;
+        }
+
+        static uint32_t magDivSmall(Mag& a, uint32_t d)
+        {
+            uint64_t rem = 0;
+            for(size_t i = a.size(); i-- > 0;)
+            {
+                uint64_t cur = (rem << 32) | a[i];
+                a[i] = static_cast<uint32_t>(cur / d);
+                rem = cur % d;
+            }
+            while(!a.empty() && a.back() == 0) a.pop_back();
+            return static_cast<uint32_t>(rem);
+        }
+
+        // ----------------------------
+        // Long division, Knuth's algorithm D
+        // ----------------------------
+        static void magDivMod(const Mag& u, const Mag& v, Mag& q, Mag& r)
+        {
+            if(magCompare(u, v) < 0) { q.clear(); r = u; return; }
+
+            if(v.size() == 1)
+            {
+                q = u;
+                r = {magDivSmall(q, v[0])};
+                return;
+            }
+
+            size_t n = v.size(), m = u.size() - n;
+            int s = __builtin_clz(v.back());
+
+            Mag vn(n), un(u.size() + 1);
+            for(size_t i = n - 1; i > 0; --i)
+                vn[i] = (v[i] << s) | (s ? uint32_t(uint64_t(v[i - 1]) >> (32 - s)) : 0);
+            vn[0] = v[0] << s;
+
+            un[u.size()] = s ? uint32_t(uint64_t(u.back()) >> (32 - s)) : 0;
+            for(size_t i = u.size() - 1; i > 0; --i)
+                un[i] = (u[i] << s) | (s ? uint32_t(uint64_t(u[i - 1]) >> (32 - s)) : 0);
+            un[0] = u[0] << s;
+
+            q.assign(m + 1, 0);
+            const uint64_t base = uint64_t(1) << 32;
+
+            for(size_t j = m + 1; j-- > 0;)
+            {
+                uint64_t num = (uint64_t(un[j + n]) << 32) | un[j + n - 1];
+                uint64_t qhat = num / vn[n - 1];
+                uint64_t rhat = num % vn[n - 1];
+
+                while(qhat >= base || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2]))
+                {
+                    --qhat;
+                    rhat += vn[n - 1];
+                    if(rhat >= base) break;
+                }
+
+                int64_t borrow = 0, t;
+                for(size_t i = 0; i < n; ++i)
+                {
+                    uint64_t p = qhat * vn[i];
+                    t = int64_t(un[i + j]) - borrow - int64_t(p & 0xFFFFFFFFu);
+                    un[i + j] = static_cast<uint32_t>(t);
+                    borrow = int64_t(p >> 32) - (t >> 32);
+                }
+                t = int64_t(un[j + n]) - borrow;
+                un[j + n] = static_cast<uint32_t>(t);
+
+                q[j] = static_cast<uint32_t>(qhat);
+
+                if(t < 0)
+                {
+                    --q[j];
+                    uint64_t carry = 0;
+                    for(size_t i = 0; i < n; ++i)
+                    {
+                        carry += uint64_t(un[i + j]) + vn[i];
+                        un[i + j] = static_cast<uint32_t>(carry);
+                        carry >>= 32;
+                    }
+                    un[j + n] += static_cast<uint32_t>(carry);
+                }
+            }
+
+            r.assign(n, 0);
+            for(size_t i = 0; i < n; ++i)
+                r[i] = (un[i] >> s) | (s ? uint32_t(uint64_t(un[i + 1]) << (32 - s)) : 0);
+        }
+
+        static BigInt addSigned(bool an, const Mag& a, bool bn, const Mag& b)
+        {
+            if(an == bn) return fromMag(an, magAdd(a, b));
+
+            int c = magCompare(a, b);
+            if(c == 0) return BigInt();
+            return c > 0 ? fromMag(an, magSub(a, b)) : fromMag(bn, magSub(b, a));
+        }
+
+        static int ctz128(u128 u)
+        {
+            uint64_t lo = static_cast<uint64_t>(u);
+            return lo ? __builtin_ctzll(lo) : 64 + __builtin_ctzll(static_cast<uint64_t>(u >> 64));
+        }
+
+        static int bitLength(u128 u)
+        {
+            uint64_t hi = static_cast<uint64_t>(u >> 64), lo = static_cast<uint64_t>(u);
+            return hi ? 128 - __builtin_clzll(hi) : lo ? 64 - __builtin_clzll(lo) : 0;
+        }
+
+    public:
+        BigInt() = default;
+        BigInt(long long v) : small(v) {}
+        BigInt(__int128 v) : small(v)
+        {
+            if(v == std::numeric_limits<__int128>::min())
+                *this = fromMag(true, Mag{0, 0, 0, 0x80000000u});
+        }
+
+        bool isSmall() const { return limbs.empty(); }
+        __int128 smallValue() const { return small; }
+        bool isZero() const { return limbs.empty() && small == 0; }
+        bool isNegative() const { return limbs.empty() ? small < 0 : negative; }
+        int sign() const { return isZero() ? 0 : isNegative() ? -1 : 1; }
+
+        BigInt operator-() const
+        {
+            BigInt r = *this;
+            if(r.limbs.empty()) r.small = -r.small;
+            else r.negative = !r.negative;
+            return r;
+        }
+
+        BigInt abs() const { return isNegative() ? -*this : *this; }
+
+        friend BigInt operator+(const BigInt& a, const BigInt& b)
+        {
+            __int128 r;
+            if(a.isSmall() && b.isSmall() && !__builtin_add_overflow(a.small, b.small, &r) && r != std::numeric_limits<__int128>::min())
+                return BigInt(r);
+            return addSigned(a.isNegative(), a.magnitude(), b.isNegative(), b.magnitude());
+        }
+
+        friend BigInt operator-(const BigInt& a, const BigInt& b)
+        {
+            __int128 r;
+            if(a.isSmall() && b.isSmall() && !__builtin_sub_overflow(a.small, b.small, &r) && r != std::numeric_limits<__int128>::min())
+                return BigInt(r);
+            return addSigned(a.isNegative(), a.magnitude(), !b.isNegative(), b.magnitude());
+        }
+
+        friend BigInt operator*(const BigInt& a, const BigInt& b)
+        {
+            __int128 r;
+            if(a.isSmall() && b.isSmall() && !__builtin_mul_overflow(a.small, b.small, &r) && r != std::numeric_limits<__int128>::min())
+                return BigInt(r);
+            return fromMag(a.isNegative() != b.isNegative(), magMul(a.magnitude(), b.magnitude()));
+        }
+
+        // Truncating division; the remainder takes the sign of a
+        static void divMod(const BigInt& a, const BigInt& b, BigInt& q, BigInt& r)
+        {
+            if(b.isZero())
+                throw std::runtime_error("Division by zero!");
+
+            if(a.isSmall() && b.isSmall())
+            {
+                q = BigInt(a.small / b.small);
+                r = BigInt(a.small % b.small);
+                return;
+            }
+
+            Mag qm, rm;
+            magDivMod(a.magnitude(), b.magnitude(), qm, rm);
+            q = fromMag(a.isNegative() != b.isNegative(), std::move(qm));
+            r = fromMag(a.isNegative(), std::move(rm));
+        }
+
+        friend BigInt operator/(const BigInt& a, const BigInt& b) { BigInt q, r; divMod(a, b, q, r); return q; }
+        friend BigInt operator%(const BigInt& a, const BigInt& b) { BigInt q, r; divMod(a, b, q, r); return r; }
+
+        static int compare(const BigInt& a, const BigInt& b)
+        {
+            if(a.isSmall() && b.isSmall()) return a.small < b.small ? -1 : a.small > b.small ? 1 : 0;
+            if(a.isNegative() != b.isNegative()) return a.isNegative() ? -1 : 1;
+
+            int c = magCompare(a.magnitude(), b.magnitude());
+            return a.isNegative() ? -c : c;
+        }
+
+        friend bool operator==(const BigInt& a, const BigInt& b) { return compare(a, b) == 0; }
+        friend bool operator!=(const BigInt& a, const BigInt& b) { return compare(a, b) != 0; }
+        friend bool operator<(const BigInt& a, const BigInt& b) { return compare(a, b) < 0; }
+        friend bool operator>(const BigInt& a, const BigInt& b) { return compare(a, b) > 0; }
+
+        // 10^n, from a table while it fits in __int128
+        static BigInt pow10(int n)
+        {
+            static const auto table = []()
+            {
+                std::array<__int128, 39> t{};
+                t[0] = 1;
+                for(int i = 1; i < 39; ++i) t[i] = t[i - 1] * 10;
+                return t;
+            }();
+
+            if(n < 39) return BigInt(table[n]);
+            return pow10(38) * pow10(n - 38);
+        }
+
+        // Number of decimal digits of |v| (1 for zero)
+        int digits10() const
+        {
+            int bits = isSmall() ? bitLength(absSmall(small)) : int(limbs.size() - 1) * 32 + 32 - __builtin_clz(limbs.back());
+            int d = (bits * 1233 >> 12) + 1;
+
+            if(isSmall())
+                return (d > 1 && absSmall(small) < static_cast<u128>(pow10(d - 1).small)) ? d - 1 : d;
+
+            return magCompare(limbs, pow10(d - 1).magnitude()) < 0 ? d - 1 : d;
+        }
+
+        // ----------------------------
+        // Greatest common divisor, always non-negative
+        // Binary (Stein's) gcd on the inline path; Euclid steps on limbs
+        // until both values fit inline
+        // ----------------------------
+        static BigInt gcd(BigInt a, BigInt b)
+        {
+            a = a.abs();
+            b = b.abs();
+
+            while(!a.isSmall() || !b.isSmall())
+            {
+                if(b.isZero()) return a;
+                BigInt r = a % b;
+                a = std::move(b);
+                b = std::move(r);
+            }
+
+            u128 x = static_cast<u128>(a.small), y = static_cast<u128>(b.small);
+            if(x == 0) return b;
+            if(y == 0) return a;
+
+            int shift = ctz128(x | y);
+            x >>= ctz128(x);
+
+            do
+            {
+                y >>= ctz128(y);
+                if(x > y) std::swap(x, y);
+                y -= x;
+            } while(y != 0);
+
+            return BigInt(static_cast<__int128>(x << shift));
+        }
+
+        static BigInt fromString(std::string_view digits)
+        {
+            BigInt r;
+            size_t i = 0;
+
+            while(i < digits.size())
+            {
+                size_t len = std::min<size_t>(18, digits.size() - i);
+                long long chunk = 0;
+                for(size_t k = 0; k < len; ++k) chunk = chunk * 10 + (digits[i + k] - '0');
+
+                r = r * pow10(int(len)) + BigInt(chunk);
+                i += len;
+            }
+            return r;
+        }
+
+        std::string toString() const
+        {
+            std::string s;
+
+            if(isSmall())
+            {
+                u128 u = absSmall(small);
+                do { s += char('0' + int(u % 10)); u /= 10; } while(u);
+            }
+            else
+            {
+                Mag m = limbs;
+                while(!m.empty())
+                {
+                    uint32_t chunk = magDivSmall(m, 1000000000u);
+                    for(int k = 0; k < 9 && (chunk || !m.empty()); ++k) { s += char('0' + chunk % 10); chunk /= 10; }
+                }
+            }
+
+            if(isNegative()) s += '-';
+            std::reverse(s.begin(), s.end());
+            return s;
+        }
+
+        double toDouble() const
+        {
+            if(isSmall()) return static_cast<double>(small);
+
+            double r = 0;
+            for(size_t i = limbs.size(); i-- > 0;) r = r * 4294967296.0 + limbs[i];
+            return negative ? -r : r;
+        }
+};
+
+// ----------------------------
+// Decimal arithmetic: value = coef * 10^exp
+// Every result is rounded to `precision` significant digits
+// ----------------------------
+struct Decimal
+{
+    BigInt coef;
+    int exp = 0;
+};
+
+enum class Rounding {HALF_EVEN, HALF_UP, HALF_DOWN, DOWN, UP, CEILING, FLOOR};
+
+struct DecimalContext
+{
+    int precision = 28;
+    Rounding rounding = Rounding::HALF_EVEN;
+};
+
+class DecimalArith
+{
+    private:
+        DecimalContext ctx;
+
+        // Should a dropped remainder bump the kept digits away from zero?
+        // cmpHalf: remainder compared to half of the dropped unit
+        bool roundsAway(bool negative, int cmpHalf, bool inexact, bool lastOdd) const
+        {
+            if(!inexact) return false;
+
+            switch(ctx.rounding)
+            {
+                case Rounding::HALF_EVEN: return cmpHalf > 0 || (cmpHalf == 0 && lastOdd);
+                case Rounding::HALF_UP:   return cmpHalf >= 0;
+                case Rounding::HALF_DOWN: return cmpHalf > 0;
+                case Rounding::DOWN:      return false;
+                case Rounding::UP:        return true;
+                case Rounding::CEILING:   return !negative;
+                case Rounding::FLOOR:     return negative;
+            }
+            return false;
+        }
+
+        Decimal round(Decimal d, int precision) const
+        {
+            int digits = d.coef.digits10();
+            if(digits <= precision) return d;
+
+            int drop = digits - precision;
+            BigInt unit = BigInt::pow10(drop), q, r;
+            BigInt::divMod(d.coef, unit, q, r);
+
+            bool negative = d.coef.isNegative();
+            BigInt twice = r.abs() * BigInt(2LL);
+            int cmpHalf = BigInt::compare(twice, unit);
+            bool lastOdd = !(q % BigInt(2LL)).isZero();
+
+            if(roundsAway(negative, cmpHalf, !r.isZero(), lastOdd))
+                q = q + BigInt(negative ? -1LL : 1LL);
+
+            d.coef = std::move(q);
+            d.exp += drop;
+
+            // 999.5 -> 1000: one digit too many after the carry
+            if(d.coef.digits10() > precision)
+            {
+                d.coef = d.coef / BigInt(10LL);
+                d.exp += 1;
+            }
+            return d;
+        }
+
+        Decimal round(Decimal d) const { return round(std::move(d), ctx.precision); }
+
+        static void align(const Decimal& x, const Decimal& y, BigInt& a, BigInt& b, int& exp)
+        {
+            exp = std::min(x.exp, y.exp);
+            a = x.exp > exp ? x.coef * BigInt::pow10(x.exp - exp) : x.coef;
+            b = y.exp > exp ? y.coef * BigInt::pow10(y.exp - exp) : y.coef;
+        }
+
+        Decimal divide(const Decimal& x, const Decimal& y, int precision) const
+        {
+            if(y.coef.isZero())
+                throw std::runtime_error("Division by zero!");
+
+            if(x.coef.isZero()) return Decimal{};
+
+            // Scale so the quotient carries at least precision + 1 digits,
+            // then fold a non-zero remainder into one sticky digit
+            int k = std::max(0, precision + y.coef.digits10() - x.coef.digits10() + 1);
+            BigInt q, r;
+            BigInt::divMod(x.coef * BigInt::pow10(k), y.coef, q, r);
+
+            Decimal d;
+            long long sticky = r.isZero() ? 0 : x.coef.isNegative() != y.coef.isNegative() ? -1 : 1;
+            d.coef = q * BigInt(10LL) + BigInt(sticky);
+            d.exp = x.exp - y.exp - k - 1;
+            return round(std::move(d), precision);
+        }
+
+        bool isInteger(const Decimal& d) const
+        {
+            return d.exp >= 0 || (d.coef % BigInt::pow10(-d.exp)).isZero();
+        }
+
+        Decimal power(const Decimal& x, const Decimal& y) const
+        {
+            if(isInteger(y) && y.exp <= 18 && y.coef.digits10() + y.exp <= 18)
+            {
+                BigInt n = y.exp >= 0 ? y.coef * BigInt::pow10(y.exp) : y.coef / BigInt::pow10(-y.exp);
+                long long e = static_cast<long long>(n.smallValue());
+                bool invert = e < 0;
+                unsigned long long u = invert ? -static_cast<unsigned long long>(e) : e;
+
+                // Square-and-multiply with enough guard digits to absorb
+                // one rounding per step, then one final rounding
+                int work = ctx.precision + n.digits10() + 3;
+                Decimal result{BigInt(1LL), 0}, base = x;
+
+                while(u)
+                {
+                    if(u & 1) result = round(Decimal{result.coef * base.coef, result.exp + base.exp}, work);
+                    u >>= 1;
+                    if(u) base = round(Decimal{base.coef * base.coef, base.exp * 2}, work);
+                }
+
+                if(invert) return divide(Decimal{BigInt(1LL), 0}, result, ctx.precision);
+                return round(std::move(result));
+            }
+
+            // Fractional exponent: no exact decimal result exists,
+            // go through double and round to the context
+            double r = std::pow(toDouble(x), toDouble(y));
+            if(!std::isfinite(r))
+                throw std::runtime_error("Invalid decimal power: result is not a finite number.");
+
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.17e", r);
+            return round(parse(buf));
+        }
+
+    public:
+        using Num = Decimal;
+
+        explicit DecimalArith(DecimalContext c) : ctx(c) {}
+
+        // Parses digits with an optional '.' and optional e[+-]digits
+        static Decimal parse(std::string_view text)
+        {
+            std::string digits;
+            int exp = 0;
+            bool negative = false, afterPoint = false;
+            size_t i = 0;
+
+            if(!text.empty() && text[0] == '[')
+                throw std::runtime_error("Interval literals need 'mode interval'.");
+
+            if(i < text.size() && (text[i] == '-' || text[i] == '+')) negative = text[i++] == '-';
+
+            for(; i < text.size() && text[i] != 'e' && text[i] != 'E'; ++i)
+            {
+                if(text[i] == '.') { afterPoint = true; continue; }
+                digits += text[i];
+                if(afterPoint) --exp;
+            }
+
+            if(i < text.size()) exp += std::stoi(std::string(text.substr(i + 1)));
+
+            Decimal d{BigInt::fromString(digits), exp};
+            if(negative) d.coef = -d.coef;
+            return d;
+        }
+
+        static double toDouble(const Decimal& d)
+        {
+            return d.coef.toDouble() * std::pow(10.0, d.exp);
+        }
+
+        Decimal literal(std::string_view text, double) const { return parse(text); }
+
+        Decimal constant(double v) const
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.17e", v);
+            return parse(buf);
+        }
+
+        Decimal negate(const Decimal& x) const { return Decimal{-x.coef, x.exp}; }
+
+        // abs, min and max stay exact; everything else goes through double
+        Decimal call(const BuiltinFunction& fn, const Decimal* args) const
+        {
+            switch(fn.id)
+            {
+                case BuiltinFunction::ABS: return args[0].coef.isNegative() ? negate(args[0]) : args[0];
+                case BuiltinFunction::MIN:
+                case BuiltinFunction::MAX:
+                {
+                    BigInt a, b;
+                    int exp;
+                    align(args[0], args[1], a, b, exp);
+                    return (a < b) == (fn.id == BuiltinFunction::MIN) ? args[0] : args[1];
+                }
+                default: break;
+            }
+
+            double in[2] = {toDouble(args[0]), fn.arity > 1 ? toDouble(args[1]) : 0};
+            double r = fn.scalar(in);
+            if(!std::isfinite(r))
+                throw std::runtime_error(std::string("Invalid decimal argument for ") + fn.name + ".");
+
+            return round(constant(r));
+        }
+
+        // x% is exact in decimal: shift the exponent
+        Decimal percent(const Decimal& x) const { return Decimal{x.coef, x.exp - 2}; }
+
+        Decimal apply(const Decimal& x, const Decimal& y, char op) const
+        {
+            BigInt a, b;
+            int exp;
+
+            switch(op)
+            {
+                case '+': align(x, y, a, b, exp); return round(Decimal{a + b, exp});
+                case '-': align(x, y, a, b, exp); return round(Decimal{a - b, exp});
+                case '*': return round(Decimal{x.coef * y.coef, x.exp + y.exp});
+                case '/': return divide(x, y, ctx.precision);
+                case '^': return power(x, y);
+                default:
+                    if(!isComparison(op))
+                        throw std::runtime_error(std::string("Unknown operator: ") + op);
+
+                    align(x, y, a, b, exp);
+                    return Decimal{BigInt(compareResult(a < b ? -1 : a == b ? 0 : 1, op) ? 1LL : 0LL), 0};
+            }
+        }
+
+        bool truth(const Decimal& x) const { return !x.coef.isZero(); }
+
+        // Range bounds of sum(i, from, to, ...) and friends
+        double integer(const Decimal& x) const
+        {
+            if(!isInteger(x)) throw std::runtime_error("Range bounds must be integers.");
+            return toDouble(x);
+        }
+
+        // Plain notation with trailing zeros removed, scientific for huge exponents
+        static std::string format(Decimal d)
+        {
+            if(d.coef.isZero()) return "0";
+
+            while(d.exp < 0 && (d.coef % BigInt(10LL)).isZero())
+            {
+                d.coef = d.coef / BigInt(10LL);
+                ++d.exp;
+            }
+
+            std::string digits = d.coef.abs().toString();
+            std::string sign = d.coef.isNegative() ? "-" : "";
+            int adjusted = int(digits.size()) - 1 + d.exp;
+
+            if(adjusted > 40 || adjusted < -40)
+            {
+                std::string s = sign + digits.substr(0, 1);
+                if(digits.size() > 1) s += "." + digits.substr(1);
+                return s + "E" + (adjusted > 0 ? "+" : "") + std::to_string(adjusted);
+            }
+
+            if(d.exp >= 0) return sign + digits + std::string(d.exp, '0');
+
+            size_t point = -d.exp;
+            if(digits.size() <= point) return sign + "0." + std::string(point - digits.size(), '0') + digits;
+            return sign + digits.substr(0, digits.size() - point) + "." + digits.substr(digits.size() - point);
+        }
+};
+
+// ----------------------------
+// Exact rational arithmetic: num / den, den > 0, always reduced
+// Numerator and denominator are BigInts, so they stay in __int128
+// until an operation overflows
+// ----------------------------
+struct Rational
+{
+    BigInt num;
+    BigInt den = BigInt(1LL);
+};
+
+class RationalArith
+{
+    private:
+        static Rational reduce(BigInt num, BigInt den)
+        {
+            if(den.isZero())
+                throw std::runtime_error("Division by zero!");
+
+            if(den.isNegative()) { num = -num; den = -den; }
+
+            BigInt g = BigInt::gcd(num, den);
+            if(g != BigInt(1LL)) { num = num / g; den = den / g; }
+            return Rational{std::move(num), std::move(den)};
+        }
+
+        // a/b + c/d with the gcd of the denominators divided out first,
+        // which keeps intermediates small (Knuth 4.5.1)
+        static Rational add(const Rational& x, const Rational& y)
+        {
+            BigInt g = BigInt::gcd(x.den, y.den);
+
+            if(g == BigInt(1LL))
+                return Rational{x.num * y.den + y.num * x.den, x.den * y.den};
+
+            BigInt t = x.num * (y.den / g) + y.num * (x.den / g);
+            BigInt g2 = BigInt::gcd(t, g);
+
+            if(g2 == BigInt(1LL))
+                return Rational{std::move(t), (x.den / g) * y.den};
+            return Rational{t / g2, (x.den / g) * (y.den / g2)};
+        }
+
+        // Cross-cancel before multiplying so no final gcd is needed
+        static Rational multiply(const Rational& x, const Rational& y)
+        {
+            if(x.num.isZero() || y.num.isZero()) return Rational{};
+
+            BigInt g1 = BigInt::gcd(x.num, y.den);
+            BigInt g2 = BigInt::gcd(y.num, x.den);
+
+            return Rational{(x.num / g1) * (y.num / g2), (x.den / g2) * (y.den / g1)};
+        }
+
+        static Rational invert(const Rational& x)
+        {
+            if(x.num.isZero())
+                throw std::runtime_error("Division by zero!");
+
+            return x.num.isNegative() ? Rational{-x.den, -x.num} : Rational{x.den, x.num};
+        }
+
+        static BigInt power(BigInt base, unsigned long long e)
+        {
+            BigInt result(1LL);
+
+            while(e)
+            {
+                if(e & 1) result = result * base;
+                e >>= 1;
+                if(e) base = base * base;
+            }
+            return result;
+        }
+
+        static Rational power(const Rational& x, const Rational& y)
+        {
+            if(y.den == BigInt(1LL) && y.num.isSmall())
+            {
+                __int128 e = y.num.smallValue();
+                unsigned __int128 u = e < 0 ? -static_cast<unsigned __int128>(e) : e;
+
+                if(x.num.isZero() && e < 0)
+                    throw std::runtime_error("Division by zero!");
+
+                bool trivial = x.den == BigInt(1LL) && (x.num.abs() == BigInt(1LL) || x.num.isZero());
+                if(!trivial && u * std::max(x.num.digits10(), x.den.digits10()) > 1000000)
+                    throw std::runtime_error("Exponent too large for an exact rational result.");
+
+                // 0, 1 and -1 only need the parity of the exponent
+                unsigned long long n = trivial && u > 2 ? 2 + static_cast<unsigned long long>(u & 1) : static_cast<unsigned long long>(u);
+
+                // Powers of coprime numbers stay coprime: no reduction needed
+                Rational r{power(x.num, n), power(x.den, n)};
+                return e < 0 ? invert(r) : r;
+            }
+
+            // Fractional exponent: no exact rational result in general,
+            // go through double
+            double r = std::pow(toDouble(x), toDouble(y));
+            if(!std::isfinite(r))
+                throw std::runtime_error("Invalid rational power: result is not a finite number.");
+
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.17e", r);
+            return parse(buf);
+        }
+
+    public:
+        using Num = Rational;
+
+        // Digits with an optional '.' and optional e[+-]digits
+        static Rational parse(std::string_view text)
+        {
+            Decimal d = DecimalArith::parse(text);
+
+            if(d.exp >= 0) return Rational{d.coef * BigInt::pow10(d.exp), BigInt(1LL)};
+            return reduce(std::move(d.coef), BigInt::pow10(-d.exp));
+        }
+
+        static double toDouble(const Rational& x)
+        {
+            return x.num.toDouble() / x.den.toDouble();
+        }
+
+        Rational literal(std::string_view text, double) const { return parse(text); }
+
+        Rational constant(double v) const
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.17e", v);
+            return parse(buf);
+        }
+
+        Rational negate(const Rational& x) const { return Rational{-x.num, x.den}; }
+
+        // abs, min and max stay exact; everything else goes through double
+        Rational call(const BuiltinFunction& fn, const Rational* args) const
+        {
+            switch(fn.id)
+            {
+                case BuiltinFunction::ABS: return args[0].num.isNegative() ? negate(args[0]) : args[0];
+                case BuiltinFunction::MIN:
+                case BuiltinFunction::MAX:
+                {
+                    bool less = args[0].num * args[1].den < args[1].num * args[0].den;
+                    return less == (fn.id == BuiltinFunction::MIN) ? args[0] : args[1];
+                }
+                default: break;
+            }
+
+            double in[2] = {toDouble(args[0]), fn.arity > 1 ? toDouble(args[1]) : 0};
+            double r = fn.scalar(in);
+            if(!std::isfinite(r))
+                throw std::runtime_error(std::string("Invalid rational argument for ") + fn.name + ".");
+
+            return constant(r);
+        }
+        Rational percent(const Rational& x) const { return multiply(x, Rational{BigInt(1LL), BigInt(100LL)}); }
+
+        Rational apply(const Rational& x, const Rational& y, char op) const
+        {
+            switch(op)
+            {
+                case '+': return add(x, y);
+                case '-': return add(x, negate(y));
+                case '*': return multiply(x, y);
+                case '/': return multiply(x, invert(y));
+                case '^': return power(x, y);
+                default:
+                {
+                    if(!isComparison(op))
+                        throw std::runtime_error(std::string("Unknown operator: ") + op);
+
+                    // Denominators are positive, so cross-multiplying keeps the order
+                    BigInt a = x.num * y.den, b = y.num * x.den;
+                    return Rational{BigInt(compareResult(a < b ? -1 : a == b ? 0 : 1, op) ? 1LL : 0LL), BigInt(1LL)};
+                }
+            }
+        }
+
+        bool truth(const Rational& x) const { return !x.num.isZero(); }
+
+        // Range bounds of sum(i, from, to, ...) and friends
+        double integer(const Rational& x) const
+        {
+            if(x.den != BigInt(1LL)) throw std::runtime_error("Range bounds must be integers.");
+            return x.num.toDouble();
+        }
+
+        static std::string format(const Rational& x)
+        {
+            if(x.den == BigInt(1LL)) return x.num.toString();
+            return x.num.toString() + "/" + x.den.toString();
+        }
+};
+
+// strtod on [p, end), which needs a terminated copy
+const char* parseDoubleSlow(const char* p, const char* end, double& out)
+{
+    std::string text(p, end);
+    char* stop;
+    out = strtod(text.c_str(), &stop);
+    return stop == text.c_str() ? nullptr : p + (stop - text.c_str());
+}
+
+// ----------------------------
+// Fast decimal to double. The digits go into a 64-bit integer and
+// the result is one multiply or divide by an exact power of ten;
+// when both are exact (mantissa < 2^53, |exponent| <= 22) that
+// rounds exactly like strtod. Anything else (long mantissas, huge
+// exponents, inf, nan) goes to strtod. Returns the end of the
+// number, or nullptr if [p, end) does not start with one
+// ----------------------------
+const char* parseDouble(const char* p, const char* end, double& out)
+{
+    static const double pow10[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    const char* start = p;
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    // Up to 19 digits cannot overflow; more (rare) go to strtod
+    uint64_t mantissa = 0;
+    const char* first = p;
+    for(; p < end && unsigned(*p - '0') < 10; ++p) mantissa = mantissa * 10 + (*p - '0');
+    int digits = int(p - first), exponent = 0;
+
+    if(p < end && *p == '.')
+    {
+        first = ++p;
+        for(; p < end && unsigned(*p - '0') < 10; ++p) mantissa = mantissa * 10 + (*p - '0');
+        exponent = -int(p - first);
+        digits += int(p - first);
+    }
+
+    if(digits > 0 && p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p + 1;
+        bool minus = false;
+        if(q < end && (*q == '-' || *q == '+')) minus = *q++ == '-';
+
+        int e = 0;
+        const char* digitsAt = q;
+        for(; q < end && unsigned(*q - '0') < 10; ++q) e = std::min(e * 10 + (*q - '0'), 100000);
+
+        if(q > digitsAt)
+        {
+            exponent += minus ? -e : e;
+            p = q;
+        }
+    }
+
+    if(digits > 0 && digits <= 19 && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double v = double(mantissa);
+        v = exponent < 0 ? v / pow10[-exponent] : v * pow10[exponent];
+        out = negative ? -v : v;
+        return p;
+    }
+
+    return parseDoubleSlow(start, end, out);
+}
+
+// ----------------------------
+// One bound of an interval literal [lo, hi]: a number as the lexer
+// reads one (digits with at most one '.'), perhaps with a leading
+// '-', and spaces around it. Nothing else: no exponent, inf or nan,
+// which no other literal takes either
+// ----------------------------
+bool parseBound(std::string_view text, double& out)
+{
+    auto space = [](char c) { return c == ' ' || (c >= '\t' && c <= '\r'); };
+    while(!text.empty() && space(text.front())) text.remove_prefix(1);
+    while(!text.empty() && space(text.back())) text.remove_suffix(1);
+
+    std::string_view number = text.substr(!text.empty() && text[0] == '-');
+    if(number.find_first_not_of("0123456789.") != std::string_view::npos ||
+       number.find_first_of("0123456789") == std::string_view::npos || std::count(number.begin(), number.end(), '.') > 1)
+        return false;
+
+    parseDouble(text.data(), text.data() + text.size(), out);
+    return true;
+}
+
+// ----------------------------
+// Interval arithmetic: every result encloses the exact value
+// Operations round to nearest and then step each bound one ulp
+// outward, which bounds a correctly rounded result without
+// switching the FPU rounding mode
+// ----------------------------
+struct Interval
+{
+    double lo = 0, hi = 0;
+};
+
+class IntervalArith
+{
+    private:
+        static constexpr double inf = std::numeric_limits<double>::infinity();
+
+        static double nextUp(double x)
+        {
+            if(x != x || x == inf) return x;
+            if(x == 0) return std::numeric_limits<double>::denorm_min();
+
+            uint64_t bits;
+            memcpy(&bits, &x, sizeof(bits));
+            bits += x > 0 ? 1 : -1;
+            memcpy(&x, &bits, sizeof(bits));
+            return x;
+        }
+
+        static double nextDown(double x) { return -nextUp(-x); }
+
+        static Interval outward(double lo, double hi) { return Interval{nextDown(lo), nextUp(hi)}; }
+
+        static bool containsZero(const Interval& x) { return x.lo <= 0 && x.hi >= 0; }
+
+        // ----------------------------
+        // Hull of the four corner products, min/max two lanes at a time.
+        // A corner with a zero factor is 0, also against an infinite
+        // bound: 0 * inf would be NaN, and min/max would then pick a
+        // side by operand order
+        // ----------------------------
+        static Interval multiply(const Interval& x, const Interval& y)
+        {
+            if((x.lo == 0 && x.hi == 0) || (y.lo == 0 && y.hi == 0)) return Interval{};
+
+#ifdef __SSE2__
+            __m128d ys = _mm_set_pd(y.hi, y.lo), zero = _mm_setzero_pd(), yZero = _mm_cmpeq_pd(ys, zero);
+            auto corners = [&](double xb)
+            {
+                __m128d xs = _mm_set1_pd(xb);
+                return _mm_andnot_pd(_mm_or_pd(yZero, _mm_cmpeq_pd(xs, zero)), _mm_mul_pd(xs, ys));
+            };
+            __m128d a = corners(x.lo), b = corners(x.hi);
+            __m128d mn = _mm_min_pd(a, b), mx = _mm_max_pd(a, b);
+            mn = _mm_min_sd(mn, _mm_unpackhi_pd(mn, mn));
+            mx = _mm_max_sd(mx, _mm_unpackhi_pd(mx, mx));
+            return outward(_mm_cvtsd_f64(mn), _mm_cvtsd_f64(mx));
+#else
+            auto corner = [](double u, double v) { return u == 0 || v == 0 ? 0.0 : u * v; };
+            double a = corner(x.lo, y.lo), b = corner(x.lo, y.hi), c = corner(x.hi, y.lo), d = corner(x.hi, y.hi);
+            return outward(std::min(std::min(a, b), std::min(c, d)), std::max(std::max(a, b), std::max(c, d)));
+#endif
+        }
+
+        // ----------------------------
+        // Division, including divisors that touch or contain zero
+        // A divisor with zero strictly inside gives the whole line
+        // ----------------------------
+        static Interval divide(const Interval& x, const Interval& y)
+        {
+            if(y.lo == 0 && y.hi == 0)
+                throw std::runtime_error("Division by zero!");
+
+            if(!containsZero(y))
+            {
+                Interval r = multiply(x, Interval{1.0 / y.hi, 1.0 / y.lo});
+
+                // 1/y was rounded too: widen once more
+                return outward(r.lo, r.hi);
+            }
+
+            if(containsZero(x) || (y.lo < 0 && y.hi > 0)) return Interval{-inf, inf};
+
+            // y = [0, b] or [a, 0]
+            if(y.lo == 0) return x.lo > 0 ? Interval{nextDown(x.lo / y.hi), inf} : Interval{-inf, nextUp(x.hi / y.hi)};
+            return x.lo > 0 ? Interval{-inf, nextUp(x.lo / y.lo)} : Interval{nextDown(x.hi / y.lo), inf};
+        }
+
+        // ----------------------------
+        // x^y: integer exponents follow the parity of n,
+        // otherwise the base must be non-negative and the
+        // extremes sit on the corners
+        // ----------------------------
+        static Interval power(const Interval& x, const Interval& y)
+        {
+            // std::pow is not correctly rounded: allow two ulps
+            auto widen = [](double lo, double hi) { return outward(nextDown(lo), nextUp(hi)); };
+
+            if(y.lo == y.hi && y.lo == std::floor(y.lo) && std::fabs(y.lo) < 9007199254740992.0)
+            {
+                double n = y.lo;
+                if(n == 0) return Interval{1, 1};
+
+                Interval r;
+                double m = std::fabs(n);
+                bool even = std::fmod(m, 2.0) == 0;
+
+                if(!even) r = widen(std::pow(x.lo, m), std::pow(x.hi, m));
+                else if(containsZero(x)) r = Interval{0, widen(0, std::pow(std::max(-x.lo, x.hi), m)).hi};
+                else r = widen(std::pow(std::min(std::fabs(x.lo), std::fabs(x.hi)), m), std::pow(std::max(std::fabs(x.lo), std::fabs(x.hi)), m));
+
+                // Even powers and powers of non-negative bases never go below zero
+                if(r.lo < 0 && (even || x.lo >= 0)) r.lo = 0;
+                return n < 0 ? divide(Interval{1, 1}, r) : r;
+            }
+
+            if(x.lo < 0)
+                throw std::runtime_error("Invalid interval power: negative base with non-integer exponent.");
+
+            double a = std::pow(x.lo, y.lo), b = std::pow(x.lo, y.hi), c = std::pow(x.hi, y.lo), d = std::pow(x.hi, y.hi);
+            Interval r = widen(std::min(std::min(a, b), std::min(c, d)), std::max(std::max(a, b), std::max(c, d)));
+            if(r.lo < 0) r.lo = 0;
+            return r;
+        }
+
+    public:
+        using Num = Interval;
+
+        // ----------------------------
+        // Short integers are exact doubles; anything else was rounded
+        // by the tokenizer and gets one ulp of slack on each side.
+        // "[lo, hi]" is an uncertain input
+        // ----------------------------
+        static bool exact(std::string_view text)
+        {
+            while(!text.empty() && isspace(static_cast<unsigned char>(text.front()))) text.remove_prefix(1);
+            while(!text.empty() && isspace(static_cast<unsigned char>(text.back()))) text.remove_suffix(1);
+            return text.size() <= 15 && text.find_first_of(".eE") == std::string_view::npos;
+        }
+
+        Interval literal(std::string_view text, double value) const
+        {
+            if(!text.empty() && text[0] == '[')
+            {
+                size_t comma = text.find(',');
+                std::string_view loText = text.substr(1, comma - 1);
+                std::string_view hiText = text.substr(comma + 1, text.size() - comma - 2);
+                double lo = 0, hi = 0;
+                parseBound(loText, lo);
+                parseBound(hiText, hi);
+                return Interval{exact(loText) ? lo : nextDown(lo), exact(hiText) ? hi : nextUp(hi)};
+            }
+
+            if(exact(text)) return Interval{value, value};
+            return outward(value, value);
+        }
+
+        Interval constant(double v) const { return Interval{v, v}; }
+        Interval negate(const Interval& x) const { return Interval{-x.hi, -x.lo}; }
+
+        // ----------------------------
+        // Built-ins: monotone functions map the bounds (libm is not
+        // correctly rounded, so allow two ulps); sin and cos also
+        // check for a peak or trough inside the interval
+        // ----------------------------
+        Interval call(const BuiltinFunction& fn, const Interval* args) const
+        {
+            const Interval& x = args[0];
+            auto widen = [](double lo, double hi) { return outward(nextDown(lo), nextUp(hi)); };
+
+            switch(fn.id)
+            {
+                case BuiltinFunction::SQRT:
+                    if(x.hi < 0)
+                        throw std::runtime_error("Invalid interval argument for sqrt.");
+                {
+                    Interval r = outward(std::sqrt(std::max(x.lo, 0.0)), std::sqrt(x.hi));
+                    return Interval{std::max(r.lo, 0.0), r.hi};
+                }
+
+                case BuiltinFunction::EXP:
+                {
+                    Interval r = widen(std::exp(x.lo), std::exp(x.hi));
+                    return Interval{std::max(r.lo, 0.0), r.hi};
+                }
+
+                case BuiltinFunction::LOG:
+                    if(x.hi <= 0)
+                        throw std::runtime_error("Invalid interval argument for log.");
+                    return x.lo <= 0 ? Interval{-inf, widen(0, std::log(x.hi)).hi} : widen(std::log(x.lo), std::log(x.hi));
+
+                case BuiltinFunction::SIN:
+                case BuiltinFunction::COS:
+                {
+                    const double pi = 3.14159265358979323846;
+                    if(!(x.hi - x.lo < 2 * pi)) return Interval{-1, 1};
+
+                    // peak/trough phases: cos at 0 / pi, sin at pi/2 / -pi/2
+                    double peak = fn.id == BuiltinFunction::COS ? 0 : pi / 2;
+                    double slack = 1e-12 * (1 + std::max(std::fabs(x.lo), std::fabs(x.hi)));
+
+                    auto hits = [&](double phase)
+                    {
+                        double k = std::ceil((x.lo - slack - phase) / (2 * pi));
+                        return phase + k * 2 * pi <= x.hi + slack;
+                    };
+
+                    double a = fn.scalar(&x.lo), b = fn.scalar(&x.hi);
+                    Interval r = widen(std::min(a, b), std::max(a, b));
+                    if(hits(peak)) r.hi = 1;
+                    if(hits(peak - pi)) r.lo = -1;
+                    return Interval{std::max(r.lo, -1.0), std::min(r.hi, 1.0)};
+                }
+
+                case BuiltinFunction::ABS:
+                    if(x.lo >= 0) return x;
+                    if(x.hi <= 0) return negate(x);
+                    return Interval{0, std::max(-x.lo, x.hi)};
+
+                case BuiltinFunction::MIN: return Interval{std::min(x.lo, args[1].lo), std::min(x.hi, args[1].hi)};
+                case BuiltinFunction::MAX: return Interval{std::max(x.lo, args[1].lo), std::max(x.hi, args[1].hi)};
+            }
+            throw std::runtime_error(std::string("Unknown function: ") + fn.name);
+        }
+        Interval percent(const Interval& x) const { return outward(x.lo / 100.0, x.hi / 100.0); }
+
+        Interval apply(const Interval& x, const Interval& y, char op) const
+        {
+            switch(op)
+            {
+                case '+': return outward(x.lo + y.lo, x.hi + y.hi);
+                case '-': return outward(x.lo - y.hi, x.hi - y.lo);
+                case '*': return multiply(x, y);
+                case '/': return divide(x, y);
+                case '^': return power(x, y);
+                default:
+                    if(!isComparison(op))
+                        throw std::runtime_error(std::string("Unknown operator: ") + op);
+                    return compare(x, y, op);
+            }
+        }
+
+        // ----------------------------
+        // A comparison is [1, 1] when it holds for every pair of
+        // points, [0, 0] when it holds for none, else [0, 1]
+        // ----------------------------
+        static Interval compare(const Interval& x, const Interval& y, char op)
+        {
+            auto known = [](bool v) { return v ? Interval{1, 1} : Interval{0, 0}; };
+
+            switch(op)
+            {
+                case '<': if(x.hi < y.lo || x.lo >= y.hi) return known(x.hi < y.lo); break;
+                case 'l': if(x.hi <= y.lo || x.lo > y.hi) return known(x.hi <= y.lo); break;
+                case '>': return compare(y, x, '<');
+                case 'g': return compare(y, x, 'l');
+                case '=':
+                case 'n':
+                    if(x.hi < y.lo || y.hi < x.lo) return known(op == 'n');
+                    if(x.lo == x.hi && y.lo == y.hi) return known(op == '=');
+                    break;
+            }
+            return Interval{0, 1};
+        }
+
+        // Branching needs a definite answer
+        bool truth(const Interval& x) const
+        {
+            if(x.lo > 0 || x.hi < 0) return true;
+            if(x.lo == 0 && x.hi == 0) return false;
+            throw std::runtime_error("Condition is uncertain over " + format(x) + ".");
+        }
+
+        // Range bounds must be definite too
+        double integer(const Interval& x) const
+        {
+            if(x.lo != x.hi) throw std::runtime_error("Range bound is uncertain over " + format(x) + ".");
+            if(std::floor(x.lo) != x.lo) throw std::runtime_error("Range bounds must be integers.");
+            return x.lo;
+        }
+
+        static std::string format(const Interval& x)
+        {
+            char buf[64];
+            int n = snprintf(buf, sizeof(buf), "[%.17g, %.17g]", x.lo, x.hi);
+            return std::string(buf, n);
+        }
+};
+
+// ----------------------------
+// Character classes as the "C" locale (the one in use) has them,
+// one bit each, so a scanner tests a byte with a table load rather
+// than a call into the locale. POINT is '.', for number runs
+// ----------------------------
+namespace chars
+{
+    enum : uint8_t {SPACE = 1, DIGIT = 2, NAME_START = 4, NAME = 8, POINT = 16};
+
+    constexpr std::array<uint8_t, 256> makeTable()
+    {
+        std::array<uint8_t, 256> table{};
+        for(int c : {' ', '\t', '\n', '\v', '\f', '\r'}) table[c] = SPACE;
+        for(int c = '0'; c <= '9'; ++c) table[c] = DIGIT | NAME;
+        for(int c = 'a'; c <= 'z'; ++c) table[c] = table[c - 'a' + 'A'] = NAME_START | NAME;
+        table['_'] = NAME_START | NAME;
+        table['.'] = POINT;
+        return table;
+    }
+
+    inline constexpr std::array<uint8_t, 256> table = makeTable();
+
+    inline bool is(char c, uint8_t cls) { return table[(unsigned char)c] & cls; }
+
+    // ----------------------------
+    // What tokenize() starts on each byte: one lookup picks the
+    // branch, in place of the ctype calls and operator comparisons.
+    // POINT starts a number only when a digit follows
+    // ----------------------------
+    enum class Lex : uint8_t {UNKNOWN, SPACE, DIGIT, POINT, NAME, OPERATOR, MINUS, COMPARE,
+                              PAREN_LEFT, PAREN_RIGHT, COMMA, INTERVAL};
+
+    constexpr std::array<Lex, 256> makeLexTable()
+    {
+        std::array<Lex, 256> lex{};
+        for(int c = 0; c < 256; ++c)
+        {
+            if(table[c] & SPACE) lex[c] = Lex::SPACE;
+            else if(table[c] & DIGIT) lex[c] = Lex::DIGIT;
+            else if(table[c] & NAME_START) lex[c] = Lex::NAME;
+        }
+        for(int c : {'+', '*', '/', '^', '%', '?', ':'}) lex[c] = Lex::OPERATOR;
+        for(int c : {'<', '>', '=', '!', '&', '|'}) lex[c] = Lex::COMPARE;
+        lex['.'] = Lex::POINT;
+        lex['-'] = Lex::MINUS;
+        lex['('] = Lex::PAREN_LEFT;
+        lex[')'] = Lex::PAREN_RIGHT;
+        lex[','] = Lex::COMMA;
+        lex['['] = Lex::INTERVAL;
+        return lex;
+    }
+
+    inline constexpr std::array<Lex, 256> lexTable = makeLexTable();
+
+    inline Lex lex(char c) { return lexTable[(unsigned char)c]; }
+
+    // ----------------------------
+    // The one-char code tokenize() stores for the comparison or
+    // logical operator c followed by next: <= >= == != && || become
+    // l g = n & |, a lone < or > stays itself. 0 when there is none
+    // ----------------------------
+    constexpr char compareOp(char c, char next)
+    {
+        if(next == '=') return c == '<' ? 'l' : c == '>' ? 'g' : c == '=' ? '=' : c == '!' ? 'n' : 0;
+        if(c == '<' || c == '>') return c;
+        return (c == '&' || c == '|') && next == c ? c : 0;
+    }
+
+#ifdef __SSE2__
+    // All ones in the bytes of v within [lo, hi], compared unsigned
+    inline __m128i inRange(__m128i v, char lo, char hi)
+    {
+        __m128i x = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+        return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(char(hi - lo))), x);
+    }
+
+    // Bit k set when p[k] is in one of the classes of cls, for k < 16
+    inline unsigned classMask(const char* p, uint8_t cls)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), m = _mm_setzero_si128();
+
+        if(cls & SPACE) m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), inRange(v, '\t', '\r')));
+        if(cls & (DIGIT | NAME)) m = _mm_or_si128(m, inRange(v, '0', '9'));
+        if(cls & POINT) m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+        if(cls & (NAME_START | NAME))
+        {
+            __m128i letters = inRange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+            m = _mm_or_si128(m, _mm_or_si128(letters, _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+        }
+        return unsigned(_mm_movemask_epi8(m));
+    }
+#endif
+
+    // ----------------------------
+    // End of the run of bytes in cls that starts at i. Two bytes are
+    // tried one at a time, which ends most runs in an expression;
+    // past that, with simd, SSE2 classifies 16 bytes per step and the
+    // first byte outside the run is the lowest clear bit of the mask.
+    // Otherwise it is the table all the way. --bench finds the two
+    // within a few percent of each other on every layout it tries, so
+    // the table is the default and SSE2 is kept for --fuzz-lexer and
+    // --bench to compare against
+    // ----------------------------
+    inline size_t runEnd(std::string_view s, size_t i, uint8_t cls, bool simd = false)
+    {
+        for(int k = 0; k < 2; ++k, ++i)
+            if(i >= s.size() || !is(s[i], cls)) return i;
+
+#ifdef __SSE2__
+        if(simd)
+            for(; i + 16 <= s.size(); i += 16)
+                if(unsigned outside = ~classMask(s.data() + i, cls) & 0xFFFF) return i + __builtin_ctz(outside);
+#else
+        (void)simd;
+#endif
+        while(i < s.size() && is(s[i], cls)) ++i;
+        return i;
+    }
+}
+
+class Calculator
+{
+    public:
+        // Number system used by evaluateText() and the REPL
+        enum class Mode {DOUBLE, DECIMAL, RATIONAL, INTERVAL};
+
+    private:
+        std::string expr;
+        double result = 0;
+        std::string resultText;
+
+        Mode mode = Mode::DOUBLE;
+        DecimalContext decimalCtx;
+        std::map<std::string, double, std::less<>> variables;
+
+    public:
+        struct Token
+        {
+            enum Type {NUMBER, OPERATOR, PAREN_LEFT, PAREN_RIGHT, FUNCTION, VARIABLE, COMMA, CALL, PARAM, STORE, LOAD, OUTPUT, BRANCH, JUMP, JOIN, LOOP, NEXT, INDEX} type;
+            double value;
+            char op;
+            size_t pos = 0, len = 0;   // source span
+            int index = 0;             // built-in id for FUNCTION, value slot for VARIABLE,
+                                       // user function for CALL, argument number for PARAM,
+                                       // temporary for STORE (copy top) and LOAD (push it back),
+                                       // result number for OUTPUT (pop into out[index]),
+                                       // target for BRANCH (pop, jump if zero) and JUMP,
+                                       // NEXT for LOOP and LOOP for NEXT, enclosing
+                                       // loop for INDEX (0 = innermost)
+
+            // ----------------------------
+            // Conditionals compile to  cond BRANCH then JUMP else JOIN.
+            // The scalar evaluators follow the jumps, so the branch not
+            // taken costs nothing. Read straight through, the same code
+            // is  cond then else SELECT  (JOIN picks by cond), which is
+            // how batch mode and the compile passes treat it. JOIN's op
+            // records the source form: '?', '&' (&&) or '|' (||).
+            // sum(i, from, to, body) compiles to  from to LOOP body NEXT:
+            // LOOP pops the bounds, NEXT folds the body's value into the
+            // result and jumps back while i <= to; INDEX pushes i. LOOP
+            // and NEXT carry the kind (see findAggregate) and the span of
+            // the loop variable. Read straight through it is a 3-ary op.
+            // Jump targets are set by linkJumps() after every rewrite
+            // ----------------------------
+        };
+
+    private:
+        // ----------------------------
+        // User-defined function, stored as postfix with PARAM tokens
+        // Calls to earlier functions are already inlined; `text` is the
+        // body source followed by the text of those inlined bodies
+        // ----------------------------
+        struct UserFunction
+        {
+            std::string name;
+            std::vector<std::string> params;
+            std::vector<Token> body;
+            std::string text;
+        };
+
+        std::vector<UserFunction> userFunctions;
+
+        int findUserFunction(std::string_view name) const;
+        int arityOf(const Token& fn) const;
+        std::string functionName(const Token& fn) const;
+
+        // diagnose() and validate(): sink(problem, pos, len, arity) returns false to stop
+        template<class Sink>
+        void scanSyntax(std::string_view src, Sink&& sink) const;
+
+    public:
+
+        // ----------------------------
+        // Immutable compiled form of an expression
+        // Safe to share between threads: evaluate() only reads the postfix
+        // ----------------------------
+        class CompiledExpr
+        {
+            private:
+                friend class Calculator;
+                std::vector<Token> postfix;
+                std::string source;
+                Mode mode = Mode::DOUBLE;
+                DecimalContext decimalCtx;
+
+                std::vector<std::string> vars;   // variable name of each value slot
+                std::vector<double> bound;       // values bound when compiled
+                std::string unbound;             // first variable without a value
+                size_t eliminated = 0;           // operations removed by CSE
+
+                const double* boundValues() const;
+
+            public:
+                // values[slot] overrides the variables bound at compile time
+                double evaluate(const double* values = nullptr) const;
+                std::string evaluateText(const double* values = nullptr) const;
+
+                // Value plus grad[slot] = d/d(variable slot), in one forward pass
+                double gradient(double* grad, const double* values = nullptr) const;
+
+                // Same result from a recorded tape swept backwards; cost does
+                // not grow with the number of variables
+                double reverseGradient(double* grad, const double* values = nullptr) const;
+
+                // columns[slot][row] for each variable; results to out[row]
+                void evaluateBatch(const double* const* columns, size_t rows, double* out) const;
+
+                const std::vector<Token>& code() const { return postfix; }
+                const std::vector<std::string>& variables() const { return vars; }
+                size_t eliminatedOps() const { return eliminated; }
+        };
+
+        // ----------------------------
+        // A group of expressions compiled into one program
+        // Subexpressions shared between them run once per evaluation;
+        // result k goes to out[k]. Always evaluated in double precision
+        // ----------------------------
+        class CompiledProgram
+        {
+            private:
+                friend class Calculator;
+                std::vector<Token> postfix;
+                std::string source;              // the expressions, one per line
+
+                std::vector<std::string> vars;
+                std::vector<double> bound;
+                std::string unbound;
+                size_t outputCount = 0;
+                size_t eliminated = 0;           // operations shared instead of repeated
+
+                const double* boundValues() const;
+
+            public:
+                void evaluate(double* out, const double* values = nullptr) const;
+
+                // columns[slot][row] for each variable; result k to outs[k][row]
+                void evaluateBatch(const double* const* columns, size_t rows, double* const* outs) const;
+
+                const std::vector<Token>& code() const { return postfix; }
+                const std::vector<std::string>& variables() const { return vars; }
+                size_t outputs() const { return outputCount; }
+                size_t eliminatedOps() const { return eliminated; }
+        };
+
+        // ----------------------------
+        // Expression that keeps every intermediate value
+        // set() recomputes only the nodes that depend on the changed
+        // variable, in postfix (children first) order. A conditional is
+        // one node over its condition and both branches; an error in
+        // the branch not taken (say 1/x at x = 0) stays in that node and
+        // only surfaces if it reaches the root. An aggregation is one
+        // node over its bounds that reruns its loop. Double precision;
+        // holds mutable state, so give each thread its own copy
+        // ----------------------------
+        class IncrementalExpr
+        {
+            private:
+                friend class Calculator;
+
+                struct Node
+                {
+                    Token tok;
+                    int kids[3] = {-1, -1, -1};
+                    int arity = 0;
+                    std::vector<Token> loop;   // aggregation: from to LOOP body NEXT, bounds filled in
+                };
+
+                std::vector<Node> nodes;                 // children before parents; root last
+                std::vector<double> values;              // current value of each node
+                std::vector<std::string> errors;         // per node: why it has no value, or empty
+                std::vector<std::vector<int>> affected;  // per variable slot: nodes that depend on it
+                std::vector<std::string> vars;
+                std::vector<double> inputs;
+                std::vector<char> known;                 // input has a value
+                bool stale = true;                       // no recompute has run yet
+                size_t recomputed = 0;
+
+                void recompute(const std::vector<int>& order);
+                void recomputeAll();
+                double result() const;
+
+            public:
+                double value();
+                double set(size_t slot, double v);
+                double set(std::string_view name, double v);
+
+                const std::vector<std::string>& variables() const { return vars; }
+                size_t nodeCount() const { return nodes.size(); }
+                size_t lastRecomputed() const { return recomputed; }
+        };
+
+        void inputExpr();
+        std::string getExpr() { return expr; }
+
+        static int precedence(char op);
+        static double applyOperation(double x, double y, char op);
+        static double applyToken(const Token& tok, const double* args);
+        static void linkJumps(std::vector<Token>& postfix);
+
+        std::vector<Token> tokenize(std::string_view src, bool simd = false) const;
+        std::vector<Token> toPostfix(const std::vector<Token>& tokens, std::string_view src) const;
+        static double evaluatePostfix(const std::vector<Token>& postfix, const double* vars = nullptr, bool trace = false, double* outputs = nullptr);
+        static void evaluateBlocks(const std::vector<Token>& postfix, const double* const* columns, size_t rows, double* const* outs);
+
+        // One running sum(i, from, to, ...); its result so far stays on the value stack
+        struct LoopFrame
+        {
+            double i, to;
+            double comp = 0;     // Neumaier compensation of a double sum
+            bool first = true;   // min and max take the first value as is
+        };
+        static bool beginLoop(char kind, double from, double to);
+        static bool aggregateBlocks(const std::vector<Token>& postfix, size_t loop, const double* vars, const std::vector<LoopFrame>& outer,
+                                    double from, double to, double& result);
+        static double evaluateDual(const std::vector<Token>& postfix, const double* vars, size_t nvars, double* grad);
+        static double evaluateAdjoint(const std::vector<Token>& postfix, const double* vars, size_t nvars, double* grad);
+
+        template<class Arith>
+        static typename Arith::Num evaluatePostfixAs(const std::vector<Token>& postfix, std::string_view src, const Arith& arith, const double* vars = nullptr);
+        static std::string evaluatePostfixText(const std::vector<Token>& postfix, std::string_view src, Mode mode, const DecimalContext& dc, const double* vars = nullptr);
+
+        static std::vector<std::string> bindVariables(std::vector<Token>& postfix, std::string_view src);
+
+        std::vector<Token> inlineCalls(const std::vector<Token>& postfix, size_t srcSize, std::string& extra) const;
+        static void foldConstants(std::vector<Token>& postfix);
+        static size_t eliminateCommonSubexpressions(std::vector<Token>& postfix, std::string_view src, bool literalText);
+        // tokenize, convert, inline user functions and optionally fold;
+        // spans of inlined bodies point into src + '\n' + extra
+        std::vector<Token> compilePostfix(std::string_view src, std::string& extra, bool fold) const;
+
+        // def-style definition: "name(a, b) = body"
+        void define(std::string_view definition);
+        std::vector<double> variableValues(const std::vector<std::string>& names) const;
+        void captureBindings(const std::vector<std::string>& names, std::vector<double>& bound, std::string& unbound) const;
+        void debug(const std::vector<Token>& tokens, const std::string& stage, std::string_view text);
+
+        // ----------------------------
+        // What diagnose() and validate() can find wrong with a source
+        // ----------------------------
+        enum class Problem : uint8_t
+        {
+            NONE, EMPTY, UNKNOWN_CHARACTER, UNKNOWN_OPERATOR, DECIMAL_POINTS, BAD_INTERVAL, INTERVAL_ORDER,
+            INTERVAL_MODE, UNKNOWN_FUNCTION, MISSING_OPERATOR, MISSING_OPERAND, MISSING_LAST_OPERAND, SIGN_AFTER_POWER,
+            SIGN_AFTER_PERCENT, SIGN_AFTER_LEADING_PERCENT, UNEXPECTED_COLON, UNCLOSED_CONDITIONAL, COMMA_OUTSIDE_CALL, UNEXPECTED_PAREN,
+            UNCLOSED_PAREN, AGGREGATE_FORM, AGGREGATE_ARGUMENTS, ARGUMENT_COUNT
+        };
+
+        // A problem found by diagnose(): what is wrong and the span of source it is about
+        struct Diagnostic
+        {
+            size_t pos, len;
+            std::string message;
+        };
+
+        // The first problem found by validate(), or NONE
+        struct Validation
+        {
+            Problem problem = Problem::NONE;
+            size_t pos = 0, len = 0;
+            int arity = 0;            // expected, for ARGUMENT_COUNT
+
+            bool ok() const { return problem == Problem::NONE; }
+        };
+
+        // Every lexical and syntax error in src, in source order; empty when well-formed
+        std::vector<Diagnostic> diagnose(std::string_view src) const;
+        Validation validate(std::string_view src) const;
+        static std::string describe(Problem problem, std::string_view text, int arity = 0);
+        static std::string describe(const Validation& v, std::string_view src) { return describe(v.problem, src.substr(v.pos, v.len), v.arity); }
+
+        // Reentrant API: const, touches no member state
+        CompiledExpr compile(std::string_view src) const;
+        CompiledProgram compileProgram(const std::vector<std::string>& sources) const;
+        IncrementalExpr compileIncremental(std::string_view src) const;
+
+        // d(src)/d(var), simplified and printed back as infix;
+        // differentiate() compiles it like any other expression
+        std::string derivative(std::string_view src, std::string_view var) const;
+        CompiledExpr differentiate(std::string_view src, std::string_view var) const { return compile(derivative(src, var)); }
+        static std::string toInfix(const std::vector<Token>& postfix, std::string_view src);
+        double evaluate(std::string_view src) const;
+        std::string evaluateText(std::string_view src) const;
+
+        void setMode(Mode m) { mode = m; }
+        Mode getMode() const { return mode; }
+        DecimalContext& decimalContext() { return decimalCtx; }
+        void setVariable(const std::string& name, double value) { variables[name] = value; }
+
+        double evaluateExpr();
+        void displayResult() const;
+};
+
+// ----------------------------
+// Input expression from user
+// ----------------------------
+void Calculator::inputExpr()
+{
+    std::getline(std::cin, expr);
+}
+
+// ----------------------------
+// Operator precedence
+// 'u' is unary minus
+// ----------------------------
+int Calculator::precedence(char op)
+{
+    switch(op)
+    {
+        case '?':
+        case ':': return 1;  // conditional
+        case '|': return 2;
+        case '&': return 3;
+        case '=':
+        case 'n': return 4;
+        case '<':
+        case '>':
+        case 'l':
+        case 'g': return 5;
+        case '+':
+        case '-': return 6;
+        case '*':
+        case '/': return 7;
+        case 'u': return 8;  // unary minus
+        case '^': return 9;
+        case '%': return 10;
+        default: return 0;
+    }
+}
+
+// ----------------------------
+// Apply binary operations
+// ----------------------------
+double Calculator::applyOperation(double x, double y, char op)
+{
+    switch(op)
+    {
+        case '+': return x + y;
+        case '-': return x - y;
+        case '*': return x * y;
+        case '/': 
+            if(y == 0)
+                throw std::runtime_error("Division by zero!");
+            return x / y;
+        case '^':
+            return pow(x, y);
+        case '<': return x < y;
+        case '>': return x > y;
+        case 'l': return x <= y;
+        case 'g': return x >= y;
+        case '=': return x == y;
+        case 'n': return x != y;
+        default:
+            throw std::runtime_error(std::string("Unknown operator: ") + op);
+    }
+}
+
+// ----------------------------
+// Tokenize the input expression
+// Handles numbers, operators, parentheses, unary minus.
+// chars::lex() picks each token's branch from its first byte, and
+// the only state carried between tokens is whether an operand is
+// expected: at the start and after an operator, '(' or ','. A '-'
+// read there is the sign 'u'. Runs of spaces, number characters
+// and name characters are measured in bulk by chars::runEnd(),
+// with the scalar table unless simd asks for the SSE2 runs
+// ----------------------------
+std::vector<Calculator::Token> Calculator::tokenize(std::string_view expr, bool simd) const
+{
+    using chars::Lex;
+
+    // Room for a token every other byte, about what spaced expressions
+    // have, so long ones do not regrow
+    std::vector<Token> tokens;
+    tokens.reserve(expr.size() / 2 + 1);
+    bool operand = true;
+    size_t i = 0;
+
+    while(i < expr.size())
+    {
+        char c = expr[i];
+        size_t start = i;
+
+        switch(chars::lex(c))
+        {
+            case Lex::SPACE:
+                i = chars::runEnd(expr, i + 1, chars::SPACE, simd);
+                continue;
+
+            // ----------------------------
+            // Parse numbers (integers or decimals)
+            // ----------------------------
+            case Lex::POINT:
+                if(i + 1 >= expr.size() || !chars::is(expr[i + 1], chars::DIGIT)) break;
+                [[fallthrough]];
+            case Lex::DIGIT:
+            {
+                i = chars::runEnd(expr, i, chars::DIGIT | chars::POINT, simd);
+
+                std::string_view numStr = expr.substr(start, i - start);
+                size_t point = numStr.find('.');
+                if(point != std::string_view::npos && numStr.find('.', point + 1) != std::string_view::npos)
+                    throw std::runtime_error("Invalid number: multiple decimal points.");
+
+                double value;
+                parseDouble(numStr.data(), numStr.data() + numStr.size(), value);
+                tokens.push_back({Token::NUMBER, value, 0, start, i - start});
+                operand = false;
+                continue;
+            }
+
+            // ----------------------------
+            // Parse names: a function call when followed by '(',
+            // otherwise a variable
+            // ----------------------------
+            case Lex::NAME:
+            {
+                i = chars::runEnd(expr, i, chars::NAME, simd);
+
+                std::string_view name = expr.substr(start, i - start);
+                size_t next = chars::runEnd(expr, i, chars::SPACE, simd);
+
+                if(next < expr.size() && expr[next] == '(')
+                {
+                    int id = findBuiltin(name);
+                    char kind = id < 0 ? findAggregate(name) : 0;
+                    int user = id < 0 && !kind ? findUserFunction(name) : -1;
+
+                    if(id < 0 && !kind && user < 0)
+                        throw std::runtime_error("Unknown function: " + std::string(name));
+
+                    // min and max with four arguments aggregate too; toPostfix decides
+                    if(id >= 0) tokens.push_back({Token::FUNCTION, 0, 0, start, i - start, id});
+                    else if(kind) tokens.push_back({Token::LOOP, 0, kind, start, i - start, -1});
+                    else tokens.push_back({Token::CALL, 0, 0, start, i - start, user});
+                }
+                else tokens.push_back({Token::VARIABLE, 0, 0, start, i - start});
+
+                operand = false;
+                continue;
+            }
+
+            // ----------------------------
+            // Parse interval literals [lo, hi]
+            // Only interval mode takes them; IntervalArith reads the
+            // bounds from the text, the token keeps the midpoint
+            // ----------------------------
+            case Lex::INTERVAL:
+            {
+                size_t close = expr.find(']', i);
+                size_t comma = expr.find(',', i);
+
+                if(close == std::string_view::npos || comma == std::string_view::npos || comma > close)
+                    throw std::runtime_error("Invalid interval: expected [lo, hi].");
+
+                double lo, hi;
+                if(!parseBound(expr.substr(i + 1, comma - i - 1), lo) || !parseBound(expr.substr(comma + 1, close - comma - 1), hi))
+                    throw std::runtime_error("Invalid interval: expected [lo, hi].");
+
+                if(lo > hi)
+                    throw std::runtime_error("Invalid interval: lower bound exceeds upper bound.");
+
+                if(mode != Mode::INTERVAL)
+                    throw std::runtime_error("Interval literals need 'mode interval'.");
+
+                tokens.push_back({Token::NUMBER, lo + (hi - lo) / 2, 0, i, close + 1 - i});
+                i = close + 1;
+                operand = false;
+                continue;
+            }
+
+            // ----------------------------
+            // Handle unary minus as 'u' operator
+            // Occurs at start, after operator, '(' or ','
+            // ----------------------------
+            case Lex::MINUS:
+                tokens.push_back({Token::OPERATOR, 0, operand ? 'u' : '-', i, 1});
+                ++i;
+                operand = true;
+                continue;
+
+            // ----------------------------
+            // Parse binary operators
+            // ----------------------------
+            case Lex::OPERATOR:
+                tokens.push_back({Token::OPERATOR, 0, c, i, 1});
+                ++i;
+                operand = true;
+                continue;
+
+            // ----------------------------
+            // Comparison and logical operators, stored as one char
+            // ----------------------------
+            case Lex::COMPARE:
+            {
+                char op = chars::compareOp(c, i + 1 < expr.size() ? expr[i + 1] : 0);
+                if(!op)
+                    throw std::runtime_error(std::string("Unknown operator: ") + c);
+
+                size_t len = op == '<' || op == '>' ? 1 : 2;
+                tokens.push_back({Token::OPERATOR, 0, op, i, len});
+                i += len;
+                operand = true;
+                continue;
+            }
+
+            // ----------------------------
+            // Parse parentheses and argument separators
+            // ----------------------------
+            case Lex::PAREN_LEFT:
+                tokens.push_back({Token::PAREN_LEFT, 0, 0, i, 1});
+                ++i;
+                operand = true;
+                continue;
+
+            case Lex::PAREN_RIGHT:
+                tokens.push_back({Token::PAREN_RIGHT, 0, 0, i, 1});
+                ++i;
+                operand = false;
+                continue;
+
+            case Lex::COMMA:
+                tokens.push_back({Token::COMMA, 0, 0, i, 1});
+                ++i;
+                operand = true;
+                continue;
+
+            case Lex::UNKNOWN:
+                break;
+        }
+
+        throw std::runtime_error(std::string("Unknown character: ") + c);
+    }
+
+    return tokens;
+}
+
+// ----------------------------
+// Convert tokens to postfix (RPN) using Shunting Yard
+// Handles operator precedence and right-associativity.
+// src is only needed to tell loop variables by name: inside the
+// body of sum(i, ...) every i becomes an INDEX token
+// ----------------------------
+std::vector<Calculator::Token> Calculator::toPostfix(const std::vector<Token>& tokens, std::string_view src) const
+{
+    std::vector<Token> output;
+    std::stack<Token> opStack;
+    std::stack<int> argCounts;   // arguments seen by each open function call
+    std::vector<Token> loops;    // open aggregations, innermost last
+    std::vector<std::string_view> loopVars;   // those whose body has started
+    const Token* prev = nullptr;
+
+    auto isRightAssociative = [](char op) { return op == '^' || op == 'u' || op == '%' || op == '?' || op == ':'; };
+
+    // ----------------------------
+    // Operands and operators must alternate, as validate() requires.
+    // Checked here because the postfix no longer shows it: "== 2 2"
+    // would come out as the well-formed 2 2 ==. operand is true
+    // where one is expected. '%' may stand on either side of its
+    // operand, so it leaves that as it was
+    // ----------------------------
+    bool operand = true;
+    auto alternate = [&](size_t t)
+    {
+        const Token &tok = tokens[t];
+        auto fail = [&](Problem problem) { throw std::runtime_error(describe(problem, src.substr(tok.pos, tok.len))); };
+
+        switch(tok.type)
+        {
+            case Token::NUMBER:
+            case Token::VARIABLE:
+                if(!operand) fail(Problem::MISSING_OPERATOR);
+                operand = false;
+                break;
+
+            case Token::PAREN_RIGHT:
+            {
+                bool emptyCall = t >= 2 && tokens[t - 1].type == Token::PAREN_LEFT &&
+                                 (tokens[t - 2].type == Token::FUNCTION || tokens[t - 2].type == Token::CALL);
+                if(operand && !emptyCall) fail(Problem::MISSING_OPERAND);
+                operand = false;
+                break;
+            }
+
+            case Token::COMMA:
+                if(operand) fail(Problem::MISSING_OPERAND);
+                operand = true;
+                break;
+
+            // ----------------------------
+            // A sign is out of place after a closing '%', and after '^'
+            // or a leading '%': its lower precedence would pop those
+            // before their operand arrives
+            // ----------------------------
+            case Token::OPERATOR:
+                if(tok.op == 'u')
+                {
+                    char last = t > 0 && tokens[t - 1].type == Token::OPERATOR ? tokens[t - 1].op : 0;
+                    if(!operand) fail(Problem::SIGN_AFTER_PERCENT);
+                    if(last == '^') fail(Problem::SIGN_AFTER_POWER);
+                    if(last == '%') fail(Problem::SIGN_AFTER_LEADING_PERCENT);
+                }
+                else if(tok.op != '%')
+                {
+                    if(operand) fail(Problem::MISSING_OPERAND);
+                    operand = true;
+                }
+                break;
+
+            default:   // FUNCTION, CALL, LOOP, PAREN_LEFT
+                if(!operand) fail(Problem::MISSING_OPERATOR);
+                operand = true;
+                break;
+        }
+    };
+
+    // ----------------------------
+    // Move the top operator to the output. Conditionals were opened
+    // with BRANCH when their operator arrived; here they close:
+    //   a && b  ->  a BRANCH b 0 != JUMP 0 JOIN
+    //   a || b  ->  a BRANCH 1 JUMP b 0 != JOIN
+    //   c ? x : y  ->  c BRANCH x JUMP y JOIN
+    // ----------------------------
+    auto popOperator = [&]()
+    {
+        Token top = opStack.top();
+        opStack.pop();
+
+        if(top.type != Token::OPERATOR) { output.push_back(top); return; }
+
+        Token zero{Token::NUMBER, 0, 0}, test{Token::OPERATOR, 0, 'n', top.pos, top.len};
+        Token join{Token::JOIN, 0, top.op, top.pos, top.len};
+
+        switch(top.op)
+        {
+            case '?':
+                throw std::runtime_error("Expected ':' in conditional expression.");
+            case ':':
+                join.op = '?';
+                output.push_back(join);
+                break;
+            case '&':
+                output.insert(output.end(), {zero, test, Token{Token::JUMP, 0, 0, top.pos, top.len}, zero, join});
+                break;
+            case '|':
+                output.insert(output.end(), {zero, test, join});
+                break;
+            default:
+                output.push_back(top);
+        }
+    };
+
+    // min and max take four arguments when they aggregate
+    auto argumentCount = [&](size_t open)
+    {
+        int depth = 0, count = 1;
+        for(size_t k = open; k < tokens.size(); ++k)
+        {
+            if(tokens[k].type == Token::PAREN_LEFT) ++depth;
+            else if(tokens[k].type == Token::PAREN_RIGHT && --depth == 0) break;
+            else if(tokens[k].type == Token::COMMA && depth == 1) ++count;
+        }
+        return count;
+    };
+
+    for(size_t t = 0; t < tokens.size(); ++t)
+    {
+        const Token &tok = tokens[t];
+        const Token* before = prev;
+        prev = &tok;
+        alternate(t);
+
+        if(tok.type == Token::NUMBER) output.push_back(tok);
+
+        // The innermost loop variable of that name wins
+        else if(tok.type == Token::VARIABLE)
+        {
+            Token var = tok;
+            auto name = src.substr(tok.pos, tok.len);
+            auto it = std::find(loopVars.rbegin(), loopVars.rend(), name);
+            if(it != loopVars.rend()) { var.type = Token::INDEX; var.index = int(it - loopVars.rbegin()); }
+            output.push_back(var);
+        }
+
+        // ----------------------------
+        // sum(i, ...): the loop variable is a name, not an operand.
+        // The '(' is marked with index 2; the body starts after the
+        // third comma, where LOOP is emitted
+        // ----------------------------
+        else if(tok.type == Token::LOOP || (tok.type == Token::FUNCTION && t + 1 < tokens.size() &&
+                (tok.index == BuiltinFunction::MIN || tok.index == BuiltinFunction::MAX) && argumentCount(t + 1) == 4))
+        {
+            Token loop{Token::LOOP, 0, tok.type == Token::LOOP ? tok.op : findAggregate(builtinFunctions()[tok.index].name)};
+            std::string usage = std::string(aggregateName(loop.op)) + "(i, from, to, expression)";
+
+            if(t + 3 >= tokens.size() || tokens[t + 1].type != Token::PAREN_LEFT ||
+               tokens[t + 2].type != Token::VARIABLE || tokens[t + 3].type != Token::COMMA)
+                throw std::runtime_error("Expected " + usage + ".");
+
+            loop.pos = tokens[t + 2].pos;
+            loop.len = tokens[t + 2].len;
+            loops.push_back(loop);
+            opStack.push(loop);
+
+            Token paren = tokens[t + 1];
+            paren.index = 2;
+            opStack.push(paren);
+            argCounts.push(2);
+
+            t += 3;
+            prev = &tokens[t];
+        }
+
+        else if(tok.type == Token::FUNCTION || tok.type == Token::CALL) opStack.push(tok);
+
+        // ':' closes the nearest open '?': its condition and then-part are done
+        else if(tok.type == Token::OPERATOR && tok.op == ':')
+        {
+            while(!opStack.empty() && opStack.top().type == Token::OPERATOR && opStack.top().op != '?') popOperator();
+
+            if(opStack.empty() || opStack.top().type != Token::OPERATOR)
+                throw std::runtime_error("Unexpected ':' without '?'.");
+
+            output.push_back({Token::JUMP, 0, 0, tok.pos, tok.len});
+            opStack.top() = tok;
+        }
+
+        else if(tok.type == Token::OPERATOR)
+        {
+            while(!opStack.empty() && opStack.top().type == Token::OPERATOR)
+            {
+                char topOp = opStack.top().op;
+
+                if((!isRightAssociative(tok.op) && precedence(topOp) >= precedence(tok.op)) ||
+                   (isRightAssociative(tok.op) && precedence(topOp) > precedence(tok.op)))
+                    popOperator();
+                else break;
+            }
+
+            // The left operand is complete: open the conditional
+            if(tok.op == '?' || tok.op == '&' || tok.op == '|')
+                output.push_back({Token::BRANCH, 0, 0, tok.pos, tok.len});
+            if(tok.op == '|')
+                output.insert(output.end(), {Token{Token::NUMBER, 1, 0}, Token{Token::JUMP, 0, 0, tok.pos, tok.len}});
+
+            opStack.push(tok);
+        }
+
+        // ----------------------------
+        // A '(' right after a function name opens its argument list;
+        // index marks it so ',' and ')' can tell
+        // ----------------------------
+        else if(tok.type == Token::PAREN_LEFT)
+        {
+            Token paren = tok;
+            paren.index = before && (before->type == Token::FUNCTION || before->type == Token::CALL);
+            if(paren.index) argCounts.push(1);
+            opStack.push(paren);
+        }
+
+        else if(tok.type == Token::COMMA)
+        {
+            while(!opStack.empty() && opStack.top().type != Token::PAREN_LEFT) popOperator();
+
+            if(opStack.empty() || !opStack.top().index)
+                throw std::runtime_error("Unexpected ',' outside a function call.");
+
+            // The bounds are done: the body runs inside the loop
+            if(++argCounts.top() == 4 && opStack.top().index == 2)
+            {
+                output.push_back(loops.back());
+                loopVars.push_back(src.substr(loops.back().pos, loops.back().len));
+            }
+        }
+
+        else if(tok.type == Token::PAREN_RIGHT)
+        {
+            while(!opStack.empty() && opStack.top().type != Token::PAREN_LEFT) popOperator();
+
+            if(opStack.empty())
+                throw std::runtime_error("Mismatched parentheses: unexpected ')'");
+            
+            bool call = opStack.top().index;
+            opStack.pop();
+
+            if(call)
+            {
+                Token fn = opStack.top();
+                opStack.pop();
+
+                if(fn.type == Token::LOOP)
+                {
+                    if(argCounts.top() != 4)
+                        throw std::runtime_error(std::string(aggregateName(fn.op)) + " expects 4 arguments: " +
+                                                 aggregateName(fn.op) + "(i, from, to, expression).");
+
+                    argCounts.pop();
+                    loops.pop_back();
+                    loopVars.pop_back();
+                    fn.type = Token::NEXT;
+                    output.push_back(fn);
+                    continue;
+                }
+
+                int arity = arityOf(fn);
+                int argc = before && before->type == Token::PAREN_LEFT ? 0 : argCounts.top();
+                argCounts.pop();
+
+                if(argc != arity)
+                    throw std::runtime_error("Function " + functionName(fn) + " expects " + std::to_string(arity) +
+                                             (arity == 1 ? " argument." : " arguments."));
+
+                output.push_back(fn);
+            }
+        }
+    }
+
+    if(operand && !tokens.empty())
+        throw std::runtime_error(describe(Problem::MISSING_LAST_OPERAND, src.substr(tokens.back().pos, tokens.back().len)));
+
+    while(!opStack.empty())
+    {
+        if(opStack.top().type == Token::PAREN_LEFT)
+            throw std::runtime_error("Mismatched parentheses: unclosed '('");
+
+        popOperator();
+    }
+
+    return output;
+}
+
+// ----------------------------
+// Syntax check shared by diagnose() and validate(): one pass over
+// src, no tokens stored, no numbers converted (the bounds of an
+// interval literal aside, which must be in order). Accepts what
+// tokenize() and toPostfix() accept, and also finds the missing
+// operands the evaluators would report one at a time.
+// sink(problem, pos, len, arity) hears of each problem, with its
+// span and, for ARGUMENT_COUNT, the arity expected; it returns
+// false to stop. After a problem the scan goes on as if the
+// obvious fix were made (operand or operator supplied, stray ')'
+// dropped, an unknown character taken for the missing operator),
+// so one mistake is reported once, not cascaded. Nothing is
+// allocated unless parentheses nest deeper than 16
+// ----------------------------
+template<class Sink>
+void Calculator::scanSyntax(std::string_view src, Sink&& sink) const
+{
+    bool stop = false, reported = false;
+    auto report = [&](Problem problem, size_t pos, size_t len, int arity = 0)
+    {
+        if(!stop) stop = !sink(problem, pos, len, arity);
+        reported = true;
+    };
+
+    // ----------------------------
+    // One per open '(', plus the whole expression at the bottom.
+    // first tracks the first argument of a call: 0 nothing yet,
+    // 1 a lone variable (an aggregation's loop variable), 2 other
+    // ----------------------------
+    enum Kind : char {TOP, GROUP, CALL, UNKNOWN, AGGREGATE, MINMAX};
+    struct Group
+    {
+        Kind kind;
+        size_t pos, name, nameLen;   // '(' and the function name before it
+        int arity = 0, args = 1, first = 0;
+        int conditionals = 0;        // '?' still waiting for ':'
+        size_t question = 0;         // the latest of them
+    };
+
+    Group groups[16];
+    std::vector<Group> deeper;       // nesting past 16 spills here
+    size_t depth = 0;
+    auto top = [&]() -> Group& { return depth < 16 ? groups[depth] : deeper[depth - 16]; };
+    auto open = [&](const Group& g)
+    {
+        ++depth;
+        if(depth < 16) groups[depth] = g;
+        else if(depth - 16 < deeper.size()) deeper[depth - 16] = g;
+        else deeper.push_back(g);
+    };
+    groups[0] = {TOP, 0, 0, 0};
+
+    bool expectOperand = true;
+    char lastOp = 0;                 // the previous token, if it was an operator
+    size_t lastPos = 0, lastLen = 0; // the previous token
+    bool any = false;                // a token was read
+    bool skipped = false;            // an unknown character was, just before
+
+    auto note = [&](bool variable)
+    {
+        Group &g = top();
+        if(g.args == 1) g.first = g.first == 0 && variable ? 1 : 2;
+    };
+    auto operand = [&](size_t pos, size_t len, bool variable)
+    {
+        if(!expectOperand && !skipped) report(Problem::MISSING_OPERATOR, pos, len);
+        note(variable);
+        expectOperand = false;
+        lastOp = 0;
+    };
+    auto binary = [&](size_t pos, size_t len, char op)
+    {
+        if(expectOperand) report(Problem::MISSING_OPERAND, pos, len);
+        note(false);
+        expectOperand = true;
+        lastOp = op;
+    };
+    auto unclosedConditional = [&](Group& g)
+    {
+        if(g.conditionals) report(Problem::UNCLOSED_CONDITIONAL, g.question, 1);
+        g.conditionals = 0;
+    };
+
+    size_t i = 0;
+    while(i < src.size() && !stop)
+    {
+        char c = src[i];
+        if(chars::is(c, chars::SPACE)) { i = chars::runEnd(src, i + 1, chars::SPACE); continue; }
+
+        size_t start = i;
+
+        if(chars::is(c, chars::DIGIT) || (c == '.' && i + 1 < src.size() && chars::is(src[i + 1], chars::DIGIT)))
+        {
+            i = chars::runEnd(src, i, chars::DIGIT | chars::POINT);
+            if(std::count(src.begin() + start, src.begin() + i, '.') > 1) report(Problem::DECIMAL_POINTS, start, i - start);
+            operand(start, i - start, false);
+        }
+
+        else if(chars::is(c, chars::NAME_START))
+        {
+            i = chars::runEnd(src, i, chars::NAME);
+
+            std::string_view name = src.substr(start, i - start);
+            size_t next = chars::runEnd(src, i, chars::SPACE);
+
+            if(next < src.size() && src[next] == '(')
+            {
+                Group g{CALL, next, start, i - start};
+                int id = findBuiltin(name);
+
+                if(id == BuiltinFunction::MIN || id == BuiltinFunction::MAX) g.kind = MINMAX;
+                else if(id >= 0) g.arity = builtinFunctions()[id].arity;
+                else if(findAggregate(name)) g.kind = AGGREGATE;
+                else if(int user = findUserFunction(name); user >= 0) g.arity = int(userFunctions[user].params.size());
+                else
+                {
+                    g.kind = UNKNOWN;
+                    report(Problem::UNKNOWN_FUNCTION, start, i - start);
+                }
+
+                operand(start, i - start, false);
+                expectOperand = true;
+                open(g);
+                i = next + 1;
+            }
+            else operand(start, i - start, true);
+        }
+
+        // Bounds are converted like tokenize() does, to check their order;
+        // outside interval mode the literal is refused, as there
+        else if(c == '[')
+        {
+            size_t close = src.find(']', i), comma = src.find(',', i);
+            i = close == std::string_view::npos ? src.size() : close + 1;
+
+            if(close == std::string_view::npos || comma == std::string_view::npos || comma > close)
+                report(Problem::BAD_INTERVAL, start, i - start);
+            else
+            {
+                double lo, hi;
+                if(!parseBound(src.substr(start + 1, comma - start - 1), lo) || !parseBound(src.substr(comma + 1, close - comma - 1), hi))
+                    report(Problem::BAD_INTERVAL, start, i - start);
+                else if(lo > hi)
+                    report(Problem::INTERVAL_ORDER, start, i - start);
+                else if(mode != Mode::INTERVAL)
+                    report(Problem::INTERVAL_MODE, start, i - start);
+            }
+            operand(start, i - start, false);
+        }
+
+        // ----------------------------
+        // '-' is a sign wherever tokenize() makes it one. Places where
+        // it then fails to compile: right after '^' or a leading '%',
+        // which the sign's lower precedence splits off, and after a
+        // closing '%'
+        // ----------------------------
+        else if(c == '-' && (expectOperand || lastOp == '%'))
+        {
+            ++i;
+            if(lastOp == '^') report(Problem::SIGN_AFTER_POWER, start, 1);
+            if(lastOp == '%' && expectOperand) report(Problem::SIGN_AFTER_LEADING_PERCENT, start, 1);
+
+            if(expectOperand)
+            {
+                note(false);
+                lastOp = 'u';
+            }
+            else
+            {
+                report(Problem::SIGN_AFTER_PERCENT, start, 1);
+                binary(start, 1, '-');
+            }
+        }
+
+        // ----------------------------
+        // toPostfix() applies '%' to the operand on either side: a
+        // leading one waits for the operand after it, like a sign.
+        // With none on either side the operand is found missing later
+        // ----------------------------
+        else if(c == '%')
+        {
+            ++i;
+            note(false);
+            lastOp = '%';
+        }
+
+        else if(c == '?' || c == ':')
+        {
+            ++i;
+            binary(start, 1, c);
+
+            Group &g = top();
+            if(c == '?') { ++g.conditionals; g.question = start; }
+            else if(g.conditionals) --g.conditionals;
+            else report(Problem::UNEXPECTED_COLON, start, 1);
+        }
+
+        else if(c == '+' || c == '-' || c == '*' || c == '/' || c == '^')
+        {
+            ++i;
+            binary(start, 1, c);
+        }
+
+        // An unknown one between operands is taken as a binary operator
+        else if(c == '<' || c == '>' || c == '=' || c == '!' || c == '&' || c == '|')
+        {
+            char next = i + 1 < src.size() ? src[i + 1] : 0;
+            size_t len = 0;
+
+            if(next == '=') len = c == '&' || c == '|' ? 0 : 2;
+            else if(c == '<' || c == '>') len = 1;
+            else if((c == '&' || c == '|') && next == c) len = 2;
+
+            if(!len)
+            {
+                report(Problem::UNKNOWN_OPERATOR, start, 1);
+                if(expectOperand) { ++i; skipped = true; continue; }
+            }
+            i += std::max<size_t>(len, 1);
+            binary(start, i - start, c);
+        }
+
+        else if(c == '(')
+        {
+            ++i;
+            if(!expectOperand && !skipped) report(Problem::MISSING_OPERATOR, start, 1);
+            note(false);
+            expectOperand = true;
+            lastOp = 0;
+            open({GROUP, start, 0, 0});
+        }
+
+        else if(c == ',')
+        {
+            ++i;
+            Group &g = top();
+
+            if(g.kind == TOP || g.kind == GROUP)
+                report(Problem::COMMA_OUTSIDE_CALL, start, 1);
+            else
+            {
+                if(expectOperand) report(Problem::MISSING_OPERAND, start, 1);
+                unclosedConditional(g);
+                ++g.args;
+            }
+            expectOperand = true;
+            lastOp = 0;
+        }
+
+        else if(c == ')')
+        {
+            ++i;
+            if(depth == 0)
+            {
+                report(Problem::UNEXPECTED_PAREN, start, 1);
+                continue;
+            }
+
+            Group &g = top();
+            bool empty = g.args == 1 && g.first == 0;
+            if(expectOperand && !(empty && g.kind != GROUP)) report(Problem::MISSING_OPERAND, start, 1);
+            unclosedConditional(g);
+
+            if(g.kind == AGGREGATE || (g.kind == MINMAX && g.args == 4))
+            {
+                if(g.args < 2 || g.first != 1) report(Problem::AGGREGATE_FORM, g.name, g.nameLen);
+                else if(g.args != 4) report(Problem::AGGREGATE_ARGUMENTS, g.name, g.nameLen);
+            }
+            else if(g.kind == CALL || g.kind == MINMAX)
+            {
+                int arity = g.kind == MINMAX ? 2 : g.arity;
+                if((empty ? 0 : g.args) != arity) report(Problem::ARGUMENT_COUNT, g.name, g.nameLen, arity);
+            }
+
+            --depth;
+            expectOperand = false;
+            lastOp = 0;
+        }
+
+        else
+        {
+            ++i;
+            report(Problem::UNKNOWN_CHARACTER, start, 1);
+            skipped = true;
+            continue;
+        }
+
+        lastPos = start;
+        lastLen = i - start;
+        any = true;
+        skipped = false;
+    }
+
+    if(!any)
+    {
+        if(!reported) report(Problem::EMPTY, 0, src.size());
+        return;
+    }
+    if(expectOperand) report(Problem::MISSING_LAST_OPERAND, lastPos, lastLen);
+
+    for(; depth > 0; --depth)
+    {
+        unclosedConditional(top());
+        report(Problem::UNCLOSED_PAREN, top().pos, 1);
+    }
+    unclosedConditional(groups[0]);
+}
+
+// ----------------------------
+// The message for a problem found at text (its span of source)
+// ----------------------------
+std::string Calculator::describe(Problem problem, std::string_view text, int arity)
+{
+    std::string quoted = "'" + std::string(text) + "'", name(text);
+
+    switch(problem)
+    {
+        case Problem::NONE: return "";
+        case Problem::EMPTY: return "Empty expression.";
+        case Problem::UNKNOWN_CHARACTER: return "Unknown character: " + name;
+        case Problem::UNKNOWN_OPERATOR: return "Unknown operator: " + name;
+        case Problem::DECIMAL_POINTS: return "Invalid number: multiple decimal points.";
+        case Problem::BAD_INTERVAL: return "Invalid interval: expected [lo, hi].";
+        case Problem::INTERVAL_ORDER: return "Invalid interval: lower bound exceeds upper bound.";
+        case Problem::INTERVAL_MODE: return "Interval literals need 'mode interval'.";
+        case Problem::UNKNOWN_FUNCTION: return "Unknown function: " + name;
+        case Problem::MISSING_OPERATOR: return "Missing operator before " + quoted + ".";
+        case Problem::MISSING_OPERAND: return "Missing operand before " + quoted + ".";
+        case Problem::MISSING_LAST_OPERAND: return "Missing operand after " + quoted + ".";
+        case Problem::SIGN_AFTER_POWER: return "Minus after '^' needs parentheses: write a^(-b).";
+        case Problem::SIGN_AFTER_PERCENT: return "Minus after '%' is read as a sign: write (a%) - b.";
+        case Problem::SIGN_AFTER_LEADING_PERCENT: return "Minus after a leading '%' needs parentheses: write %(-b).";
+        case Problem::UNEXPECTED_COLON: return "Unexpected ':' without '?'.";
+        case Problem::UNCLOSED_CONDITIONAL: return "Expected ':' in conditional expression.";
+        case Problem::COMMA_OUTSIDE_CALL: return "Unexpected ',' outside a function call.";
+        case Problem::UNEXPECTED_PAREN: return "Mismatched parentheses: unexpected ')'";
+        case Problem::UNCLOSED_PAREN: return "Mismatched parentheses: unclosed '('";
+        case Problem::AGGREGATE_FORM: return "Expected " + name + "(i, from, to, expression).";
+        case Problem::AGGREGATE_ARGUMENTS: return name + " expects 4 arguments: " + name + "(i, from, to, expression).";
+        case Problem::ARGUMENT_COUNT:
+            return "Function " + name + " expects " + std::to_string(arity) + (arity == 1 ? " argument." : " arguments.");
+    }
+    return "";
+}
+
+// ----------------------------
+// Every lexical and syntax error in src, in source order
+// ----------------------------
+std::vector<Calculator::Diagnostic> Calculator::diagnose(std::string_view src) const
+{
+    std::vector<Diagnostic> found;
+    scanSyntax(src, [&](Problem problem, size_t pos, size_t len, int arity)
+    {
+        found.push_back({pos, len, describe(problem, src.substr(pos, len), arity)});
+        return true;
+    });
+
+    std::stable_sort(found.begin(), found.end(), [](const Diagnostic& a, const Diagnostic& b) { return a.pos < b.pos; });
+    return found;
+}
+
+// ----------------------------
+// Well-formed or not, for bulk checks: stops at the first problem
+// and builds no message; describe() gives one if needed
+// ----------------------------
+Calculator::Validation Calculator::validate(std::string_view src) const
+{
+    Validation v;
+    scanSyntax(src, [&](Problem problem, size_t pos, size_t len, int arity)
+    {
+        v = {problem, pos, len, arity};
+        return false;
+    });
+    return v;
+}
+
+// ----------------------------
+// Point every BRANCH past its JUMP and every JUMP at its JOIN,
+// and link each LOOP with its NEXT, checking on the way that every
+// operator finds its operands and each part of a conditional and
+// each loop body leaves exactly one value. Operands are counted
+// per region: an operator inside a branch or a loop body may not
+// take values from outside it, which at run time would be the
+// condition's neighbours or the loop's accumulator. Run after any
+// pass that moves tokens (user functions must be inlined by then)
+// ----------------------------
+void Calculator::linkJumps(std::vector<Token>& postfix)
+{
+    struct Open { size_t branch, jump, depth; bool loop; };
+    std::vector<Open> open;
+    size_t depth = 0;
+    auto malformed = []() { return std::runtime_error("Invalid expression: malformed conditional."); };
+    auto malformedLoop = []() { return std::runtime_error("Invalid expression: malformed aggregation."); };
+
+    // ----------------------------
+    // The values below base() belong to enclosing regions: the part
+    // of a conditional before its BRANCH (the condition included,
+    // though it is popped at run time), plus the first branch's
+    // value once past its JUMP, or what was below a loop's bounds
+    // ----------------------------
+    auto base = [&]() -> size_t { return open.empty() ? 0 : open.back().depth + (open.back().jump ? 1 : 0); };
+    auto pop = [&](size_t n, const char* what, const char* name = "")
+    {
+        if(depth < base() + n) throw std::runtime_error(std::string("Invalid expression: missing ") + what + name + ".");
+        depth -= n;
+    };
+
+    for(size_t i = 0; i < postfix.size(); ++i)
+    {
+        auto &tok = postfix[i];
+
+        switch(tok.type)
+        {
+            case Token::BRANCH:
+                if(depth <= base()) throw malformed();
+                open.push_back({i, 0, depth, false});
+                break;
+
+            // The bounds are consumed; the body leaves one value
+            case Token::LOOP:
+                if(depth < base() + 2) throw malformedLoop();
+                depth -= 2;
+                open.push_back({i, 0, depth, true});
+                break;
+
+            case Token::NEXT:
+                if(open.empty() || !open.back().loop || depth != open.back().depth + 1) throw malformedLoop();
+                postfix[open.back().branch].index = int(i);
+                tok.index = int(open.back().branch);
+                open.pop_back();
+                break;
+
+            case Token::JUMP:
+                if(open.empty() || open.back().loop || open.back().jump || depth != open.back().depth + 1) throw malformed();
+                open.back().jump = i;
+                postfix[open.back().branch].index = int(i + 1);
+                break;
+
+            case Token::JOIN:
+                if(open.empty() || open.back().loop || !open.back().jump || depth != open.back().depth + 2) throw malformed();
+                postfix[open.back().jump].index = int(i);
+                open.pop_back();
+                depth -= 2;
+                break;
+
+            case Token::OPERATOR:
+                if(tok.op == 'u') pop(1, "operand for unary minus");
+                else if(tok.op == '%') pop(1, "operand for '%'");
+                else pop(2, "operand for binary operator");
+                ++depth;
+                break;
+
+            case Token::FUNCTION:
+                pop(builtinFunctions()[tok.index].arity, "argument for ", builtinFunctions()[tok.index].name);
+                ++depth;
+                break;
+
+            case Token::OUTPUT: pop(1, "result to output"); break;
+            case Token::STORE: break;
+            default: ++depth; break;   // NUMBER, VARIABLE, PARAM, LOAD, INDEX
+        }
+    }
+
+    if(!open.empty()) throw malformed();
+}
+
+// ----------------------------
+// Evaluate postfix expression
+// Handles unary minus 'u' and binary operators
+// Prints every step when trace is set; a program's OUTPUT
+// tokens pop their results into outputs
+// ----------------------------
+double Calculator::evaluatePostfix(const std::vector<Token>& postfix, const double* vars, bool trace, double* outputs)
+{
+    std::stack<double> st;
+    std::vector<double> temps;
+    std::vector<LoopFrame> loops;
+
+    for(size_t pc = 0; pc < postfix.size(); ++pc)
+    {
+        const auto &tok = postfix[pc];
+
+        if(tok.type == Token::NUMBER)
+        {
+            st.push(tok.value);
+            if(trace) std::cout << "\nPush " << tok.value << " onto stack\n";
+        }
+
+        else if(tok.type == Token::BRANCH)
+        {
+            if(st.empty())
+                throw std::runtime_error("Invalid expression: missing condition.");
+
+            bool taken = st.top() != 0;
+            st.pop();
+            if(trace) std::cout << "Condition is " << (taken ? "true" : "false, skip to the other branch") << "\n";
+            if(!taken) pc = tok.index - 1;
+        }
+
+        else if(tok.type == Token::JUMP) pc = tok.index - 1;
+        else if(tok.type == Token::JOIN) continue;
+
+        else if(tok.type == Token::LOOP)
+        {
+            if(st.size() < 2)
+                throw std::runtime_error("Invalid expression: missing range bounds.");
+
+            double to = st.top();
+            st.pop();
+            double from = st.top();
+            st.pop();
+            double result;
+
+            if(!beginLoop(tok.op, from, to))
+            {
+                st.push(tok.op == '*' ? 1 : 0);
+                pc = tok.index;
+                if(trace) std::cout << "Empty range for " << aggregateName(tok.op) << " -> " << st.top() << "\n";
+            }
+            else if(aggregateBlocks(postfix, pc, vars, loops, from, to, result))
+            {
+                st.push(result);
+                pc = tok.index;
+                if(trace) std::cout << aggregateName(tok.op) << " over " << from << ".." << to << " in batches -> " << result << "\n";
+            }
+            else
+            {
+                loops.push_back({from, to});
+                st.push(tok.op == '*' ? 1 : 0);
+            }
+        }
+
+        else if(tok.type == Token::INDEX)
+        {
+            st.push(loops[loops.size() - 1 - tok.index].i);
+            if(trace) std::cout << "\nPush loop variable " << st.top() << " onto stack\n";
+        }
+
+        else if(tok.type == Token::NEXT)
+        {
+            // linkJumps() saw to this; a body that ate the result would be a bug there
+            if(st.size() < 2 || loops.empty())
+                throw std::runtime_error("Invalid expression: malformed aggregation.");
+
+            double x = st.top();
+            st.pop();
+            double &acc = st.top();
+            LoopFrame &loop = loops.back();
+
+            switch(tok.op)
+            {
+                case '+': neumaierAdd(acc, loop.comp, x); break;
+                case '*': acc *= x; break;
+                case '<': if(loop.first || x < acc) acc = x; break;
+                case '>': if(loop.first || x > acc) acc = x; break;
+            }
+            loop.first = false;
+
+            if(++loop.i <= loop.to) pc = tok.index;
+            else
+            {
+                acc += loop.comp;
+                loops.pop_back();
+                if(trace) std::cout << aggregateName(tok.op) << " done -> " << acc << "\n";
+            }
+        }
+
+        else if(tok.type == Token::STORE)
+        {
+            if(temps.size() <= size_t(tok.index)) temps.resize(tok.index + 1);
+            temps[tok.index] = st.top();
+            if(trace) std::cout << "Keep " << st.top() << " as t" << tok.index << "\n";
+        }
+
+        else if(tok.type == Token::LOAD)
+        {
+            st.push(temps[tok.index]);
+            if(trace) std::cout << "\nReuse t" << tok.index << " = " << temps[tok.index] << "\n";
+        }
+
+        else if(tok.type == Token::OUTPUT)
+        {
+            outputs[tok.index] = st.top();
+            st.pop();
+        }
+
+        else if(tok.type == Token::VARIABLE)
+        {
+            st.push(vars[tok.index]);
+            if(trace) std::cout << "\nPush variable " << vars[tok.index] << " onto stack\n";
+        }
+
+        else if(tok.type == Token::FUNCTION)
+        {
+            const auto &fn = builtinFunctions()[tok.index];
+            if(st.size() < size_t(fn.arity))
+                throw std::runtime_error(std::string("Invalid expression: missing argument for ") + fn.name + ".");
+
+            double args[2];   // no built-in takes more
+            for(int k = fn.arity; k-- > 0;) { args[k] = st.top(); st.pop(); }
+
+            double r = fn.scalar(args);
+            st.push(r);
+            if(trace) std::cout << "Calling " << fn.name << " -> " << r << "\n";
+        }
+
+        else if(tok.type == Token::OPERATOR)
+        {
+            if(tok.op == 'u')
+            {
+                if(st.empty())
+                    throw std::runtime_error("Invalid expression: missing operand for unary minus.");
+
+                double x = st.top();
+                st.pop();
+                st.push(-x);
+                if(trace) std::cout << "Unary minus applied: -" << x << " -> pushed " << -x << "\n";
+            }
+
+            else if(tok.op == '%')
+            {
+                if(st.empty())
+                    throw std::runtime_error("Invalid expression: missing operand for '%'.");
+                
+                double x = st.top();
+                st.pop();
+
+                double r = x / 100.0;
+                st.push(r);
+                if(trace) std::cout << "Percent applied: " << x << "% -> pushed " << r << "\n";
+            }
+
+            else
+            {
+                if(st.size() < 2)
+                    throw std::runtime_error("Invalid expression: missing operand for binary operator.");
+
+                double y = st.top();
+                st.pop();
+                double x = st.top();
+                st.pop();
+
+                double r = applyOperation(x, y, tok.op);
+                st.push(r);
+                if(trace) std::cout << "Applying " << operatorName(tok.op) << " to " << x << " and " << y << " -> " << r << "\n";
+            }
+        }
+    }
+
+    if(st.size() != (outputs ? 0 : 1))
+        throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+
+    return outputs ? 0 : st.top();
+}
+
+// ----------------------------
+// Check the bounds of sum(i, from, to, ...) and friends. An empty
+// range gives 0 for sum and 1 for product (returns false); min
+// and max of nothing is an error
+// ----------------------------
+bool Calculator::beginLoop(char kind, double from, double to)
+{
+    if(std::floor(from) != from || std::floor(to) != to)
+        throw std::runtime_error("Range bounds must be integers.");
+    if(std::fabs(from) > 9007199254740992.0 || std::fabs(to) > 9007199254740992.0)
+        throw std::runtime_error("Range bounds are too large.");
+
+    if(from <= to) return true;
+    if(kind == '<' || kind == '>')
+        throw std::runtime_error(std::string("Empty range for ") + aggregateName(kind) + ".");
+    return false;
+}
+
+// ----------------------------
+// Fast path for sum(i, from, to, body) and friends. When the body
+// has no loop of its own, everything in it but i is fixed for the
+// whole range: variables and outer loop counters become constants
+// (and fold), and the body runs as a batch program over a column
+// of i values, in chunks through evaluateBlocks. Long ranges spread
+// the chunks over all cores; chunk results are combined in chunk
+// order, so the result does not depend on the thread count. Sums
+// are compensated within and across chunks. Returns false for
+// short ranges and bodies that need the plain loop
+// ----------------------------
+bool Calculator::aggregateBlocks(const std::vector<Token>& postfix, size_t loop, const double* vars, const std::vector<LoopFrame>& outer,
+                                 double from, double to, double& result)
+{
+    constexpr size_t chunk = 4096, chunksPerThread = 8;
+    if(to - from + 1 < 64) return false;
+
+    const Token &head = postfix[loop];
+    std::vector<Token> body(postfix.begin() + loop + 1, postfix.begin() + head.index);
+
+    for(auto &tok : body)
+    {
+        if(tok.type == Token::LOOP || tok.type == Token::OUTPUT) return false;
+
+        if(tok.type == Token::VARIABLE) tok = {Token::NUMBER, vars[tok.index], 0};
+        else if(tok.type == Token::INDEX && tok.index == 0) tok = {Token::VARIABLE, 0, 0};
+        else if(tok.type == Token::INDEX) tok = {Token::NUMBER, outer[outer.size() - tok.index].i, 0};
+    }
+
+    foldConstants(body);
+    linkJumps(body);
+
+    size_t count = size_t(to - from) + 1;
+    size_t chunks = (count + chunk - 1) / chunk;
+    char kind = head.op;
+
+    struct Partial { double value, comp = 0; };
+    std::vector<Partial> partials(chunks);
+    std::vector<std::exception_ptr> errors(chunks);
+    std::atomic<size_t> next{0}, firstError{chunks};
+
+    auto combine = [kind](Partial& p, double x)
+    {
+        switch(kind)
+        {
+            case '+': neumaierAdd(p.value, p.comp, x); break;
+            case '*': p.value *= x; break;
+            case '<': if(x < p.value) p.value = x; break;
+            case '>': if(x > p.value) p.value = x; break;
+        }
+    };
+
+    // Chunks are handed out in order: after an error, the ones before it still finish
+    auto work = [&]()
+    {
+        std::vector<double> index(chunk), values(chunk);
+        const double* columns[1] = {index.data()};
+        double* outs[1] = {values.data()};
+
+        for(size_t c; (c = next++) < chunks && c < firstError;)
+        {
+            size_t n = std::min(chunk, count - c * chunk);
+            double start = from + double(c * chunk);
+            for(size_t k = 0; k < n; ++k) index[k] = start + double(k);
+
+            try { evaluateBlocks(body, columns, n, outs); }
+            catch (...)
+            {
+                errors[c] = std::current_exception();
+                for(size_t seen = firstError; c < seen && !firstError.compare_exchange_weak(seen, c);) {}
+                return;
+            }
+
+            // A local total stays in registers
+            Partial p{kind == '+' ? 0 : kind == '*' ? 1 : values[0]};
+            for(size_t k = kind == '<' || kind == '>' ? 1 : 0; k < n; ++k) combine(p, values[k]);
+            partials[c] = p;
+        }
+    };
+
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), chunks / chunksPerThread);
+    if(threads <= 1) work();
+    else
+    {
+        std::vector<std::thread> pool;
+        for(size_t k = 0; k < threads; ++k) pool.emplace_back(work);
+        for(auto &t : pool) t.join();
+    }
+
+    for(const auto &e : errors)
+        if(e) std::rethrow_exception(e);
+
+    Partial total = partials[0];
+    for(size_t c = 1; c < chunks; ++c)
+    {
+        combine(total, partials[c].value);
+        total.comp += partials[c].comp;
+    }
+
+    result = total.value + total.comp;
+    return true;
+}
+
+// ----------------------------
+// Evaluate postfix in any number system
+// Arith supplies literal(), constant(), negate(), percent(),
+// apply(), call(), truth() for conditions and integer() for
+// range bounds. Aggregations always run the plain loop here
+// ----------------------------
+template<class Arith>
+typename Arith::Num Calculator::evaluatePostfixAs(const std::vector<Token>& postfix, std::string_view src, const Arith& arith, const double* vars)
+{
+    using Num = typename Arith::Num;
+    std::vector<Num> st, temps;
+    std::vector<LoopFrame> loops;
+
+    for(size_t pc = 0; pc < postfix.size(); ++pc)
+    {
+        const auto &tok = postfix[pc];
+
+        if(tok.type == Token::NUMBER)
+            st.push_back(arith.literal(src.substr(tok.pos, tok.len), tok.value));
+
+        else if(tok.type == Token::BRANCH)
+        {
+            if(st.empty())
+                throw std::runtime_error("Invalid expression: missing condition.");
+
+            bool taken = arith.truth(st.back());
+            st.pop_back();
+            if(!taken) pc = tok.index - 1;
+        }
+
+        else if(tok.type == Token::JUMP) pc = tok.index - 1;
+        else if(tok.type == Token::JOIN) continue;
+
+        else if(tok.type == Token::LOOP)
+        {
+            if(st.size() < 2)
+                throw std::runtime_error("Invalid expression: missing range bounds.");
+
+            double from = arith.integer(st[st.size() - 2]), to = arith.integer(st.back());
+            st.resize(st.size() - 2);
+            st.push_back(arith.constant(tok.op == '*' ? 1 : 0));
+
+            if(beginLoop(tok.op, from, to)) loops.push_back({from, to});
+            else pc = tok.index;
+        }
+
+        else if(tok.type == Token::INDEX)
+            st.push_back(arith.constant(loops[loops.size() - 1 - tok.index].i));
+
+        else if(tok.type == Token::NEXT)
+        {
+            // The result so far, then the body's value
+            if(st.size() < 2 || loops.empty())
+                throw std::runtime_error("Invalid expression: malformed aggregation.");
+
+            Num* args = &st[st.size() - 2];
+            LoopFrame &loop = loops.back();
+
+            if(tok.op == '+' || tok.op == '*') args[0] = arith.apply(args[0], args[1], tok.op);
+            else if(loop.first) args[0] = std::move(args[1]);
+            else args[0] = arith.call(builtinFunctions()[tok.op == '<' ? BuiltinFunction::MIN : BuiltinFunction::MAX], args);
+
+            st.pop_back();
+            loop.first = false;
+
+            if(++loop.i <= loop.to) pc = tok.index;
+            else loops.pop_back();
+        }
+
+        else if(tok.type == Token::STORE)
+        {
+            if(temps.size() <= size_t(tok.index)) temps.resize(tok.index + 1);
+            temps[tok.index] = st.back();
+        }
+
+        else if(tok.type == Token::LOAD)
+            st.push_back(temps[tok.index]);
+
+        else if(tok.type == Token::VARIABLE)
+            st.push_back(arith.constant(vars[tok.index]));
+
+        else if(tok.type == Token::FUNCTION)
+        {
+            const auto &fn = builtinFunctions()[tok.index];
+            if(st.size() < size_t(fn.arity))
+                throw std::runtime_error(std::string("Invalid expression: missing argument for ") + fn.name + ".");
+
+            Num r = arith.call(fn, &st[st.size() - fn.arity]);
+            st.resize(st.size() - fn.arity);
+            st.push_back(std::move(r));
+        }
+
+        else if(tok.type == Token::OPERATOR)
+        {
+            if(tok.op == 'u' || tok.op == '%')
+            {
+                if(st.empty())
+                    throw std::runtime_error(tok.op == 'u' ? "Invalid expression: missing operand for unary minus."
+                                                           : "Invalid expression: missing operand for '%'.");
+
+                st.back() = tok.op == 'u' ? arith.negate(st.back()) : arith.percent(st.back());
+            }
+
+            else
+            {
+                if(st.size() < 2)
+                    throw std::runtime_error("Invalid expression: missing operand for binary operator.");
+
+                Num y = std::move(st.back());
+                st.pop_back();
+                st.back() = arith.apply(st.back(), y, tok.op);
+            }
+        }
+    }
+
+    if(st.size() != 1)
+        throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+
+    return std::move(st.back());
+}
+
+std::string Calculator::evaluatePostfixText(const std::vector<Token>& postfix, std::string_view src, Mode mode, const DecimalContext& dc, const double* vars)
+{
+    switch(mode)
+    {
+        case Mode::DECIMAL: return DecimalArith::format(evaluatePostfixAs(postfix, src, DecimalArith(dc), vars));
+        case Mode::RATIONAL: return RationalArith::format(evaluatePostfixAs(postfix, src, RationalArith(), vars));
+        case Mode::INTERVAL: return IntervalArith::format(evaluatePostfixAs(postfix, src, IntervalArith(), vars));
+        case Mode::DOUBLE:  break;
+    }
+    return formatResult(evaluatePostfix(postfix, vars));
+}
+
+// ----------------------------
+// Give every distinct variable name a value slot
+// Returns the names in slot order
+// ----------------------------
+std::vector<std::string> Calculator::bindVariables(std::vector<Token>& postfix, std::string_view src)
+{
+    std::vector<std::string> names;
+
+    for(auto &tok : postfix)
+    {
+        if(tok.type != Token::VARIABLE) continue;
+
+        std::string_view name = src.substr(tok.pos, tok.len);
+        auto it = std::find(names.begin(), names.end(), name);
+        tok.index = int(it - names.begin());
+        if(it == names.end()) names.emplace_back(name);
+    }
+    return names;
+}
+
+std::vector<double> Calculator::variableValues(const std::vector<std::string>& names) const
+{
+    std::vector<double> values;
+    values.reserve(names.size());
+
+    for(const auto &name : names)
+    {
+        auto it = variables.find(name);
+        if(it == variables.end())
+            throw std::runtime_error("Unknown variable: " + name);
+        values.push_back(it->second);
+    }
+    return values;
+}
+
+double Calculator::evaluateExpr()
+{
+    auto tokens = tokenize(expr);
+    debug(tokens, "After Tokenization", expr);
+
+    std::string extra;
+    auto postfix = inlineCalls(toPostfix(tokens, expr), expr.size(), extra);
+    if(mode == Mode::DOUBLE) foldConstants(postfix);
+    linkJumps(postfix);
+
+    std::string text = extra.empty() ? expr : expr + "\n" + extra;
+    size_t eliminated = eliminateCommonSubexpressions(postfix, text, mode != Mode::DOUBLE);
+    debug(postfix, "Postfix Conversion", text);
+
+    if(eliminated)
+        std::cout << "\nCommon subexpressions: " << eliminated << (eliminated == 1 ? " operation" : " operations") << " eliminated\n";
+
+    auto values = variableValues(bindVariables(postfix, text));
+
+    resultText.clear();
+    if(mode != Mode::DOUBLE)
+    {
+        // The answer lives in resultText; there is no double to report
+        resultText = evaluatePostfixText(postfix, text, mode, decimalCtx, values.data());
+        result = std::numeric_limits<double>::quiet_NaN();
+        return result;
+    }
+
+    result = evaluatePostfix(postfix, values.data(), true);
+    return result;
+}
+
+// ----------------------------
+// User function lookup helpers
+// ----------------------------
+int Calculator::findUserFunction(std::string_view name) const
+{
+    for(size_t i = 0; i < userFunctions.size(); ++i)
+        if(userFunctions[i].name == name) return int(i);
+    return -1;
+}
+
+int Calculator::arityOf(const Token& fn) const
+{
+    if(fn.type == Token::CALL) return int(userFunctions[fn.index].params.size());
+    return builtinFunctions()[fn.index].arity;
+}
+
+std::string Calculator::functionName(const Token& fn) const
+{
+    if(fn.type == Token::CALL) return userFunctions[fn.index].name;
+    return builtinFunctions()[fn.index].name;
+}
+
+// ----------------------------
+// Define a function: "name(a, b) = body"
+// Parameters become PARAM tokens; calls to functions defined
+// earlier are inlined right away, so bodies are always flat
+// ----------------------------
+void Calculator::define(std::string_view definition)
+{
+    size_t open = definition.find('('), close = definition.find(')'), eq = definition.find('=');
+
+    if(open == std::string_view::npos || close == std::string_view::npos || eq == std::string_view::npos || !(open < close && close < eq))
+        throw std::runtime_error("Expected: def name(a, b) = expression");
+
+    auto trim = [](std::string_view v)
+    {
+        while(!v.empty() && isspace(v.front())) v.remove_prefix(1);
+        while(!v.empty() && isspace(v.back())) v.remove_suffix(1);
+        return v;
+    };
+
+    auto isName = [](std::string_view v)
+    {
+        return !v.empty() && (isalpha(v[0]) || v[0] == '_') && std::all_of(v.begin(), v.end(), [](char ch) { return isalnum(ch) || ch == '_'; });
+    };
+
+    UserFunction fn;
+    fn.name = std::string(trim(definition.substr(0, open)));
+
+    if(!isName(fn.name))
+        throw std::runtime_error("Invalid function name: " + fn.name);
+    if(findBuiltin(fn.name) >= 0 || findAggregate(fn.name))
+        throw std::runtime_error("Cannot redefine built-in function " + fn.name + ".");
+
+    std::string_view params = definition.substr(open + 1, close - open - 1);
+    while(!trim(params).empty())
+    {
+        size_t comma = params.find(',');
+        std::string_view param = trim(params.substr(0, comma));
+
+        if(!isName(param))
+            throw std::runtime_error("Invalid parameter name: " + std::string(param));
+        if(std::find(fn.params.begin(), fn.params.end(), param) != fn.params.end())
+            throw std::runtime_error("Duplicate parameter: " + std::string(param));
+
+        fn.params.emplace_back(param);
+        if(comma == std::string_view::npos) break;
+        params.remove_prefix(comma + 1);
+    }
+
+    std::string_view body = definition.substr(eq + 1);
+    auto postfix = toPostfix(tokenize(body), body);
+
+    for(auto &tok : postfix)
+    {
+        if(tok.type != Token::VARIABLE) continue;
+
+        auto it = std::find(fn.params.begin(), fn.params.end(), body.substr(tok.pos, tok.len));
+        if(it != fn.params.end())
+        {
+            tok.type = Token::PARAM;
+            tok.index = int(it - fn.params.begin());
+        }
+    }
+
+    std::string extra;
+    fn.body = inlineCalls(postfix, body.size(), extra);
+    fn.text = std::string(body) + "\n" + extra;
+
+    int existing = findUserFunction(fn.name);
+    if(existing >= 0) userFunctions[existing] = std::move(fn);
+    else userFunctions.push_back(std::move(fn));
+}
+
+// ----------------------------
+// Replace every CALL by the callee's body with its PARAM tokens
+// replaced by the argument postfix. Operand starts are tracked on
+// a stack so each argument is a contiguous slice of the output.
+// Body spans are shifted to where the body text lands in
+// src + '\n' + extra
+// ----------------------------
+std::vector<Calculator::Token> Calculator::inlineCalls(const std::vector<Token>& postfix, size_t srcSize, std::string& extra) const
+{
+    bool hasCalls = std::any_of(postfix.begin(), postfix.end(), [](const Token& t) { return t.type == Token::CALL; });
+    if(!hasCalls) return postfix;
+
+    std::vector<Token> out;
+    std::vector<size_t> starts;
+
+    auto popOperands = [&](size_t count, const char* what)
+    {
+        if(starts.size() < count)
+            throw std::runtime_error(std::string("Invalid expression: missing operand for ") + what + ".");
+
+        size_t first = starts[starts.size() - count];
+        starts.resize(starts.size() - count);
+        return first;
+    };
+
+    for(const auto &tok : postfix)
+    {
+        switch(tok.type)
+        {
+            case Token::OPERATOR:
+            {
+                bool unary = tok.op == 'u' || tok.op == '%';
+                size_t first = popOperands(unary ? 1 : 2, unary ? "unary operator" : "binary operator");
+                out.push_back(tok);
+                starts.push_back(first);
+                break;
+            }
+
+            case Token::FUNCTION:
+            {
+                size_t first = popOperands(builtinFunctions()[tok.index].arity, builtinFunctions()[tok.index].name);
+                out.push_back(tok);
+                starts.push_back(first);
+                break;
+            }
+
+            case Token::BRANCH:
+            case Token::JUMP:
+            case Token::LOOP:
+                out.push_back(tok);
+                break;
+
+            case Token::JOIN:
+            case Token::NEXT:
+            {
+                size_t first = popOperands(3, tok.type == Token::JOIN ? "conditional" : aggregateName(tok.op));
+                out.push_back(tok);
+                starts.push_back(first);
+                break;
+            }
+
+            case Token::CALL:
+            {
+                const auto &fn = userFunctions[tok.index];
+                size_t count = fn.params.size();
+
+                if(starts.size() < count)
+                    throw std::runtime_error("Invalid expression: missing argument for " + fn.name + ".");
+
+                std::vector<std::vector<Token>> args(count);
+                for(size_t k = 0; k < count; ++k)
+                {
+                    size_t from = starts[starts.size() - count + k];
+                    size_t to = k + 1 < count ? starts[starts.size() - count + k + 1] : out.size();
+                    args[k].assign(out.begin() + from, out.begin() + to);
+                }
+
+                size_t first = count ? popOperands(count, fn.name.c_str()) : out.size();
+                out.resize(first);
+
+                size_t offset = srcSize + 1 + extra.size();
+                extra += fn.text;
+                extra += '\n';
+
+                // An argument placed inside loops of the body must
+                // skip them to reach its own loop variables
+                int loops = 0;
+
+                for(const auto &b : fn.body)
+                {
+                    if(b.type == Token::PARAM)
+                    {
+                        int inner = 0;
+                        for(const auto &a : args[b.index])
+                        {
+                            Token t = a;
+                            if(t.type == Token::LOOP) ++inner;
+                            else if(t.type == Token::NEXT) --inner;
+                            else if(t.type == Token::INDEX && t.index >= inner) t.index += loops;
+                            out.push_back(t);
+                        }
+                        continue;
+                    }
+
+                    if(b.type == Token::LOOP) ++loops;
+                    else if(b.type == Token::NEXT) --loops;
+
+                    Token t = b;
+                    t.pos += offset;
+                    out.push_back(t);
+                }
+
+                starts.push_back(first);
+                break;
+            }
+
+            default:
+                starts.push_back(out.size());
+                out.push_back(tok);
+                break;
+        }
+    }
+
+    return out;
+}
+
+// ----------------------------
+// Constant folding (double mode only): any operator or built-in
+// whose operands are all plain numbers is computed now. Errors such
+// as division by zero are left in place to surface at evaluation
+// ----------------------------
+void Calculator::foldConstants(std::vector<Token>& postfix)
+{
+    std::vector<Token> out;
+    out.reserve(postfix.size());
+
+    auto constantTail = [&](size_t count)
+    {
+        if(out.size() < count) return false;
+        for(size_t k = out.size() - count; k < out.size(); ++k)
+            if(out[k].type != Token::NUMBER) return false;
+        return true;
+    };
+
+    // Operands of a folded token are the last `count` outputs only when
+    // they are single NUMBER tokens, so checking the tail is enough
+    for(const auto &tok : postfix)
+    {
+        int count = 0;
+        if(tok.type == Token::OPERATOR) count = (tok.op == 'u' || tok.op == '%') ? 1 : 2;
+        else if(tok.type == Token::FUNCTION) count = builtinFunctions()[tok.index].arity;
+
+        if(count == 0 || !constantTail(count))
+        {
+            out.push_back(tok);
+            continue;
+        }
+
+        const Token* args = &out[out.size() - count];
+        double value;
+
+        try
+        {
+            double in[2] = {args[0].value, count > 1 ? args[1].value : 0};
+            value = applyToken(tok, in);
+        }
+        catch (const std::runtime_error&)
+        {
+            out.push_back(tok);
+            continue;
+        }
+
+        // The span covers the operator and every operand: a function
+        // name comes before its arguments, a binary operator between
+        size_t pos = tok.pos, end = tok.pos + tok.len;
+        for(int k = 0; k < count; ++k)
+        {
+            if(!args[k].len) continue;
+            pos = std::min(pos, args[k].pos);
+            end = std::max(end, args[k].pos + args[k].len);
+        }
+        out.resize(out.size() - count);
+        out.push_back({Token::NUMBER, value, 0, pos, end - pos});
+    }
+
+    postfix = std::move(out);
+}
+
+// ----------------------------
+// Common subexpression elimination by hash-consing: every postfix
+// token becomes a node keyed by (kind, operator, literal, children),
+// so equal subtrees map to one node. The DAG is then written back
+// as postfix; a node with several parents is computed once, kept
+// with STORE and pushed again with LOAD. Returns the number of
+// operators and calls removed.
+// A program (see compileProgram) ends each result with OUTPUT; its
+// roots are emitted in order, each followed by its OUTPUT again.
+// Literals are keyed by their text in the exact modes, where
+// 0.1 and 0.10 may differ; + and * operands are put in a fixed
+// order so a+b and b+a share a node.
+// Each branch of a conditional is its own region and nodes are
+// only shared within a region: a value kept in a branch that did
+// not run must never be loaded. A loop body is a region as well,
+// since it runs once per value of its variable
+// ----------------------------
+size_t Calculator::eliminateCommonSubexpressions(std::vector<Token>& postfix, std::string_view src, bool literalText)
+{
+    struct Node
+    {
+        Token tok;
+        int kids[3] = {-1, -1, -1};
+        int arity = 0;
+        int parents = 0;
+        int temp = -1;
+        bool visited = false;
+    };
+
+    using Key = std::tuple<int, int, uint64_t, std::string_view, int, int, int, int>;
+    std::map<Key, int> ids;
+    std::vector<Node> nodes;
+    std::vector<int> st, roots;
+    std::vector<Token> outputs;
+    std::vector<int> regions{0};
+    int nextRegion = 1;
+    size_t opsBefore = 0;
+
+    for(const auto &tok : postfix)
+    {
+        if(tok.type == Token::BRANCH || tok.type == Token::LOOP) { regions.push_back(nextRegion++); continue; }
+        if(tok.type == Token::JUMP) { regions.back() = nextRegion++; continue; }
+
+        if(tok.type == Token::OUTPUT)
+        {
+            if(st.empty()) return 0;
+
+            roots.push_back(st.back());
+            ++nodes[st.back()].parents;
+            outputs.push_back(tok);
+            st.pop_back();
+            continue;
+        }
+
+        Node node;
+        node.tok = tok;
+
+        uint64_t bits = 0;
+        std::string_view text;
+
+        if(tok.type == Token::NUMBER)
+        {
+            memcpy(&bits, &tok.value, sizeof bits);
+            if(literalText) text = src.substr(tok.pos, tok.len);
+        }
+        else if(tok.type == Token::VARIABLE) text = src.substr(tok.pos, tok.len);
+        else if(tok.type == Token::OPERATOR) node.arity = (tok.op == 'u' || tok.op == '%') ? 1 : 2;
+        else if(tok.type == Token::FUNCTION) node.arity = builtinFunctions()[tok.index].arity;
+        else if(tok.type == Token::JOIN || tok.type == Token::NEXT)
+        {
+            if(regions.size() < 2) return 0;
+            regions.pop_back();
+            node.arity = 3;
+        }
+        else if(tok.type != Token::INDEX) return 0;   // already rewritten
+
+        // Malformed input: keep it as is so evaluation reports the error
+        if(st.size() < size_t(node.arity)) return 0;
+
+        for(int k = node.arity; k-- > 0;) { node.kids[k] = st.back(); st.pop_back(); }
+        if(node.arity) ++opsBefore;
+
+        bool commutes = tok.type == Token::OPERATOR && (tok.op == '+' || tok.op == '*');
+        if(commutes && node.kids[0] > node.kids[1]) std::swap(node.kids[0], node.kids[1]);
+
+        int region = node.arity || tok.type == Token::INDEX ? regions.back() : 0;
+        int op = tok.type == Token::OPERATOR || tok.type == Token::JOIN || tok.type == Token::NEXT ? tok.op : tok.index;
+        Key key{tok.type, op, bits, text, region, node.kids[0], node.kids[1], node.kids[2]};
+        auto found = ids.find(key);
+
+        if(found != ids.end()) { st.push_back(found->second); continue; }
+
+        for(int k = 0; k < node.arity; ++k) ++nodes[node.kids[k]].parents;
+        ids.emplace(key, int(nodes.size()));
+        st.push_back(int(nodes.size()));
+        nodes.push_back(node);
+    }
+
+    if(outputs.empty() ? st.size() != 1 : !st.empty()) return 0;
+    if(outputs.empty()) roots.push_back(st.back());
+
+    // Emit the DAG depth first, left to right, without recursion so
+    // long generated formulas cannot exhaust the call stack. A
+    // conditional gets its BRANCH and JUMP back between its parts,
+    // a loop its LOOP before the body
+    enum Step { VISIT, EMIT, EMIT_BRANCH, EMIT_JUMP, EMIT_LOOP };
+    std::vector<Token> out;
+    std::vector<std::pair<int, Step>> work;
+    size_t opsAfter = 0;
+    int temps = 0;
+
+    for(size_t r = 0; r < roots.size(); ++r)
+    {
+        work.push_back({roots[r], VISIT});
+
+        while(!work.empty())
+        {
+            auto [id, step] = work.back();
+            work.pop_back();
+            Node &node = nodes[id];
+
+            if(step == EMIT_BRANCH || step == EMIT_JUMP)
+            {
+                out.push_back({step == EMIT_BRANCH ? Token::BRANCH : Token::JUMP, 0, 0, node.tok.pos, node.tok.len});
+                continue;
+            }
+
+            if(step == EMIT_LOOP)
+            {
+                out.push_back({Token::LOOP, 0, node.tok.op, node.tok.pos, node.tok.len});
+                continue;
+            }
+
+            if(step == EMIT)
+            {
+                out.push_back(node.tok);
+                ++opsAfter;
+
+                if(node.parents > 1)
+                {
+                    node.temp = temps++;
+                    out.push_back({Token::STORE, 0, 0, node.tok.pos, node.tok.len, node.temp});
+                }
+                continue;
+            }
+
+            if(node.arity == 0) { out.push_back(node.tok); continue; }
+
+            if(node.visited)
+            {
+                out.push_back({Token::LOAD, 0, 0, node.tok.pos, node.tok.len, node.temp});
+                continue;
+            }
+
+            node.visited = true;
+            work.push_back({id, EMIT});
+
+            for(int k = node.arity; k-- > 0;)
+            {
+                work.push_back({node.kids[k], VISIT});
+                if(node.tok.type == Token::JOIN && k) work.push_back({id, k == 1 ? EMIT_BRANCH : EMIT_JUMP});
+                if(node.tok.type == Token::NEXT && k == 2) work.push_back({id, EMIT_LOOP});
+            }
+        }
+
+        if(!outputs.empty()) out.push_back(outputs[r]);
+    }
+
+    if(opsAfter == opsBefore) return 0;
+
+    postfix = std::move(out);
+    linkJumps(postfix);
+    return opsBefore - opsAfter;
+}
+
+// ----------------------------
+// One operator or built-in call on plain doubles
+// ----------------------------
+double Calculator::applyToken(const Token& tok, const double* args)
+{
+    if(tok.type == Token::FUNCTION) return builtinFunctions()[tok.index].scalar(args);
+    if(tok.op == 'u') return -args[0];
+    if(tok.op == '%') return args[0] / 100.0;
+    return applyOperation(args[0], args[1], tok.op);
+}
+
+std::vector<Calculator::Token> Calculator::compilePostfix(std::string_view src, std::string& extra, bool fold) const
+{
+    auto postfix = inlineCalls(toPostfix(tokenize(src), src), src.size(), extra);
+    if(fold) foldConstants(postfix);
+    linkJumps(postfix);
+    return postfix;
+}
+
+// ----------------------------
+// Compile once, evaluate many times from any thread
+// ----------------------------
+Calculator::CompiledExpr Calculator::compile(std::string_view src) const
+{
+    CompiledExpr ce;
+    std::string extra;
+    ce.postfix = compilePostfix(src, extra, mode == Mode::DOUBLE);
+    ce.source = src;
+    if(!extra.empty()) ce.source += "\n" + extra;
+    ce.mode = mode;
+    ce.decimalCtx = decimalCtx;
+    ce.eliminated = eliminateCommonSubexpressions(ce.postfix, ce.source, mode != Mode::DOUBLE);
+    ce.vars = bindVariables(ce.postfix, ce.source);
+    captureBindings(ce.vars, ce.bound, ce.unbound);
+    return ce;
+}
+
+// Capture what is bound now; the rest must come with evaluate()
+void Calculator::captureBindings(const std::vector<std::string>& names, std::vector<double>& bound, std::string& unbound) const
+{
+    for(const auto &name : names)
+    {
+        auto it = variables.find(name);
+        bound.push_back(it == variables.end() ? std::numeric_limits<double>::quiet_NaN() : it->second);
+        if(it == variables.end() && unbound.empty()) unbound = name;
+    }
+}
+
+// ----------------------------
+// Compile a group of expressions into one program. Each one is
+// lowered on its own, then the concatenated postfix (each result
+// followed by an OUTPUT token) is hash-consed as a whole, so a
+// subexpression shared by any of them is computed once per row
+// ----------------------------
+Calculator::CompiledProgram Calculator::compileProgram(const std::vector<std::string>& sources) const
+{
+    CompiledProgram prog;
+
+    for(size_t k = 0; k < sources.size(); ++k)
+    {
+        std::string extra;
+        auto postfix = compilePostfix(sources[k], extra, true);
+
+        // Shift spans so they point into the joined program source
+        size_t offset = prog.source.size();
+        for(auto &tok : postfix) tok.pos += offset;
+
+        prog.source += sources[k];
+        prog.source += '\n';
+        if(!extra.empty()) prog.source += extra;
+
+        prog.postfix.insert(prog.postfix.end(), postfix.begin(), postfix.end());
+        prog.postfix.push_back({Token::OUTPUT, 0, 0, offset, sources[k].size(), int(k)});
+    }
+
+    prog.outputCount = sources.size();
+    linkJumps(prog.postfix);
+    prog.eliminated = eliminateCommonSubexpressions(prog.postfix, prog.source, false);
+    prog.vars = bindVariables(prog.postfix, prog.source);
+    captureBindings(prog.vars, prog.bound, prog.unbound);
+    return prog;
+}
+
+const double* Calculator::CompiledProgram::boundValues() const
+{
+    if(!unbound.empty())
+        throw std::runtime_error("Unknown variable: " + unbound);
+    return bound.data();
+}
+
+void Calculator::CompiledProgram::evaluate(double* out, const double* values) const
+{
+    evaluatePostfix(postfix, values ? values : boundValues(), false, out);
+}
+
+void Calculator::CompiledProgram::evaluateBatch(const double* const* columns, size_t rows, double* const* outs) const
+{
+    evaluateBlocks(postfix, columns, rows, outs);
+}
+
+// ----------------------------
+// Incremental evaluation: the compiled (CSE'd) postfix becomes a
+// node graph, LOAD pointing back at the node its STORE kept, so a
+// shared subexpression is one node recomputed once
+// ----------------------------
+Calculator::IncrementalExpr Calculator::compileIncremental(std::string_view src) const
+{
+    if(mode != Mode::DOUBLE)
+        throw std::runtime_error("Incremental evaluation needs double mode.");
+
+    CompiledExpr ce = compile(src);
+    IncrementalExpr ie;
+    std::vector<int> st, temps;
+
+    for(size_t pc = 0; pc < ce.postfix.size(); ++pc)
+    {
+        const auto &tok = ce.postfix[pc];
+
+        // Read linearly, a conditional is cond then else JOIN
+        if(tok.type == Token::BRANCH || tok.type == Token::JUMP) continue;
+
+        if(tok.type == Token::STORE)
+        {
+            if(temps.size() <= size_t(tok.index)) temps.resize(tok.index + 1);
+            temps[tok.index] = st.back();
+            continue;
+        }
+        if(tok.type == Token::LOAD) { st.push_back(temps[tok.index]); continue; }
+
+        IncrementalExpr::Node node;
+        node.tok = tok;
+        if(tok.type == Token::OPERATOR) node.arity = (tok.op == 'u' || tok.op == '%') ? 1 : 2;
+        else if(tok.type == Token::FUNCTION) node.arity = builtinFunctions()[tok.index].arity;
+        else if(tok.type == Token::JOIN) node.arity = 3;
+        else if(tok.type == Token::LOOP)
+        {
+            node.tok.type = Token::NEXT;
+            node.arity = 2;
+            node.loop = {Token{Token::NUMBER, 0, 0}, Token{Token::NUMBER, 0, 0}};
+            node.loop.insert(node.loop.end(), ce.postfix.begin() + pc, ce.postfix.begin() + tok.index + 1);
+            linkJumps(node.loop);
+            pc = tok.index;
+        }
+
+        if(st.size() < size_t(node.arity))
+            throw std::runtime_error("Invalid expression: missing operand for operator.");
+
+        for(int k = node.arity; k-- > 0;) { node.kids[k] = st.back(); st.pop_back(); }
+        st.push_back(int(ie.nodes.size()));
+        ie.nodes.push_back(node);
+    }
+
+    if(st.size() != 1 || st.back() != int(ie.nodes.size()) - 1)
+        throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+
+    // A node depends on a variable when any child does; children come first
+    ie.affected.resize(ce.vars.size());
+    std::vector<char> depends(ie.nodes.size());
+
+    for(size_t v = 0; v < ce.vars.size(); ++v)
+    {
+        for(size_t i = 0; i < ie.nodes.size(); ++i)
+        {
+            const auto &node = ie.nodes[i];
+            depends[i] = node.tok.type == Token::VARIABLE ? node.tok.index == int(v)
+                       : std::any_of(node.kids, node.kids + node.arity, [&](int kid) { return depends[kid] != 0; }) ||
+                         std::any_of(node.loop.begin(), node.loop.end(), [&](const Token& t) { return t.type == Token::VARIABLE && t.index == int(v); });
+
+            if(depends[i]) ie.affected[v].push_back(int(i));
+        }
+    }
+
+    ie.vars = ce.vars;
+    ie.inputs = ce.bound;
+    for(const auto &name : ie.vars) ie.known.push_back(variables.count(name) != 0);
+    ie.values.resize(ie.nodes.size());
+    ie.errors.resize(ie.nodes.size());
+    return ie;
+}
+
+void Calculator::IncrementalExpr::recompute(const std::vector<int>& order)
+{
+    recomputed = 0;
+
+    for(int i : order)
+    {
+        auto &node = nodes[i];
+        errors[i].clear();
+
+        if(node.tok.type == Token::NUMBER) values[i] = node.tok.value;
+        else if(node.tok.type == Token::VARIABLE) values[i] = inputs[node.tok.index];
+        else if(node.tok.type == Token::JOIN)
+        {
+            // Condition first, then only the branch it picks
+            int c = node.kids[0];
+            int pick = !errors[c].empty() ? c : values[c] != 0 ? node.kids[1] : node.kids[2];
+            errors[i] = errors[pick];
+            values[i] = values[pick];
+        }
+        else
+        {
+            auto failed = std::find_if(node.kids, node.kids + node.arity, [&](int kid) { return !errors[kid].empty(); });
+            if(failed != node.kids + node.arity) errors[i] = errors[*failed];
+            else
+            {
+                double args[2] = {values[node.kids[0]], node.arity > 1 ? values[node.kids[1]] : 0};
+                try
+                {
+                    if(node.tok.type != Token::NEXT) values[i] = applyToken(node.tok, args);
+                    else
+                    {
+                        node.loop[0].value = args[0];
+                        node.loop[1].value = args[1];
+                        values[i] = evaluatePostfix(node.loop, inputs.data());
+                    }
+                }
+                catch (const std::runtime_error& e) { errors[i] = e.what(); }
+            }
+        }
+        ++recomputed;
+    }
+
+    stale = false;
+}
+
+double Calculator::IncrementalExpr::result() const
+{
+    if(!errors.back().empty()) throw std::runtime_error(errors.back());
+    return values.back();
+}
+
+void Calculator::IncrementalExpr::recomputeAll()
+{
+    for(size_t k = 0; k < vars.size(); ++k)
+        if(!known[k]) throw std::runtime_error("Unknown variable: " + vars[k]);
+
+    std::vector<int> order(nodes.size());
+    for(size_t i = 0; i < order.size(); ++i) order[i] = int(i);
+    recompute(order);
+}
+
+double Calculator::IncrementalExpr::value()
+{
+    if(stale) recomputeAll();
+    return result();
+}
+
+// An error (e.g. division by zero) is kept per node, so the graph
+// stays consistent and the next set() recomputes only what changed
+double Calculator::IncrementalExpr::set(size_t slot, double v)
+{
+    if(slot >= inputs.size())
+        throw std::runtime_error("Variable slot out of range.");
+
+    inputs[slot] = v;
+    known[slot] = 1;
+
+    if(stale) recomputeAll();
+    else recompute(affected[slot]);
+
+    return result();
+}
+
+double Calculator::IncrementalExpr::set(std::string_view name, double v)
+{
+    auto it = std::find(vars.begin(), vars.end(), name);
+    if(it == vars.end())
+        throw std::runtime_error("Expression does not use variable " + std::string(name) + ".");
+
+    return set(size_t(it - vars.begin()), v);
+}
+
+// ----------------------------
+// Symbolic differentiation on the lowered postfix (user functions
+// already inlined). Each subtree is a contiguous postfix slice; the
+// rules build new slices through helpers that simplify as they go:
+// x+0, x*1, x*0, x^1 and -(-x) collapse, negation moves out of
+// products so a + -b becomes a - b, and operations on two
+// constants fold. Outside double mode only integer results fold,
+// since those are exact in every number system
+// ----------------------------
+std::string Calculator::derivative(std::string_view src, std::string_view var) const
+{
+    using Expr = std::vector<Token>;
+
+    std::string extra;
+    Expr postfix = compilePostfix(src, extra, mode == Mode::DOUBLE);
+
+    std::string joined;
+    std::string_view text = src;
+    if(!extra.empty())
+    {
+        joined.append(src).append("\n").append(extra);
+        text = joined;
+    }
+
+    // Subtree starts, as in inlineCalls; a conditional is read
+    // linearly as cond then else JOIN, a loop as from to body NEXT
+    std::vector<size_t> start(postfix.size());
+    std::vector<std::array<size_t, 3>> kids(postfix.size());
+    std::vector<size_t> st;
+
+    auto arityOf = [](const Token& tok)
+    {
+        if(tok.type == Token::OPERATOR) return (tok.op == 'u' || tok.op == '%') ? 1 : 2;
+        if(tok.type == Token::FUNCTION) return builtinFunctions()[tok.index].arity;
+        if(tok.type == Token::JOIN || tok.type == Token::NEXT) return 3;
+        return 0;
+    };
+
+    for(size_t i = 0; i < postfix.size(); ++i)
+    {
+        if(postfix[i].type == Token::BRANCH || postfix[i].type == Token::JUMP || postfix[i].type == Token::LOOP) continue;
+
+        int arity = arityOf(postfix[i]);
+        if(st.size() < size_t(arity))
+            throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+
+        for(int k = arity; k-- > 0;) { kids[i][k] = st.back(); st.pop_back(); }
+        start[i] = arity ? start[kids[i][0]] : i;
+        st.push_back(i);
+    }
+
+    if(st.size() != 1)
+        throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+
+    auto slice = [&](size_t i) { return Expr(postfix.begin() + start[i], postfix.begin() + i + 1); };
+    auto isConst = [](const Expr& e) { return e.size() == 1 && e[0].type == Token::NUMBER; };
+    auto is = [&](const Expr& e, double v) { return isConst(e) && e[0].value == v; };
+    auto num = [](double v) { return Expr{{Token::NUMBER, v, 0}}; };
+
+    auto exactInt = [](double v) { return v == std::floor(v) && std::fabs(v) < 9007199254740992.0; };
+    bool foldAll = mode == Mode::DOUBLE;
+
+    auto fold = [&](const Token& tok, const Expr& a, const Expr* b, Expr& out)
+    {
+        if(!isConst(a) || (b && !isConst(*b))) return false;
+        if(!foldAll && (!exactInt(a[0].value) || (b && !exactInt((*b)[0].value)))) return false;
+
+        double args[2] = {a[0].value, b ? (*b)[0].value : 0};
+        double r;
+        try { r = applyToken(tok, args); }
+        catch (const std::runtime_error&) { return false; }
+
+        if(!std::isfinite(r) || (!foldAll && !exactInt(r))) return false;
+        out = num(r);
+        return true;
+    };
+
+    auto neg = [&](Expr a)
+    {
+        Token u{Token::OPERATOR, 0, 'u'};
+        Expr out;
+        if(fold(u, a, nullptr, out)) return out;
+        if(a.back().type == Token::OPERATOR && a.back().op == 'u') { a.pop_back(); return a; }
+        a.push_back(u);
+        return a;
+    };
+
+    auto negated = [&](const Expr& e) { return (isConst(e) && e[0].value < 0) || (e.back().type == Token::OPERATOR && e.back().op == 'u'); };
+
+    std::function<Expr(char, Expr, Expr)> bin = [&](char op, Expr a, Expr b) -> Expr
+    {
+        Token tok{Token::OPERATOR, 0, op};
+        Expr out;
+        if(fold(tok, a, &b, out)) return out;
+
+        switch(op)
+        {
+            case '+':
+                if(is(a, 0)) return b;
+                if(is(b, 0)) return a;
+                if(negated(b)) return bin('-', a, neg(b));
+                break;
+            case '-':
+                if(is(b, 0)) return a;
+                if(is(a, 0)) return neg(b);
+                if(negated(b)) return bin('+', a, neg(b));
+                break;
+            case '*':
+                if(is(a, 0) || is(b, 0)) return num(0);
+                if(is(a, 1)) return b;
+                if(is(b, 1)) return a;
+                if(is(a, -1)) return neg(b);
+                if(is(b, -1)) return neg(a);
+                if(negated(a) && !isConst(a)) return neg(bin(op, neg(a), b));
+                if(negated(b) && !isConst(b)) return neg(bin(op, a, neg(b)));
+                break;
+            case '/':
+                if(is(a, 0) && !is(b, 0)) return num(0);
+                if(is(b, 1)) return a;
+                if(negated(a) && !isConst(a)) return neg(bin(op, neg(a), b));
+                if(negated(b) && !isConst(b)) return neg(bin(op, a, neg(b)));
+                break;
+            case '^':
+                if(is(b, 1)) return a;
+                if(is(b, 0)) return num(1);
+                break;
+        }
+
+        a.insert(a.end(), b.begin(), b.end());
+        a.push_back(tok);
+        return a;
+    };
+
+    auto call = [&](BuiltinFunction::Id id, Expr a)
+    {
+        Token tok{Token::FUNCTION, 0, 0, 0, 0, int(id)};
+        Expr out;
+        if(fold(tok, a, nullptr, out)) return out;
+        a.push_back(tok);
+        return a;
+    };
+
+    // c ? t : e, with a constant condition or equal constant branches
+    // resolved now
+    auto select = [&](Expr c, const Expr& t, const Expr& e)
+    {
+        if(isConst(c)) return c[0].value != 0 ? t : e;
+        if(isConst(t) && isConst(e) && t[0].value == e[0].value) return t;
+
+        c.push_back({Token::BRANCH, 0, 0});
+        c.insert(c.end(), t.begin(), t.end());
+        c.push_back({Token::JUMP, 0, 0});
+        c.insert(c.end(), e.begin(), e.end());
+        c.push_back({Token::JOIN, 0, '?'});
+        return c;
+    };
+
+    std::function<Expr(size_t)> d = [&](size_t i) -> Expr
+    {
+        const Token &tok = postfix[i];
+
+        if(tok.type == Token::NUMBER) return num(0);
+        if(tok.type == Token::VARIABLE) return num(text.substr(tok.pos, tok.len) == var ? 1 : 0);
+        if(tok.type == Token::OPERATOR && isComparison(tok.op)) return num(0);
+        if(tok.type == Token::INDEX) return num(0);
+
+        // The bounds are integers: a sum differentiates term by term
+        if(tok.type == Token::NEXT)
+        {
+            if(tok.op != '+')
+                throw std::runtime_error(std::string("Cannot differentiate ") + aggregateName(tok.op) + " symbolically; use grad.");
+
+            Expr body = d(kids[i][2]);
+            if(is(body, 0)) return body;
+
+            Expr out(postfix.begin() + start[kids[i][0]], postfix.begin() + start[kids[i][2]]);   // from to LOOP
+            out.insert(out.end(), body.begin(), body.end());
+            out.push_back(tok);
+            return out;
+        }
+
+        // Conditions are piecewise constant: the derivative picks
+        // between the derivatives of the branches
+        if(tok.type == Token::JOIN)
+        {
+            Expr c = slice(kids[i][0]);
+            if(isConst(c)) return d(kids[i][c[0].value != 0 ? 1 : 2]);
+
+            return select(c, d(kids[i][1]), d(kids[i][2]));
+        }
+
+        Expr a = slice(kids[i][0]), da = d(kids[i][0]);
+
+        if(tok.type == Token::OPERATOR && tok.op == 'u') return neg(da);
+        if(tok.type == Token::OPERATOR && tok.op == '%') return bin('/', da, num(100));
+
+        if(tok.type == Token::FUNCTION && builtinFunctions()[tok.index].arity == 1)
+        {
+            switch(BuiltinFunction::Id(tok.index))
+            {
+                case BuiltinFunction::SQRT: return bin('/', da, bin('*', num(2), call(BuiltinFunction::SQRT, a)));
+                case BuiltinFunction::EXP: return bin('*', call(BuiltinFunction::EXP, a), da);
+                case BuiltinFunction::LOG: return bin('/', da, a);
+                case BuiltinFunction::SIN: return bin('*', call(BuiltinFunction::COS, a), da);
+                case BuiltinFunction::COS: return neg(bin('*', call(BuiltinFunction::SIN, a), da));
+                case BuiltinFunction::ABS: return bin('*', bin('/', a, call(BuiltinFunction::ABS, a)), da);
+                default: break;
+            }
+        }
+
+        Expr b = slice(kids[i][1]), db = d(kids[i][1]);
+
+        if(tok.type == Token::FUNCTION)
+        {
+            // min(a, b) is a <= b ? a : b, max(a, b) is a >= b ? a : b;
+            // at a tie the first argument's derivative, as grad takes
+            return select(bin(tok.index == BuiltinFunction::MIN ? 'l' : 'g', a, b), da, db);
+        }
+
+        switch(tok.op)
+        {
+            case '+': case '-': return bin(tok.op, da, db);
+            case '*': return bin('+', bin('*', da, b), bin('*', a, db));
+            case '/':
+                if(is(db, 0)) return bin('/', da, b);
+                return bin('/', bin('-', bin('*', da, b), bin('*', a, db)), bin('^', b, num(2)));
+            case '^':
+                // Constant exponent: the power rule; otherwise a^b (b' ln a + b a' / a)
+                if(is(db, 0)) return bin('*', bin('*', b, bin('^', a, bin('-', b, num(1)))), da);
+                return bin('*', bin('^', a, b), bin('+', bin('*', db, call(BuiltinFunction::LOG, a)), bin('/', bin('*', b, da), a)));
+        }
+        throw std::runtime_error(std::string("Unknown operator: ") + tok.op);
+    };
+
+    return toInfix(d(postfix.size() - 1), text);
+}
+
+// ----------------------------
+// Print postfix back as infix with the fewest parentheses that
+// keep the same parse. Literals keep their source text; numbers
+// made by folding (their span is the folded source, e.g. 2+1) print
+// in the shortest plain decimal form that reads back to the same
+// double (the tokenizer has no exponents).
+// && and || were lowered to conditionals over x != 0 and print
+// back in their short form
+// ----------------------------
+std::string Calculator::toInfix(const std::vector<Token>& postfix, std::string_view src)
+{
+    constexpr int atom = 11;
+
+    struct Entry
+    {
+        std::string text;
+        int prec;            // precedence of its top operator
+        std::string tested;  // x when the entry is x != 0, else empty
+        int testedPrec;
+    };
+    std::vector<Entry> st;
+
+    auto number = [](double v)
+    {
+        char buf[400];
+        for(int digits = 15; digits <= 17; ++digits)
+        {
+            snprintf(buf, sizeof(buf), "%.*g", digits, v);
+            if(strtod(buf, nullptr) == v && !strchr(buf, 'e')) return std::string(buf);
+        }
+        for(int digits = 0; digits < 340; ++digits)
+        {
+            snprintf(buf, sizeof(buf), "%.*f", digits, v);
+            if(strtod(buf, nullptr) == v) break;
+        }
+        return std::string(buf);
+    };
+
+    auto wrap = [](const Entry& e, bool paren) { return paren ? "(" + e.text + ")" : e.text; };
+
+    for(const auto &tok : postfix)
+    {
+        switch(tok.type)
+        {
+            case Token::NUMBER:
+            {
+                std::string_view literal = src.substr(tok.pos, tok.len);
+                bool plain = tok.len && literal.find_first_not_of("0123456789.") == std::string_view::npos;
+                std::string t = plain ? std::string(literal) : number(tok.value);
+                st.push_back({t, t[0] == '-' ? precedence('u') : atom, "", 0});
+                break;
+            }
+
+            case Token::VARIABLE:
+            case Token::INDEX:
+                st.push_back({std::string(src.substr(tok.pos, tok.len)), atom, "", 0});
+                break;
+
+            case Token::NEXT:
+            {
+                std::string text = std::string(aggregateName(tok.op)) + "(" + std::string(src.substr(tok.pos, tok.len));
+                for(size_t k = st.size() - 3; k < st.size(); ++k) text += ", " + st[k].text;
+                st.resize(st.size() - 3);
+                st.push_back({text + ")", atom, "", 0});
+                break;
+            }
+
+            case Token::FUNCTION:
+            {
+                const auto &fn = builtinFunctions()[tok.index];
+                std::string args;
+                for(size_t k = st.size() - fn.arity; k < st.size(); ++k) args += (args.empty() ? "" : ", ") + st[k].text;
+                st.resize(st.size() - fn.arity);
+                st.push_back({std::string(fn.name) + "(" + args + ")", atom, "", 0});
+                break;
+            }
+
+            case Token::OPERATOR:
+            {
+                int p = precedence(tok.op);
+
+                if(tok.op == 'u') st.back() = {"-" + wrap(st.back(), st.back().prec <= p), p, "", 0};
+                else if(tok.op == '%') st.back() = {wrap(st.back(), st.back().prec < p) + "%", p, "", 0};
+                else
+                {
+                    auto y = st.back();
+                    st.pop_back();
+                    auto x = st.back();
+
+                    // '^' groups to the right, the rest to the left
+                    bool right = tok.op == '^';
+                    std::string l = wrap(x, right ? x.prec <= p : x.prec < p);
+                    std::string r = wrap(y, right ? y.prec < p : y.prec <= p);
+                    bool test = tok.op == 'n' && y.text == "0";
+                    st.back() = {right ? l + "^" + r : l + " " + operatorName(tok.op) + " " + r, p, test ? x.text : "", x.prec};
+                }
+                break;
+            }
+
+            case Token::BRANCH:
+            case Token::JUMP:
+            case Token::LOOP:
+                break;
+
+            case Token::JOIN:
+            {
+                auto e = st.back();
+                st.pop_back();
+                auto t = st.back();
+                st.pop_back();
+                auto c = st.back();
+
+                // Left-associative, like the other binary operators
+                auto logical = [&](char op, const Entry& x)
+                {
+                    int p = precedence(op);
+                    std::string r = x.testedPrec <= p ? "(" + x.tested + ")" : x.tested;
+                    st.back() = {wrap(c, c.prec < p) + " " + operatorName(op) + " " + r, p, "", 0};
+                };
+
+                if(tok.op == '&' && !t.tested.empty() && e.text == "0") logical('&', t);
+                else if(tok.op == '|' && t.text == "1" && !e.tested.empty()) logical('|', e);
+                else
+                {
+                    int p = precedence('?');
+                    st.back() = {wrap(c, c.prec <= p) + " ? " + wrap(t, t.prec <= p) + " : " + e.text, p, "", 0};
+                }
+                break;
+            }
+
+            default:
+                throw std::runtime_error("Cannot print this expression as infix.");
+        }
+    }
+
+    return st.empty() ? "" : st.back().text;
+}
+
+const double* Calculator::CompiledExpr::boundValues() const
+{
+    if(!unbound.empty())
+        throw std::runtime_error("Unknown variable: " + unbound);
+    return bound.data();
+}
+
+std::string Calculator::CompiledExpr::evaluateText(const double* values) const
+{
+    return evaluatePostfixText(postfix, source, mode, decimalCtx, values ? values : boundValues());
+}
+
+double Calculator::CompiledExpr::evaluate(const double* values) const
+{
+    return evaluatePostfix(postfix, values ? values : boundValues());
+}
+
+double Calculator::CompiledExpr::gradient(double* grad, const double* values) const
+{
+    return evaluateDual(postfix, values ? values : boundValues(), vars.size(), grad);
+}
+
+// ----------------------------
+// Forward-mode automatic differentiation: every stack entry is a
+// dual number, a value plus its partial derivatives with respect
+// to each variable slot. Derivative rows are padded to an even
+// width and combined two lanes at a time with Vec2d. Chain-rule
+// terms are skipped for rows that are all zero, so constants such
+// as the 0 in sqrt(0) or x^0.5 never turn a gradient into NaN
+// ----------------------------
+double Calculator::evaluateDual(const std::vector<Token>& postfix, const double* vars, size_t nvars, double* grad)
+{
+    const size_t width = (nvars + 1) & ~size_t(1);
+    size_t temps = std::count_if(postfix.begin(), postfix.end(), [](const Token& t) { return t.type == Token::STORE; });
+
+    // Stack entries first, then CSE temporaries
+    std::vector<double> val(postfix.size() + temps), der(val.size() * width);
+    auto row = [&](size_t k) { return der.data() + k * width; };
+    auto temp = [&](int k) { return postfix.size() + k; };
+    size_t depth = 0;
+
+    auto nonzero = [&](const double* x) { return std::any_of(x, x + width, [](double d) { return d != 0; }); };
+
+    // out = a * x + b * y
+    auto combine = [&](double* out, double a, const double* x, double b, const double* y)
+    {
+        Vec2d va = Vec2d::set1(a), vb = Vec2d::set1(b);
+        for(size_t i = 0; i < width; i += 2) (va * Vec2d::load(x + i) + vb * Vec2d::load(y + i)).store(out + i);
+    };
+
+    auto scale = [&](double* x, double a)
+    {
+        Vec2d va = Vec2d::set1(a);
+        for(size_t i = 0; i < width; i += 2) (va * Vec2d::load(x + i)).store(x + i);
+    };
+
+    auto copy = [&](size_t to, size_t from)
+    {
+        val[to] = val[from];
+        std::copy_n(row(from), width, row(to));
+    };
+
+    std::vector<LoopFrame> loops;
+
+    auto constant = [&](double v)
+    {
+        val[depth] = v;
+        std::fill_n(row(depth), width, 0.0);
+        ++depth;
+    };
+
+    for(size_t pc = 0; pc < postfix.size(); ++pc)
+    {
+        const auto &tok = postfix[pc];
+
+        // Only the branch taken contributes to the derivative
+        if(tok.type == Token::BRANCH)
+        {
+            if(depth == 0)
+                throw std::runtime_error("Invalid expression: missing condition.");
+
+            if(val[--depth] == 0) pc = tok.index - 1;
+        }
+
+        else if(tok.type == Token::JUMP) pc = tok.index - 1;
+        else if(tok.type == Token::JOIN) continue;
+
+        // The result so far is a dual number on the stack
+        else if(tok.type == Token::LOOP)
+        {
+            if(depth < 2)
+                throw std::runtime_error("Invalid expression: missing range bounds.");
+
+            depth -= 2;
+            double from = val[depth], to = val[depth + 1];
+            constant(tok.op == '*' ? 1 : 0);
+
+            if(beginLoop(tok.op, from, to)) loops.push_back({from, to});
+            else pc = tok.index;
+        }
+
+        else if(tok.type == Token::INDEX) constant(loops[loops.size() - 1 - tok.index].i);
+
+        else if(tok.type == Token::NEXT)
+        {
+            --depth;
+            double a = val[depth - 1], b = val[depth];
+            double* da = row(depth - 1);
+            const double* db = row(depth);
+            LoopFrame &loop = loops.back();
+
+            switch(tok.op)
+            {
+                case '+': neumaierAdd(val[depth - 1], loop.comp, b); combine(da, 1, da, 1, db); break;
+                case '*': val[depth - 1] = a * b; combine(da, b, da, a, db); break;
+                default:
+                    if(loop.first || (tok.op == '<' ? b < a : b > a)) copy(depth - 1, depth);
+                    break;
+            }
+            loop.first = false;
+
+            if(++loop.i <= loop.to) pc = tok.index;
+            else
+            {
+                val[depth - 1] += loop.comp;
+                loops.pop_back();
+            }
+        }
+
+        else if(tok.type == Token::NUMBER || tok.type == Token::VARIABLE)
+        {
+            bool variable = tok.type == Token::VARIABLE;
+            val[depth] = variable ? vars[tok.index] : tok.value;
+            std::fill_n(row(depth), width, 0.0);
+            if(variable) row(depth)[tok.index] = 1;
+            ++depth;
+        }
+
+        else if(tok.type == Token::STORE) copy(temp(tok.index), depth - 1);
+        else if(tok.type == Token::LOAD) copy(depth++, temp(tok.index));
+
+        else if(tok.type == Token::FUNCTION)
+        {
+            const auto &fn = builtinFunctions()[tok.index];
+            if(depth < size_t(fn.arity))
+                throw std::runtime_error(std::string("Invalid expression: missing argument for ") + fn.name + ".");
+
+            depth -= fn.arity;
+            double a = val[depth], r = fn.scalar(&val[depth]);
+            double* da = row(depth);
+
+            if(fn.arity == 2)
+            {
+                // min/max pass on the derivative of the operand they pick
+                double b = val[depth + 1];
+                bool first = fn.id == BuiltinFunction::MIN ? a <= b : a >= b;
+                if(!first) std::copy_n(row(depth + 1), width, da);
+            }
+
+            else if(nonzero(da))
+            {
+                switch(fn.id)
+                {
+                    case BuiltinFunction::SQRT: scale(da, 0.5 / r); break;
+                    case BuiltinFunction::EXP: scale(da, r); break;
+                    case BuiltinFunction::LOG: scale(da, 1 / a); break;
+                    case BuiltinFunction::SIN: scale(da, cos(a)); break;
+                    case BuiltinFunction::COS: scale(da, -sin(a)); break;
+                    case BuiltinFunction::ABS: scale(da, a > 0 ? 1 : a < 0 ? -1 : 0); break;
+                    default: break;
+                }
+            }
+
+            val[depth++] = r;
+        }
+
+        else if(tok.type == Token::OPERATOR && (tok.op == 'u' || tok.op == '%'))
+        {
+            if(depth == 0)
+                throw std::runtime_error(tok.op == 'u' ? "Invalid expression: missing operand for unary minus."
+                                                       : "Invalid expression: missing operand for '%'.");
+
+            double scaleBy = tok.op == 'u' ? -1 : 0.01;
+            val[depth - 1] = tok.op == 'u' ? -val[depth - 1] : val[depth - 1] / 100.0;
+            scale(row(depth - 1), scaleBy);
+        }
+
+        else if(tok.type == Token::OPERATOR)
+        {
+            if(depth < 2)
+                throw std::runtime_error("Invalid expression: missing operand for binary operator.");
+
+            --depth;
+            double a = val[depth - 1], b = val[depth];
+            double* da = row(depth - 1);
+            const double* db = row(depth);
+            double r = applyOperation(a, b, tok.op);
+
+            switch(tok.op)
+            {
+                case '+': combine(da, 1, da, 1, db); break;
+                case '-': combine(da, 1, da, -1, db); break;
+                case '*': combine(da, b, da, a, db); break;
+                case '/': combine(da, 1 / b, da, -r / b, db); break;
+                case '^':
+                {
+                    // d(a^b) = b a^(b-1) da + a^b ln(a) db
+                    double ca = b == 0 || !nonzero(da) ? 0 : b * pow(a, b - 1);
+                    double cb = !nonzero(db) ? 0 : a > 0 ? r * log(a) : a == 0 && b > 0 ? 0 : std::numeric_limits<double>::quiet_NaN();
+                    combine(da, ca, da, cb, db);
+                    break;
+                }
+                default:
+                    // Comparisons are piecewise constant
+                    std::fill_n(da, width, 0.0);
+                    break;
+            }
+
+            val[depth - 1] = r;
+        }
+
+        else if(tok.type == Token::OUTPUT)
+            throw std::runtime_error("Gradients need a single expression.");
+    }
+
+    if(depth != 1)
+        throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+
+    std::copy_n(row(0), nvars, grad);
+    return val[0];
+}
+
+double Calculator::CompiledExpr::reverseGradient(double* grad, const double* values) const
+{
+    return evaluateAdjoint(postfix, values ? values : boundValues(), vars.size(), grad);
+}
+
+// ----------------------------
+// Reverse-mode differentiation. The forward sweep evaluates the
+// postfix and records one tape entry per value: its operands and
+// the local partial derivative with respect to each. The backward
+// sweep walks the tape from the result, adding adjoint * partial
+// into the operands; a variable's adjoint is its gradient entry.
+// The tape holds one entry per token run (a loop body adds its
+// entries once per pass) and lives in a per-thread buffer, so
+// repeated calls do not allocate once it has grown. Entries
+// that depend on no variable are inactive and never swept, which
+// keeps constant operands (as in (-2)^2) from producing NaN
+// ----------------------------
+double Calculator::evaluateAdjoint(const std::vector<Token>& postfix, const double* vars, size_t nvars, double* grad)
+{
+    struct Entry
+    {
+        int kids[2];
+        double partial[2];
+        int slot;          // variable slot, or -1
+        bool active;       // depends on some variable
+    };
+
+    thread_local std::vector<Entry> tape;
+    thread_local std::vector<double> val, adj;
+    thread_local std::vector<int> st, temps;
+
+    tape.clear();
+    val.clear();
+    st.clear();
+    temps.clear();
+    tape.reserve(postfix.size());
+
+    auto push = [&](double v, Entry e)
+    {
+        st.push_back(int(tape.size()));
+        tape.push_back(e);
+        val.push_back(v);
+    };
+
+    std::vector<LoopFrame> loops;
+
+    for(size_t pc = 0; pc < postfix.size(); ++pc)
+    {
+        const auto &tok = postfix[pc];
+
+        // The tape records only the branch taken
+        if(tok.type == Token::BRANCH)
+        {
+            if(st.empty())
+                throw std::runtime_error("Invalid expression: missing condition.");
+
+            double cond = val[st.back()];
+            st.pop_back();
+            if(cond == 0) pc = tok.index - 1;
+        }
+
+        else if(tok.type == Token::JUMP) pc = tok.index - 1;
+        else if(tok.type == Token::JOIN) continue;
+
+        // Each pass of a loop adds one entry combining the result so far with the body's value
+        else if(tok.type == Token::LOOP)
+        {
+            if(st.size() < 2)
+                throw std::runtime_error("Invalid expression: missing range bounds.");
+
+            double from = val[st[st.size() - 2]], to = val[st.back()];
+            st.resize(st.size() - 2);
+            push(tok.op == '*' ? 1 : 0, {{-1, -1}, {0, 0}, -1, false});
+
+            if(beginLoop(tok.op, from, to)) loops.push_back({from, to});
+            else pc = tok.index;
+        }
+
+        else if(tok.type == Token::INDEX) push(loops[loops.size() - 1 - tok.index].i, {{-1, -1}, {0, 0}, -1, false});
+
+        else if(tok.type == Token::NEXT)
+        {
+            int y = st.back();
+            st.pop_back();
+            int x = st.back();
+            st.pop_back();
+            LoopFrame &loop = loops.back();
+
+            double a = val[x], b = val[y], r = a;
+            Entry e{{x, y}, {1, 1}, -1, tape[x].active || tape[y].active};
+
+            switch(tok.op)
+            {
+                case '+': neumaierAdd(r, loop.comp, b); break;
+                case '*': r = a * b; e.partial[0] = b; e.partial[1] = a; break;
+                default:
+                {
+                    bool second = loop.first || (tok.op == '<' ? b < a : b > a);
+                    r = second ? b : a;
+                    e.partial[0] = !second;
+                    e.partial[1] = second;
+                    break;
+                }
+            }
+            push(r, e);
+            loop.first = false;
+
+            if(++loop.i <= loop.to) pc = tok.index;
+            else
+            {
+                val[st.back()] += loop.comp;
+                loops.pop_back();
+            }
+        }
+
+        else if(tok.type == Token::NUMBER) push(tok.value, {{-1, -1}, {0, 0}, -1, false});
+        else if(tok.type == Token::VARIABLE) push(vars[tok.index], {{-1, -1}, {0, 0}, tok.index, true});
+        else if(tok.type == Token::STORE)
+        {
+            if(temps.size() <= size_t(tok.index)) temps.resize(tok.index + 1);
+            temps[tok.index] = st.back();
+        }
+        else if(tok.type == Token::LOAD) st.push_back(temps[tok.index]);
+
+        else if(tok.type == Token::FUNCTION)
+        {
+            const auto &fn = builtinFunctions()[tok.index];
+            if(st.size() < size_t(fn.arity))
+                throw std::runtime_error(std::string("Invalid expression: missing argument for ") + fn.name + ".");
+
+            Entry e{{-1, -1}, {0, 0}, -1, false};
+            double args[2] = {0, 0};
+            for(int k = fn.arity; k-- > 0;) { e.kids[k] = st.back(); args[k] = val[st.back()]; st.pop_back(); }
+
+            double a = args[0], r = fn.scalar(args);
+
+            switch(fn.id)
+            {
+                case BuiltinFunction::SQRT: e.partial[0] = 0.5 / r; break;
+                case BuiltinFunction::EXP: e.partial[0] = r; break;
+                case BuiltinFunction::LOG: e.partial[0] = 1 / a; break;
+                case BuiltinFunction::SIN: e.partial[0] = cos(a); break;
+                case BuiltinFunction::COS: e.partial[0] = -sin(a); break;
+                case BuiltinFunction::ABS: e.partial[0] = a > 0 ? 1 : a < 0 ? -1 : 0; break;
+                case BuiltinFunction::MIN: e.partial[0] = a <= args[1]; e.partial[1] = a > args[1]; break;
+                case BuiltinFunction::MAX: e.partial[0] = a >= args[1]; e.partial[1] = a < args[1]; break;
+            }
+
+            for(int k = 0; k < fn.arity; ++k) e.active |= tape[e.kids[k]].active;
+            push(r, e);
+        }
+
+        else if(tok.type == Token::OPERATOR && (tok.op == 'u' || tok.op == '%'))
+        {
+            if(st.empty())
+                throw std::runtime_error(tok.op == 'u' ? "Invalid expression: missing operand for unary minus."
+                                                       : "Invalid expression: missing operand for '%'.");
+
+            int x = st.back();
+            st.pop_back();
+            double r = tok.op == 'u' ? -val[x] : val[x] / 100.0;
+            push(r, {{x, -1}, {tok.op == 'u' ? -1 : 0.01, 0}, -1, tape[x].active});
+        }
+
+        else if(tok.type == Token::OPERATOR)
+        {
+            if(st.size() < 2)
+                throw std::runtime_error("Invalid expression: missing operand for binary operator.");
+
+            int y = st.back();
+            st.pop_back();
+            int x = st.back();
+            st.pop_back();
+
+            double a = val[x], b = val[y], r = applyOperation(a, b, tok.op);
+            Entry e{{x, y}, {0, 0}, -1, tape[x].active || tape[y].active};
+
+            switch(tok.op)
+            {
+                case '+': e.partial[0] = 1; e.partial[1] = 1; break;
+                case '-': e.partial[0] = 1; e.partial[1] = -1; break;
+                case '*': e.partial[0] = b; e.partial[1] = a; break;
+                case '/': e.partial[0] = 1 / b; e.partial[1] = -r / b; break;
+                case '^':
+                    e.partial[0] = b == 0 ? 0 : b * pow(a, b - 1);
+                    e.partial[1] = a > 0 ? r * log(a) : a == 0 && b > 0 ? 0 : std::numeric_limits<double>::quiet_NaN();
+                    break;
+                default:
+                    // Comparisons are piecewise constant
+                    e.active = false;
+                    break;
+            }
+            push(r, e);
+        }
+
+        else if(tok.type == Token::OUTPUT)
+            throw std::runtime_error("Gradients need a single expression.");
+    }
+
+    if(st.size() != 1)
+        throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+
+    std::fill_n(grad, nvars, 0.0);
+    adj.assign(tape.size(), 0.0);
+    adj[st.back()] = 1;
+
+    for(size_t i = tape.size(); i-- > 0;)
+    {
+        const Entry &e = tape[i];
+        if(!e.active || adj[i] == 0) continue;
+
+        if(e.slot >= 0) grad[e.slot] += adj[i];
+
+        for(int k = 0; k < 2 && e.kids[k] >= 0; ++k)
+            if(tape[e.kids[k]].active) adj[e.kids[k]] += adj[i] * e.partial[k];
+    }
+
+    return val[st.back()];
+}
+
+void Calculator::CompiledExpr::evaluateBatch(const double* const* columns, size_t rows, double* out) const
+{
+    evaluateBlocks(postfix, columns, rows, &out);
+}
+
+// ----------------------------
+// Batch evaluation: the postfix runs once per block of rows,
+// every stack entry is a column of blockSize values, so each
+// operator is one tight loop and each function one batch call.
+// A single expression leaves its result in outs[0].
+// Conditionals run both branches under a lane mask and blend at
+// JOIN; a branch no lane of the block needs is skipped. Only
+// active lanes can raise errors such as division by zero.
+// Aggregations have their own range per row, so code with one runs
+// row by row (each loop then batches over its range instead)
+// ----------------------------
+void Calculator::evaluateBlocks(const std::vector<Token>& postfix, const double* const* columns, size_t rows, double* const* outs)
+{
+    constexpr size_t blockSize = 256;
+    size_t temps = 0, branches = 0, slots = 0, results = 0;
+    bool loops = false;
+
+    for(const auto &tok : postfix)
+    {
+        if(tok.type == Token::STORE) temps = std::max(temps, size_t(tok.index) + 1);
+        else if(tok.type == Token::BRANCH) ++branches;
+        else if(tok.type == Token::VARIABLE) slots = std::max(slots, size_t(tok.index) + 1);
+        else if(tok.type == Token::OUTPUT) results = std::max(results, size_t(tok.index) + 1);
+        else if(tok.type == Token::LOOP) loops = true;
+    }
+
+    bool program = !postfix.empty() && postfix.back().type == Token::OUTPUT;
+
+    if(loops)
+    {
+        std::vector<double> values(slots), out(results);
+        for(size_t row = 0; row < rows; ++row)
+        {
+            for(size_t k = 0; k < slots; ++k) values[k] = columns[k][row];
+
+            if(!program) outs[0][row] = evaluatePostfix(postfix, values.data());
+            else
+            {
+                evaluatePostfix(postfix, values.data(), false, out.data());
+                for(size_t k = 0; k < results; ++k) outs[k][row] = out[k];
+            }
+        }
+        return;
+    }
+
+    // Stack columns first, then one column per CSE temporary
+    std::vector<double> stack((std::max<size_t>(postfix.size(), 1) + temps) * blockSize);
+    auto slot = [&](size_t k) { return stack.data() + k * blockSize; };
+    auto temp = [&](int k) { return slot(postfix.size() + k); };
+
+    // One lane mask per open conditional; none open means all lanes
+    std::vector<uint8_t> masks(branches * blockSize);
+    size_t level = 0;
+    auto active = [&]() -> const uint8_t* { return level ? masks.data() + (level - 1) * blockSize : nullptr; };
+
+    // Mask for one branch, from the condition column; false if no lane takes it
+    auto enter = [&](size_t n, const double* cond, bool then)
+    {
+        const uint8_t* parent = level > 1 ? masks.data() + (level - 2) * blockSize : nullptr;
+        uint8_t* mask = masks.data() + (level - 1) * blockSize;
+        uint8_t any = 0;
+
+        for(size_t i = 0; i < n; ++i)
+        {
+            mask[i] = (!parent || parent[i]) && ((cond[i] != 0) == then);
+            any |= mask[i];
+        }
+        return any != 0;
+    };
+
+    for(size_t base = 0; base < rows; base += blockSize)
+    {
+        size_t n = std::min(blockSize, rows - base);
+        size_t depth = 0;
+        level = 0;
+
+        for(size_t pc = 0; pc < postfix.size(); ++pc)
+        {
+            const auto &tok = postfix[pc];
+
+            if(tok.type == Token::BRANCH)
+            {
+                if(depth == 0)
+                    throw std::runtime_error("Invalid expression: missing condition.");
+
+                ++level;
+                if(!enter(n, slot(depth - 1), true))
+                {
+                    // No lane needs the then-part: leave its column unset
+                    ++depth;
+                    enter(n, slot(depth - 2), false);
+                    pc = tok.index - 1;
+                }
+            }
+
+            else if(tok.type == Token::JUMP)
+            {
+                if(!enter(n, slot(depth - 2), false))
+                {
+                    ++depth;
+                    pc = tok.index - 1;
+                }
+            }
+
+            else if(tok.type == Token::JOIN)
+            {
+                double* c = slot(depth - 3);
+                const double* t = slot(depth - 2);
+                const double* e = slot(depth - 1);
+
+                for(size_t i = 0; i < n; ++i) c[i] = c[i] != 0 ? t[i] : e[i];
+                depth -= 2;
+                --level;
+            }
+
+            else if(tok.type == Token::NUMBER)
+                std::fill_n(slot(depth++), n, tok.value);
+
+            else if(tok.type == Token::VARIABLE)
+                memcpy(slot(depth++), columns[tok.index] + base, n * sizeof(double));
+
+            else if(tok.type == Token::STORE)
+                memcpy(temp(tok.index), slot(depth - 1), n * sizeof(double));
+
+            else if(tok.type == Token::LOAD)
+                memcpy(slot(depth++), temp(tok.index), n * sizeof(double));
+
+            else if(tok.type == Token::OUTPUT)
+                memcpy(outs[tok.index] + base, slot(--depth), n * sizeof(double));
+
+            else if(tok.type == Token::FUNCTION)
+            {
+                const auto &fn = builtinFunctions()[tok.index];
+                if(depth < size_t(fn.arity))
+                    throw std::runtime_error(std::string("Invalid expression: missing argument for ") + fn.name + ".");
+
+                depth -= fn.arity;
+                const double* args[2] = {slot(depth), fn.arity > 1 ? slot(depth + 1) : nullptr};
+                fn.batch(args, slot(depth), n);
+                ++depth;
+            }
+
+            else if(tok.type == Token::OPERATOR && (tok.op == 'u' || tok.op == '%'))
+            {
+                if(depth == 0)
+                    throw std::runtime_error(tok.op == 'u' ? "Invalid expression: missing operand for unary minus."
+                                                           : "Invalid expression: missing operand for '%'.");
+
+                double* x = slot(depth - 1);
+                if(tok.op == 'u') for(size_t i = 0; i < n; ++i) x[i] = -x[i];
+                else for(size_t i = 0; i < n; ++i) x[i] = x[i] / 100.0;
+            }
+
+            else if(tok.type == Token::OPERATOR)
+            {
+                if(depth < 2)
+                    throw std::runtime_error("Invalid expression: missing operand for binary operator.");
+
+                double* x = slot(depth - 2);
+                const double* y = slot(depth - 1);
+                --depth;
+
+                switch(tok.op)
+                {
+                    case '+': for(size_t i = 0; i < n; ++i) x[i] += y[i]; break;
+                    case '-': for(size_t i = 0; i < n; ++i) x[i] -= y[i]; break;
+                    case '*': for(size_t i = 0; i < n; ++i) x[i] *= y[i]; break;
+                    case '/':
+                    {
+                        // No early exit, so the check vectorizes
+                        const uint8_t* mask = active();
+                        bool zero = false;
+                        if(mask) for(size_t i = 0; i < n; ++i) zero |= (y[i] == 0) & (mask[i] != 0);
+                        else for(size_t i = 0; i < n; ++i) zero |= y[i] == 0;
+                        if(zero) throw std::runtime_error("Division by zero!");
+                        for(size_t i = 0; i < n; ++i) x[i] /= y[i];
+                        break;
+                    }
+                    case '^':
+                        // Squares are common and x * x rounds once, exactly like pow
+                        if(std::all_of(y, y + n, [](double v) { return v == 2; })) for(size_t i = 0; i < n; ++i) x[i] *= x[i];
+                        else for(size_t i = 0; i < n; ++i) x[i] = pow(x[i], y[i]);
+                        break;
+                    case '<': for(size_t i = 0; i < n; ++i) x[i] = x[i] < y[i]; break;
+                    case '>': for(size_t i = 0; i < n; ++i) x[i] = x[i] > y[i]; break;
+                    case 'l': for(size_t i = 0; i < n; ++i) x[i] = x[i] <= y[i]; break;
+                    case 'g': for(size_t i = 0; i < n; ++i) x[i] = x[i] >= y[i]; break;
+                    case '=': for(size_t i = 0; i < n; ++i) x[i] = x[i] == y[i]; break;
+                    case 'n': for(size_t i = 0; i < n; ++i) x[i] = x[i] != y[i]; break;
+                    default:
+                        throw std::runtime_error(std::string("Unknown operator: ") + tok.op);
+                }
+            }
+        }
+
+        if(depth != (program ? 0 : 1))
+            throw std::runtime_error("Invalid expression: malformed expression or missing operators.");
+
+        if(!program) memcpy(outs[0] + base, slot(0), n * sizeof(double));
+    }
+}
+
+double Calculator::evaluate(std::string_view src) const
+{
+    return compile(src).evaluate();
+}
+
+std::string Calculator::evaluateText(std::string_view src) const
+{
+    std::string extra;
+    auto postfix = compilePostfix(src, extra, mode == Mode::DOUBLE);
+
+    // Spans of inlined bodies point past src: only then build the joined text
+    std::string joined;
+    std::string_view text = src;
+    if(!extra.empty())
+    {
+        joined.append(src).append("\n").append(extra);
+        text = joined;
+    }
+
+    eliminateCommonSubexpressions(postfix, text, mode != Mode::DOUBLE);
+
+    auto values = variableValues(bindVariables(postfix, text));
+    return evaluatePostfixText(postfix, text, mode, decimalCtx, values.data());
+}
+
+void Calculator::debug(const std::vector<Token>& tokens, const std::string& stage, std::string_view text)
+{
+    std::cout << "\n--- Debug: " << stage << " ---\n";
+
+    for(const auto &tok : tokens)
+    {
+        switch(tok.type)
+        {
+            case Token::NUMBER:
+                std::cout << "Number: " << tok.value << "\n";
+                break;
+            case Token::OPERATOR:
+                std::cout << "Operator: " << operatorName(tok.op) << "\n";
+                break;
+            case Token::PAREN_LEFT:
+                std::cout << "Paren: (\n";
+                break;
+            case Token::PAREN_RIGHT:
+                std::cout << "Paren: )\n";
+                break;
+            case Token::FUNCTION:
+                std::cout << "Function: " << builtinFunctions()[tok.index].name << "\n";
+                break;
+            case Token::VARIABLE:
+                std::cout << "Variable: " << text.substr(tok.pos, tok.len) << "\n";
+                break;
+            case Token::COMMA:
+                std::cout << "Comma\n";
+                break;
+            case Token::CALL:
+                std::cout << "Call: " << functionName(tok) << "\n";
+                break;
+            case Token::PARAM:
+                std::cout << "Param: " << tok.index << "\n";
+                break;
+            case Token::STORE:
+                std::cout << "Store: t" << tok.index << "\n";
+                break;
+            case Token::LOAD:
+                std::cout << "Load: t" << tok.index << "\n";
+                break;
+            case Token::OUTPUT:
+                std::cout << "Output: " << tok.index << "\n";
+                break;
+            case Token::BRANCH:
+                std::cout << "Branch if false -> " << tok.index << "\n";
+                break;
+            case Token::JUMP:
+                std::cout << "Jump -> " << tok.index << "\n";
+                break;
+            case Token::JOIN:
+                std::cout << "Join\n";
+                break;
+            case Token::LOOP:
+                if(tok.index < 0) { std::cout << "Aggregate: " << aggregateName(tok.op) << "\n"; break; }
+                std::cout << "Loop: " << aggregateName(tok.op) << " over " << text.substr(tok.pos, tok.len) << ", exit -> " << tok.index << "\n";
+                break;
+            case Token::NEXT:
+                std::cout << "Next: back to " << tok.index << "\n";
+                break;
+            case Token::INDEX:
+                std::cout << "Loop variable: " << text.substr(tok.pos, tok.len) << "\n";
+                break;
+        }
+    }
+
+    std::cout << "-----------------------------------\n";
+}
+
+void Calculator::displayResult() const
+{
+    if(mode != Mode::DOUBLE) std::cout << "Answer: " << resultText << "\n";
+    else std::cout << "Answer: " << result << "\n";
+}
+
+// ----------------------------
+// Wait a little longer each time: pause, then yield, then sleep
+// (doubling up to a millisecond) so a long wait costs no CPU
+// ----------------------------
+void backoff(unsigned spins)
+{
+    if(spins < 64)
+    {
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+    }
+    else if(spins < 128) std::this_thread::yield();
+    else std::this_thread::sleep_for(std::chrono::microseconds(1u << std::min(spins - 128, 10u)));
+}
+
+// ----------------------------
+// Bounded multi-producer multi-consumer queue without locks.
+// Each cell's sequence number says whose turn it is: ticket t may
+// fill it at t, empty it at t + 1, and the next lap fills it at
+// t + capacity. A producer (consumer) takes a run of tickets with
+// one CAS on tail (head) and then fills (empties) those cells, so
+// a batch costs one contended atomic however many items it moves.
+// A thread stalled between taking tickets and finishing its cells
+// holds up only whoever waits on those cells
+// ----------------------------
+template<class T>
+class MpmcQueue
+{
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> seq;
+            T value;
+        };
+
+        std::unique_ptr<Cell[]> cells;
+        size_t capacity;
+        size_t mask;
+
+        alignas(64) std::atomic<size_t> tail{0};   // next ticket to fill
+        alignas(64) std::atomic<size_t> head{0};   // next ticket to empty
+        alignas(64) std::atomic<bool> closed{false};
+
+        static size_t roundUp(size_t n)
+        {
+            size_t p = 2;
+            while(p < n) p *= 2;
+            return p;
+        }
+
+    public:
+        explicit MpmcQueue(size_t size) : cells(new Cell[roundUp(size)]), capacity(roundUp(size)), mask(capacity - 1)
+        {
+            for(size_t i = 0; i < capacity; ++i) cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        // Moves up to n items in, fewer if there is less room; returns how many
+        size_t tryPush(T* items, size_t n)
+        {
+            size_t pos = tail.load(std::memory_order_relaxed), k;
+            do
+            {
+                // A stale pos may be behind head; the CAS then fails anyway
+                size_t used = pos - std::min(pos, head.load(std::memory_order_acquire));
+                k = std::min(n, capacity - std::min(used, capacity));
+                if(k == 0) return 0;
+            }
+            while(!tail.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed));
+
+            for(size_t j = 0; j < k; ++j)
+            {
+                Cell &c = cells[(pos + j) & mask];
+                for(unsigned spins = 0; c.seq.load(std::memory_order_acquire) != pos + j; backoff(spins++)) {}
+                c.value = std::move(items[j]);
+                c.seq.store(pos + j + 1, std::memory_order_release);
+            }
+            return k;
+        }
+
+        // Moves up to max items out; returns how many (0 if empty)
+        size_t tryPop(T* out, size_t max)
+        {
+            size_t pos = head.load(std::memory_order_relaxed), k;
+            do
+            {
+                size_t end = tail.load(std::memory_order_acquire);
+                k = std::min(max, end - std::min(end, pos));
+                if(k == 0) return 0;
+            }
+            while(!head.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed));
+
+            for(size_t j = 0; j < k; ++j)
+            {
+                Cell &c = cells[(pos + j) & mask];
+                for(unsigned spins = 0; c.seq.load(std::memory_order_acquire) != pos + j + 1; backoff(spins++)) {}
+                out[j] = std::move(c.value);
+                c.seq.store(pos + j + capacity, std::memory_order_release);
+            }
+            return k;
+        }
+
+        // Waits while full
+        void push(T* items, size_t n)
+        {
+            unsigned spins = 0;
+            for(size_t done = 0; done < n;)
+            {
+                size_t k = tryPush(items + done, n - done);
+                if(k == 0) backoff(spins++);
+                done += k;
+            }
+        }
+        void push(T item) { push(&item, 1); }
+
+        // Waits while empty, then takes up to max; 0 once closed and drained
+        size_t pop(T* out, size_t max)
+        {
+            for(unsigned spins = 0;; backoff(spins++))
+            {
+                bool done = closed.load(std::memory_order_acquire);
+                if(size_t n = tryPop(out, max)) return n;
+                if(done) return 0;
+            }
+        }
+        bool pop(T& item) { return pop(&item, 1) == 1; }
+
+        // Once every push has returned (producers joined, say)
+        void close() { closed.store(true, std::memory_order_release); }
+
+        // Approximate under concurrent use
+        size_t size() const
+        {
+            size_t h = head.load(), t = tail.load();
+            return t - std::min(t, h);
+        }
+        bool empty() const { return size() == 0; }
+};
+
+// ----------------------------
+// Fixed-size worker pool
+// Jobs run in any order; callers keep their own ordering.
+// Jobs go through an MpmcQueue, and a worker takes a share of
+// what is queued at once. A worker that finds nothing for a while
+// parks on a condition variable; submit() only takes the mutex to
+// wake one when some are parked. A full queue makes submit() wait
+// ----------------------------
+class ThreadPool
+{
+    private:
+        using Job = std::function<void()>;
+
+        MpmcQueue<Job> jobs{4096};
+        std::vector<std::thread> workers;
+        unsigned count;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::atomic<unsigned> parked{0};
+        bool stopping = false;
+
+        static constexpr size_t maxTake = 16;
+
+        void work()
+        {
+            Job taken[maxTake];
+            unsigned spins = 0;
+
+            while(true)
+            {
+                // A fair share, so one worker does not sit on a burst
+                size_t share = std::clamp<size_t>(jobs.size() / count, 1, maxTake);
+                size_t n = jobs.tryPop(taken, share);
+
+                if(n > 0)
+                {
+                    for(size_t i = 0; i < n; ++i)
+                    {
+                        taken[i]();
+                        taken[i] = nullptr;
+                    }
+                    spins = 0;
+                    continue;
+                }
+
+                if(spins < 128)
+                {
+                    backoff(spins++);
+                    continue;
+                }
+
+                // Announce, then look again: a submit either sees the
+                // announcement or its job is seen here
+                std::unique_lock<std::mutex> lock(mtx);
+                parked.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                cv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                parked.fetch_sub(1);
+
+                if(stopping && jobs.empty()) return;
+                spins = 0;
+            }
+        }
+
+        void wake(size_t n)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(parked.load() == 0) return;
+
+            std::lock_guard<std::mutex> lock(mtx);
+            if(n == 1) cv.notify_one();
+            else cv.notify_all();
+        }
+
+    public:
+        explicit ThreadPool(unsigned threads) : count(std::max(threads, 1u))
+        {
+            for(unsigned i = 0; i < count; ++i)
+                workers.emplace_back([this]() { work(); });
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            cv.notify_all();
+
+            for(auto &w : workers) w.join();
+        }
+
+        void submit(Job job)
+        {
+            jobs.push(std::move(job));
+            wake(1);
+        }
+
+        // Many jobs for one CAS per run of free cells
+        void submit(std::vector<Job>& batch)
+        {
+            jobs.push(batch.data(), batch.size());
+            wake(batch.size());
+            batch.clear();
+        }
+
+        unsigned size() const { return count; }
+};
+
+#if defined(__cpp_impl_coroutine)
+
+// ----------------------------
+// Coroutine evaluation (C++20). A Task starts when it is awaited
+// and resumes its awaiter when it finishes, on whatever thread that
+// is; resumeOn(pool) moves a coroutine onto the pool. So
+//
+//     std::string r = co_await evaluateAsync(calc, pool, "2^10");
+//
+// runs the work on the pool while the caller's thread is free, and
+// the caller continues on the pool thread that finished it.
+// References passed in (calculator, pool, compiled expression,
+// columns) must outlive the coroutine
+// ----------------------------
+template<class T>
+class Task
+{
+    public:
+        struct promise_type
+        {
+            std::optional<T> value;
+            std::exception_ptr error;
+            std::coroutine_handle<> continuation = std::noop_coroutine();
+
+            Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            struct Final
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept { return h.promise().continuation; }
+                void await_resume() noexcept {}
+            };
+            Final final_suspend() noexcept { return {}; }
+
+            void return_value(T v) { value.emplace(std::move(v)); }
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+        Task& operator=(Task&&) = delete;
+        ~Task() { if(handle) handle.destroy(); }
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+        {
+            handle.promise().continuation = caller;
+            return handle;
+        }
+        T await_resume()
+        {
+            auto &p = handle.promise();
+            if(p.error) std::rethrow_exception(p.error);
+            return std::move(*p.value);
+        }
+
+    private:
+        std::coroutine_handle<promise_type> handle;
+        explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+// ----------------------------
+// Values produced one at a time by a coroutine that may itself
+// await (hop onto the pool, say) between them. Each
+// co_await gen.next() runs it to its next co_yield; empty once it
+// returns
+// ----------------------------
+template<class T>
+class AsyncGenerator
+{
+    public:
+        struct promise_type
+        {
+            std::optional<T> current;
+            std::exception_ptr error;
+            std::coroutine_handle<> consumer;
+
+            AsyncGenerator get_return_object() { return AsyncGenerator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            // Back to whoever awaited next()
+            struct ToConsumer
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept { return h.promise().consumer; }
+                void await_resume() noexcept {}
+            };
+            ToConsumer final_suspend() noexcept { return {}; }
+            ToConsumer yield_value(T v)
+            {
+                current.emplace(std::move(v));
+                return {};
+            }
+
+            void return_void() {}
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        AsyncGenerator(AsyncGenerator&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+        AsyncGenerator& operator=(AsyncGenerator&&) = delete;
+        ~AsyncGenerator() { if(handle) handle.destroy(); }
+
+        struct Next
+        {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() noexcept { return handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+            {
+                handle.promise().consumer = caller;
+                handle.promise().current.reset();
+                return handle;
+            }
+            std::optional<T> await_resume()
+            {
+                auto &p = handle.promise();
+                if(p.error) std::rethrow_exception(std::exchange(p.error, nullptr));
+                return std::move(p.current);
+            }
+        };
+
+        Next next() { return {handle}; }
+
+    private:
+        std::coroutine_handle<promise_type> handle;
+        explicit AsyncGenerator(std::coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+// Suspend, and continue on a pool thread
+struct ResumeOn
+{
+    ThreadPool& pool;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { pool.submit([h]() { h.resume(); }); }
+    void await_resume() const noexcept {}
+};
+
+inline ResumeOn resumeOn(ThreadPool& pool) { return {pool}; }
+
+// Compile and evaluate on the pool, in the calculator's mode
+Task<std::string> evaluateAsync(const Calculator& calc, ThreadPool& pool, std::string src)
+{
+    co_await resumeOn(pool);
+    co_return calc.evaluateText(src);
+}
+
+Task<double> evaluateAsync(const Calculator::CompiledExpr& ce, ThreadPool& pool, std::vector<double> values)
+{
+    co_await resumeOn(pool);
+    co_return ce.evaluate(values.empty() ? nullptr : values.data());
+}
+
+// ----------------------------
+// Batch evaluation as a stream: each block of rows is evaluated on
+// the pool and yielded, in order, as soon as it is done, so the
+// consumer can write one block out while the next is computed
+// ----------------------------
+AsyncGenerator<std::vector<double>> evaluateBatchAsync(const Calculator::CompiledExpr& ce, ThreadPool& pool,
+                                                        std::vector<const double*> columns, size_t rows, size_t blockRows = 4096)
+{
+    for(size_t base = 0; base < rows; base += blockRows)
+    {
+        co_await resumeOn(pool);
+
+        size_t n = std::min(blockRows, rows - base);
+        std::vector<double> out(n);
+        ce.evaluateBatch(columns.data(), n, out.data());
+        for(auto &col : columns) col += n;
+
+        co_yield std::move(out);
+    }
+}
+
+// ----------------------------
+// Block the calling (non-pool) thread until a task is done; for
+// code at the edge of the coroutine world, like main()
+// ----------------------------
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+template<class T>
+T syncWait(Task<T> task)
+{
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+    std::optional<T> result;
+    std::exception_ptr error;
+
+    auto run = [&]() -> Detached
+    {
+        try { result.emplace(co_await std::move(task)); }
+        catch (...) { error = std::current_exception(); }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        done = true;
+        cv.notify_one();
+    };
+    run();
+
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]() { return done; });
+    if(error) std::rethrow_exception(error);
+    return std::move(*result);
+}
+
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// ----------------------------
+// Local server over a Unix domain socket
+// Protocol: one expression per line in, one "OK <value>" or
+// "ERR <message>" line out. Clients may pipeline any number of
+// requests; responses come back in request order.
+// ----------------------------
+class Server
+{
+    private:
+        const Calculator& calc;
+        unsigned workers;
+        std::unique_ptr<ThreadPool> pool;
+        int listenFd = -1;
+
+        // A request line longer than this, still without its '\n', gets
+        // an error that ends the output; the rest of the input is read
+        // and dropped until the client closes, as closing a socket with
+        // unread input would reset the connection before the error is read
+        static constexpr size_t maxLineLength = 1 << 16;
+
+        // Requests of one connection (of one loop, with epoll) on the pool at once
+        static constexpr size_t maxInFlight = 4096;
+
+        // A response and its request's sequence number
+        struct Response
+        {
+            uint64_t seq = 0;
+            std::string text;
+        };
+
+        // ----------------------------
+        // Responses of one connection on their way to its writer.
+        // Workers push into `results` and wake the writer only when it
+        // has parked, as ThreadPool does. The reader keeps at most
+        // maxInFlight requests ahead of what the writer has taken, so
+        // a push never waits
+        // ----------------------------
+        struct Pending
+        {
+            MpmcQueue<Response> results{maxInFlight};
+            std::atomic<uint64_t> taken{0};
+            std::atomic<bool> parked{false};
+            std::mutex mtx;
+            std::condition_variable cv;
+            bool done = false;
+            uint64_t total = 0;
+
+            void post(Response r)
+            {
+                results.push(std::move(r));
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(!parked.load()) return;
+
+                std::lock_guard<std::mutex> lock(mtx);
+                cv.notify_one();
+            }
+        };
+
+        static bool writeAll(int fd, const char* data, size_t len)
+        {
+            while(len > 0)
+            {
+                ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) return false;
+
+                data += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        // The job goes to `jobs`, for one pool submit per read
+        void submit(const std::shared_ptr<Pending>& pending, uint64_t seq, std::string line, std::vector<std::function<void()>>& jobs)
+        {
+            jobs.push_back([this, pending, seq, line = std::move(line)]()
+            {
+                std::string text;
+                try { text = "OK " + calc.evaluateText(line) + "\n"; }
+                catch (const std::exception& exc) { text = std::string("ERR ") + exc.what() + "\n"; }
+                pending->post(Response{seq, std::move(text)});
+            });
+        }
+
+        // ----------------------------
+        // Writer side: take responses as they come, put them back in
+        // request order and flush whatever is ready in one send() to
+        // keep syscalls per request low
+        // ----------------------------
+        static void writeResponses(int fd, Pending& pending)
+        {
+            std::deque<std::optional<std::string>> waiting;
+            uint64_t answered = 0;
+            std::string out;
+            bool ok = true;
+            Response got[64];
+
+            for(unsigned spins = 0;;)
+            {
+                if(size_t n = pending.results.tryPop(got, 64))
+                {
+                    pending.taken += n;
+                    for(size_t k = 0; k < n; ++k)
+                    {
+                        size_t at = got[k].seq - answered;
+                        if(waiting.size() <= at) waiting.resize(at + 1);
+                        waiting[at] = std::move(got[k].text);
+                    }
+
+                    while(!waiting.empty() && waiting.front())
+                    {
+                        out += *waiting.front();
+                        waiting.pop_front();
+                        ++answered;
+                    }
+                    spins = 0;
+                    continue;
+                }
+
+                if(!out.empty())
+                {
+                    ok = ok && writeAll(fd, out.data(), out.size());
+                    out.clear();
+                }
+
+                if(spins < 128)
+                {
+                    backoff(spins++);
+                    continue;
+                }
+
+                // Announce, then look again: a post either sees the
+                // announcement or its response is seen here
+                std::unique_lock<std::mutex> lock(pending.mtx);
+                pending.parked = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                pending.cv.wait(lock, [&]() { return (pending.done && answered == pending.total) || !pending.results.empty(); });
+                pending.parked = false;
+
+                if(pending.results.empty()) break;
+                spins = 0;
+            }
+        }
+
+        // ----------------------------
+        // Reader side: split the byte stream into lines and hand each
+        // to the pool as soon as it is complete; at end of input the
+        // rest is the last line
+        // ----------------------------
+        void handleConnection(int fd)
+        {
+            auto pending = std::make_shared<Pending>();
+            std::thread writer([fd, pending]() { writeResponses(fd, *pending); });
+
+            std::string buffer;
+            char chunk[4096];
+            std::vector<std::function<void()>> jobs;
+            uint64_t submitted = 0;
+            bool tooLong = false;
+
+            // Waits while maxInFlight requests are ahead of the writer,
+            // after handing the pool those not submitted yet
+            auto next = [&]()
+            {
+                if(submitted - pending->taken >= maxInFlight && !jobs.empty()) pool->submit(jobs);
+                for(unsigned spins = 0; submitted - pending->taken >= maxInFlight; backoff(spins++)) {}
+                return submitted++;
+            };
+
+            while(true)
+            {
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) break;
+
+                buffer.append(chunk, n);
+
+                size_t start = 0, nl;
+                while((nl = buffer.find('\n', start)) != std::string::npos)
+                {
+                    size_t end = nl;
+                    if(end > start && buffer[end - 1] == '\r') --end;
+
+                    submit(pending, next(), buffer.substr(start, end - start), jobs);
+                    start = nl + 1;
+                }
+                buffer.erase(0, start);
+
+                if(!jobs.empty()) pool->submit(jobs);
+
+                if(buffer.size() > maxLineLength)
+                {
+                    pending->post(Response{next(), "ERR Request line too long.\n"});
+                    buffer.clear();
+                    tooLong = true;
+                    break;
+                }
+            }
+
+            if(!buffer.empty())
+            {
+                if(buffer.back() == '\r') buffer.pop_back();
+                submit(pending, next(), std::move(buffer), jobs);
+                pool->submit(jobs);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(pending->mtx);
+                pending->done = true;
+                pending->total = submitted;
+            }
+            pending->cv.notify_one();
+
+            writer.join();
+
+            if(tooLong)
+            {
+                shutdown(fd, SHUT_WR);
+                for(ssize_t n; (n = recv(fd, chunk, sizeof(chunk), 0)) > 0 || (n < 0 && errno == EINTR);) {}
+            }
+            close(fd);
+        }
+
+#ifdef __linux__
+        // ----------------------------
+        // Event loop state of one connection
+        // Complete lines are cut out of `in` and evaluated on the pool.
+        // Request k gets sequence number k, and its response waits in
+        // `waiting` until the ones before it are in, so responses leave
+        // in request order. Each run of ready responses becomes one
+        // chunk of `out`, flushed with one sendmsg
+        // ----------------------------
+        struct Connection
+        {
+            int fd = -1;
+            size_t slot = 0;   // index in Loop::conns
+            std::vector<char> in;
+            size_t inLen = 0;
+            std::deque<std::string> out;
+            size_t outOffset = 0;
+            size_t outBytes = 0;
+            bool readBlocked = false;
+            bool eof = false;
+            bool discard = false;     // after a line too long, see maxLineLength
+            bool shut = false;        // output ended with shutdown()
+
+            uint64_t submitted = 0;   // sequence number of the next request
+            uint64_t answered = 0;    // of the first response still waiting
+            std::deque<std::optional<std::string>> waiting;
+            size_t inFlight = 0;      // requests on the pool
+            bool stalled = false;     // lines left over while the loop was full
+            bool touched = false;     // in this round's list of results
+            bool closed = false;      // fd closed; freed once nothing is in flight
+        };
+
+        // A response on its way from the pool back to the loop
+        struct Result
+        {
+            Connection* conn = nullptr;
+            uint64_t seq = 0;
+            std::string text;
+        };
+
+        static constexpr size_t maxPendingOutput = 1 << 20;
+        static constexpr int maxIov = 64;
+
+        // ----------------------------
+        // One epoll loop: reads requests, hands them to the pool and
+        // writes the responses back. A worker pushes its result into
+        // `results` and rings `wake`, an eventfd, unless a ring is
+        // already pending. At most maxInFlight requests of a loop are
+        // out at once, so `results` always has room and a worker
+        // never waits on a loop
+        // ----------------------------
+        struct Loop
+        {
+            int ep = -1;
+            int wake = -1;
+            MpmcQueue<Result> results{maxInFlight};
+            std::atomic<bool> rung{false};
+            size_t inFlight = 0;
+            std::vector<std::unique_ptr<Connection>> conns;
+            std::vector<Connection*> stalled;
+
+            ~Loop()
+            {
+                for(auto &c : conns)
+                    if(!c->closed) close(c->fd);
+                if(wake >= 0) close(wake);
+                if(ep >= 0) close(ep);
+            }
+
+            void ring()
+            {
+                uint64_t one = 1;
+                if(!rung.exchange(true) && write(wake, &one, sizeof(one)) < 0) {}
+            }
+        };
+
+        std::vector<std::unique_ptr<Loop>> loops;
+        std::atomic<bool> stopping{false};
+
+        void openLoop()
+        {
+            loops.push_back(std::make_unique<Loop>());
+            Loop &loop = *loops.back();
+
+            loop.ep = epoll_create1(EPOLL_CLOEXEC);
+            if(loop.ep < 0)
+                throw std::runtime_error(std::string("epoll_create1: ") + strerror(errno));
+
+            loop.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if(loop.wake < 0)
+                throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+
+            // The listening socket is tagged nullptr, the eventfd with the loop
+            epoll_event lev{}, wev{};
+            lev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            lev.data.ptr = nullptr;
+            wev.events = EPOLLIN;
+            wev.data.ptr = &loop;
+
+            if(epoll_ctl(loop.ep, EPOLL_CTL_ADD, listenFd, &lev) < 0 || epoll_ctl(loop.ep, EPOLL_CTL_ADD, loop.wake, &wev) < 0)
+                throw std::runtime_error(std::string("epoll_ctl: ") + strerror(errno));
+        }
+
+        // Every loop returns from its next wait
+        void stop()
+        {
+            stopping = true;
+            uint64_t one = 1;
+            for(auto &loop : loops)
+                if(write(loop->wake, &one, sizeof(one)) < 0) {}
+        }
+
+        // Files one response and moves the run now in order to `out`
+        static void deliver(Connection& conn, uint64_t seq, std::string text)
+        {
+            conn.waiting[seq - conn.answered] = std::move(text);
+
+            std::string batch;
+            while(!conn.waiting.empty() && conn.waiting.front())
+            {
+                batch += *conn.waiting.front();
+                conn.waiting.pop_front();
+                ++conn.answered;
+            }
+
+            if(!batch.empty())
+            {
+                conn.outBytes += batch.size();
+                conn.out.push_back(std::move(batch));
+            }
+        }
+
+        // ----------------------------
+        // Hand every complete line in the receive buffer to the pool,
+        // in one submit, while the loop has room; at end of input the
+        // rest is the last line. A line that outgrows maxLineLength
+        // gets an error, and later input is dropped
+        // ----------------------------
+        void processInput(Loop& loop, Connection& conn)
+        {
+            if(conn.discard)
+            {
+                conn.inLen = 0;
+                return;
+            }
+
+            const char* data = conn.in.data();
+            size_t start = 0;
+            std::vector<std::function<void()>> jobs;
+
+            while(loop.inFlight < maxInFlight && start < conn.inLen)
+            {
+                const void* hit = memchr(data + start, '\n', conn.inLen - start);
+                if(!hit && !conn.eof) break;
+
+                size_t nl = hit ? static_cast<const char*>(hit) - data : conn.inLen;
+                size_t end = nl;
+                if(end > start && data[end - 1] == '\r') --end;
+
+                jobs.push_back([this, &loop, c = &conn, seq = conn.submitted, line = std::string(data + start, end - start)]()
+                {
+                    std::string text;
+                    try { text = "OK " + calc.evaluateText(line) + "\n"; }
+                    catch (const std::exception& exc) { text = std::string("ERR ") + exc.what() + "\n"; }
+
+                    loop.results.push(Result{c, seq, std::move(text)});
+                    loop.ring();
+                });
+
+                ++conn.submitted;
+                ++conn.inFlight;
+                ++loop.inFlight;
+                conn.waiting.emplace_back();
+                start = hit ? nl + 1 : nl;
+            }
+
+            if(start > 0)
+            {
+                memmove(conn.in.data(), data + start, conn.inLen - start);
+                conn.inLen -= start;
+            }
+
+            if(!jobs.empty()) pool->submit(jobs);
+
+            if(loop.inFlight >= maxInFlight && conn.inLen > 0)
+            {
+                if(!conn.stalled) loop.stalled.push_back(&conn);
+                conn.stalled = true;
+            }
+            else if(conn.inLen > maxLineLength)
+            {
+                conn.waiting.emplace_back();
+                deliver(conn, conn.submitted++, "ERR Request line too long.\n");
+                conn.inLen = 0;
+                conn.discard = true;
+            }
+        }
+
+        // Edge-triggered: read until EAGAIN unless output is backed up
+        // or the loop is full
+        bool readInput(Loop& loop, Connection& conn)
+        {
+            while(true)
+            {
+                conn.readBlocked = conn.outBytes >= maxPendingOutput || conn.stalled;
+                if(conn.readBlocked || conn.eof) return true;
+
+                if(conn.in.size() - conn.inLen < 4096)
+                    conn.in.resize(std::max<size_t>(conn.in.size() * 2, 16384));
+
+                ssize_t n = read(conn.fd, conn.in.data() + conn.inLen, conn.in.size() - conn.inLen);
+
+                if(n > 0)
+                {
+                    conn.inLen += n;
+                    processInput(loop, conn);
+                    continue;
+                }
+
+                if(n == 0)
+                {
+                    conn.eof = true;
+                    processInput(loop, conn);
+                    return true;
+                }
+                if(errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+        }
+
+        // Vectored write of all pending response chunks
+        bool flushOutput(Connection& conn)
+        {
+            while(!conn.out.empty())
+            {
+                iovec iov[maxIov];
+                int count = 0;
+
+                for(auto it = conn.out.begin(); it != conn.out.end() && count < maxIov; ++it, ++count)
+                {
+                    size_t skip = count == 0 ? conn.outOffset : 0;
+                    iov[count].iov_base = const_cast<char*>(it->data()) + skip;
+                    iov[count].iov_len = it->size() - skip;
+                }
+
+                msghdr msg{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = count;
+
+                ssize_t n = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+
+                if(n < 0)
+                {
+                    if(errno == EINTR) continue;
+                    return errno == EAGAIN || errno == EWOULDBLOCK;
+                }
+
+                conn.outBytes -= n;
+                size_t sent = n + conn.outOffset;
+
+                while(!conn.out.empty() && sent >= conn.out.front().size())
+                {
+                    sent -= conn.out.front().size();
+                    conn.out.pop_front();
+                }
+                conn.outOffset = sent;
+            }
+            return true;
+        }
+
+        // Reads if asked and flushes until the socket would block;
+        // false on a socket error
+        bool service(Loop& loop, Connection& conn, bool readable)
+        {
+            bool alive = !readable || readInput(loop, conn);
+
+            // Flushing may unblock reading, which may produce more output
+            while(alive)
+            {
+                alive = flushOutput(conn);
+                if(!alive || !conn.readBlocked || conn.outBytes >= maxPendingOutput || conn.stalled) break;
+                alive = readInput(loop, conn);
+            }
+            return alive;
+        }
+
+        // Closes a connection that failed or is done; it is freed once
+        // none of its requests is on the pool
+        static void settle(Loop& loop, Connection& conn, bool alive)
+        {
+            bool done = conn.eof && conn.inLen == 0 && conn.inFlight == 0 && conn.out.empty();
+
+            if(alive && !done && conn.discard && !conn.shut && conn.inFlight == 0 && conn.out.empty())
+            {
+                shutdown(conn.fd, SHUT_WR);
+                conn.shut = true;
+            }
+
+            if(!conn.closed && (!alive || done))
+            {
+                close(conn.fd);
+                conn.closed = true;
+            }
+
+            if(conn.closed && conn.inFlight == 0 && !conn.stalled)
+            {
+                size_t slot = conn.slot;
+                loop.conns[slot] = std::move(loop.conns.back());
+                loop.conns[slot]->slot = slot;
+                loop.conns.pop_back();
+            }
+        }
+
+        // ----------------------------
+        // Responses back from the pool: file them in order, then give
+        // the room they freed to connections that stalled on it, and
+        // flush every connection that got something
+        // ----------------------------
+        void collect(Loop& loop)
+        {
+            uint64_t count;
+            if(read(loop.wake, &count, sizeof(count)) < 0) {}
+            loop.rung = false;
+
+            std::vector<Connection*> work;
+            auto touch = [&](Connection& conn)
+            {
+                if(!conn.touched) work.push_back(&conn);
+                conn.touched = true;
+            };
+
+            Result got[64];
+            while(size_t n = loop.results.tryPop(got, 64))
+            {
+                for(size_t k = 0; k < n; ++k)
+                {
+                    Connection &conn = *got[k].conn;
+                    --conn.inFlight;
+                    --loop.inFlight;
+                    if(!conn.closed) deliver(conn, got[k].seq, std::move(got[k].text));
+                    touch(conn);
+                }
+            }
+
+            std::vector<Connection*> stalled;
+            stalled.swap(loop.stalled);
+            for(auto *conn : stalled)
+            {
+                conn->stalled = false;
+                if(!conn->closed) processInput(loop, *conn);
+                touch(*conn);
+            }
+
+            for(auto *conn : work)
+            {
+                conn->touched = false;
+                settle(loop, *conn, conn->closed || service(loop, *conn, false));
+            }
+        }
+
+        // ----------------------------
+        // Edge-triggered epoll loop, for I/O only
+        // All loops wait on the listening socket with EPOLLEXCLUSIVE,
+        // so each new connection wakes one loop which then owns it.
+        // Results are collected after the batch's socket events, since
+        // collecting may free a connection
+        // ----------------------------
+        void eventLoop(Loop& loop)
+        {
+            epoll_event events[256];
+
+            while(!stopping)
+            {
+                int n = epoll_wait(loop.ep, events, 256, -1);
+
+                if(n < 0)
+                {
+                    if(errno == EINTR) continue;
+                    throw std::runtime_error(std::string("epoll_wait: ") + strerror(errno));
+                }
+
+                bool woken = false;
+
+                for(int e = 0; e < n; ++e)
+                {
+                    void* tag = events[e].data.ptr;
+
+                    if(tag == &loop)
+                    {
+                        woken = true;
+                        continue;
+                    }
+
+                    if(!tag)
+                    {
+                        int fd;
+                        while((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                        {
+                            auto c = std::make_unique<Connection>();
+                            c->fd = fd;
+                            c->slot = loop.conns.size();
+
+                            epoll_event cev{};
+                            cev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                            cev.data.ptr = c.get();
+
+                            if(epoll_ctl(loop.ep, EPOLL_CTL_ADD, fd, &cev) < 0) close(fd);
+                            else loop.conns.push_back(std::move(c));
+                        }
+                        continue;
+                    }
+
+                    auto &conn = *static_cast<Connection*>(tag);
+                    bool readable = events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+                    settle(loop, conn, service(loop, conn, readable));
+                }
+
+                if(woken) collect(loop);
+            }
+        }
+#endif
+
+    public:
+        Server(const Calculator& c, unsigned workerCount) : calc(c), workers(workerCount ? workerCount : 1) {}
+
+        ~Server()
+        {
+            if(listenFd >= 0) close(listenFd);
+        }
+
+        void listen(const std::string& path)
+        {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+
+            if(path.size() >= sizeof(addr.sun_path))
+                throw std::runtime_error("Socket path too long: " + path);
+
+            path.copy(addr.sun_path, path.size());
+            unlink(path.c_str());
+
+            listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(listenFd < 0)
+                throw std::runtime_error(std::string("socket: ") + strerror(errno));
+
+            if(bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listenFd, SOMAXCONN) < 0)
+                throw std::runtime_error("Cannot listen on " + path + ": " + strerror(errno));
+        }
+
+        // ----------------------------
+        // Evaluation runs on the pool; on Linux one epoll loop per four
+        // workers does the socket I/O. A loop that fails stops the
+        // others, and the error is rethrown once all are joined and
+        // the pool has drained into the loops
+        // ----------------------------
+        void run()
+        {
+#ifdef __linux__
+            int flags = fcntl(listenFd, F_GETFL);
+            fcntl(listenFd, F_SETFL, flags | O_NONBLOCK);
+
+            pool = std::make_unique<ThreadPool>(workers);
+            std::exception_ptr error;
+            std::mutex errorMtx;
+            std::vector<std::thread> threads;
+
+            auto guarded = [&](Loop& loop)
+            {
+                try { eventLoop(loop); }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(errorMtx);
+                    if(!error) error = std::current_exception();
+                }
+                stop();
+            };
+
+            try
+            {
+                for(unsigned i = 0; i < (workers + 3) / 4; ++i) openLoop();
+                for(size_t i = 1; i < loops.size(); ++i)
+                    threads.emplace_back([&guarded, &loop = *loops[i]]() { guarded(loop); });
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorMtx);
+                error = std::current_exception();
+            }
+
+            if(!error) guarded(*loops[0]);
+            stop();
+
+            for(auto &t : threads) t.join();
+            pool.reset();
+            loops.clear();
+
+            if(error) std::rethrow_exception(error);
+#else
+            runThreaded();
+#endif
+        }
+
+        // One reader/writer thread pair per connection, evaluation on the pool
+        void runThreaded()
+        {
+            pool = std::make_unique<ThreadPool>(workers);
+
+            while(true)
+            {
+                int fd = accept(listenFd, nullptr, nullptr);
+
+                if(fd < 0)
+                {
+                    if(errno == EINTR) continue;
+                    throw std::runtime_error(std::string("accept: ") + strerror(errno));
+                }
+
+                std::thread([this, fd]() { handleConnection(fd); }).detach();
+            }
+        }
+};
+
+// ----------------------------
+// Load generator for the local server
+// Each connection keeps `depth` requests in flight and records
+// the latency of every response
+// ----------------------------
+int loadgen(const std::string& path, unsigned connections, unsigned requests, unsigned depth)
+{
+    static const char* exprs[] =
+    {
+        "-3 + 5 - (8^2 + 2)\n",
+        "3^2^3 - 128 + (10^3 - 9 * 5)\n",
+        "(10 * 3) - (7 / 2) + (8^3 * 2)\n",
+    };
+
+    if(depth == 0) depth = 1;
+
+    std::vector<std::vector<double>> latencies(connections);
+    std::atomic<unsigned long> errors{0};
+    std::vector<std::thread> clients;
+    auto start = std::chrono::steady_clock::now();
+
+    for(unsigned c = 0; c < connections; ++c)
+    {
+        clients.emplace_back([&, c]()
+        {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            path.copy(addr.sun_path, std::min(path.size(), sizeof(addr.sun_path) - 1));
+
+            if(fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+            {
+                std::cerr << "Error: cannot connect to " << path << ": " << strerror(errno) << "\n";
+                errors += requests;
+                if(fd >= 0) close(fd);
+                return;
+            }
+
+            using Clock = std::chrono::steady_clock;
+            std::vector<Clock::time_point> sent(requests);
+            auto &lat = latencies[c];
+            lat.reserve(requests);
+
+            unsigned nextSend = 0, received = 0;
+            std::string out;
+
+            auto sendUpTo = [&](unsigned limit)
+            {
+                out.clear();
+                auto now = Clock::now();
+
+                for(; nextSend < limit && nextSend < requests; ++nextSend)
+                {
+                    out += exprs[(c + nextSend) % 3];
+                    sent[nextSend] = now;
+                }
+
+                const char* p = out.data();
+                size_t len = out.size();
+
+                while(len > 0)
+                {
+                    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+                    if(n < 0 && errno == EINTR) continue;
+                    if(n <= 0) return false;
+                    p += n;
+                    len -= n;
+                }
+                return true;
+            };
+
+            char chunk[4096];
+            bool ok = sendUpTo(depth);
+
+            while(ok && received < requests)
+            {
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) break;
+
+                auto now = Clock::now();
+
+                for(ssize_t i = 0; i < n; ++i)
+                {
+                    if(chunk[i] == 'E' && (i == 0 || chunk[i - 1] == '\n')) ++errors;
+                    if(chunk[i] != '\n') continue;
+
+                    lat.push_back(std::chrono::duration<double, std::micro>(now - sent[received]).count());
+                    ++received;
+                }
+
+                ok = sendUpTo(received + depth);
+            }
+
+            errors += requests - received;
+            close(fd);
+        });
+    }
+
+    for(auto &t : clients) t.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::vector<double> all;
+    for(auto &l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+
+    auto percentile = [&](double p) { return all.empty() ? 0.0 : all[std::min(all.size() - 1, size_t(p * all.size()))]; };
+
+    std::cout << "Load: " << connections << " connections x " << requests << " requests, depth " << depth << "\n";
+    std::cout << "Completed " << all.size() << " in " << elapsed.count() << "s -> "
+              << all.size() / elapsed.count() << " requests/sec\n";
+    std::cout << "Latency (us): p50 " << percentile(0.50) << ", p99 " << percentile(0.99)
+              << ", max " << (all.empty() ? 0.0 : all.back()) << "\n";
+    std::cout << "Errors: " << errors << "\n";
+
+    return errors == 0 ? 0 : 1;
+}
+
+#endif
+
+// Shortest text that reads back as the same double
+void appendNumber(std::string& out, double value)
+{
+    char buf[32];
+#if defined(__cpp_lib_to_chars)
+    auto r = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, r.ptr - buf);
+#else
+    int n = snprintf(buf, sizeof(buf), "%.17g", value);
+    out.append(buf, n);
+#endif
+}
+
+// ----------------------------
+// CSV input, a block of rows at a time. Only the columns asked for
+// are parsed, straight into column buffers, and a row is not looked
+// at past the last of them. The first line names the columns.
+// Quoted fields may hold commas and "" but not line breaks
+// ----------------------------
+class CsvReader
+{
+    public:
+        explicit CsvReader(FILE* in) : in(in) { readHeader(); }
+
+        const std::vector<std::string>& columns() const { return names; }
+        const std::string& headerLine() const { return header; }
+
+        // Up to maxRows more rows; column select[k] of row r goes to cols[k][r]
+        size_t read(size_t maxRows, const std::vector<size_t>& select, double* const* cols);
+
+        // Row r of the last read: its text without the line break, and line number
+        std::string_view line(size_t r) const { return {buf.data() + rows[r].start, rows[r].len}; }
+        size_t lineNumber(size_t r) const { return rows[r].number; }
+
+    private:
+        struct Row { size_t start, len, number; };
+
+        FILE* in;
+        std::string buf;
+        size_t pos = 0;     // first unread byte of buf
+        size_t scan = 0;    // no line break in buf before this
+        bool eof = false;
+        size_t lineNo = 0;
+        std::vector<std::string> names;
+        std::string header;
+        std::vector<Row> rows;
+
+        bool nextLine(size_t& start, size_t& len);
+        void readHeader();
+
+        // [f, e) of the field at p; returns where the next field starts (past end if none)
+        static const char* field(const char* p, const char* end, const char*& f, const char*& e);
+};
+
+bool CsvReader::nextLine(size_t& start, size_t& len)
+{
+    while(true)
+    {
+        const char* nl = static_cast<const char*>(memchr(buf.data() + scan, '\n', buf.size() - scan));
+        if(nl || (eof && pos < buf.size()))
+        {
+            size_t stop = nl ? nl - buf.data() : buf.size();
+            start = pos;
+            len = stop - pos;
+            if(len > 0 && buf[stop - 1] == '\r') --len;
+            pos = scan = nl ? stop + 1 : stop;
+            ++lineNo;
+            return true;
+        }
+
+        scan = buf.size();
+        if(eof) return false;
+
+        constexpr size_t chunk = 1 << 20;
+        size_t old = buf.size();
+        buf.resize(old + chunk);
+        size_t n = fread(&buf[old], 1, chunk, in);
+        buf.resize(old + n);
+
+        if(n == 0)
+        {
+            if(ferror(in)) throw std::runtime_error(std::string("Cannot read input: ") + strerror(errno));
+            eof = true;
+        }
+    }
+}
+
+const char* CsvReader::field(const char* p, const char* end, const char*& f, const char*& e)
+{
+    if(p < end && *p == '"')
+    {
+        const char* q = p + 1;
+        while(q < end && !(*q == '"' && (q + 1 == end || q[1] != '"'))) q += *q == '"' ? 2 : 1;
+
+        f = p + 1;
+        e = std::min(q, end);
+        p = std::min(q + 1, end);
+    }
+    else f = p;
+
+    // Fields are short: a plain loop beats memchr
+    const char* comma = p;
+    while(comma < end && *comma != ',') ++comma;
+    if(f == p) e = comma;
+    return comma + 1;
+}
+
+void CsvReader::readHeader()
+{
+    size_t start, len;
+    while(nextLine(start, len) && len == 0) {}
+    if(len == 0) throw std::runtime_error("Empty input: expected a header line.");
+
+    header.assign(buf, start, len);
+    if(header.compare(0, 3, "\xEF\xBB\xBF") == 0) header.erase(0, 3);
+
+    const char* end = header.data() + header.size();
+    for(const char* p = header.data(); p <= end;)
+    {
+        const char *f, *e;
+        p = field(p, end, f, e);
+
+        std::string name;
+        for(const char* c = f; c < e; ++c)
+        {
+            name += *c;
+            if(*c == '"' && c + 1 < e && c[1] == '"') ++c;
+        }
+        name.erase(name.find_last_not_of(" \t") + 1);
+        name.erase(0, name.find_first_not_of(" \t"));
+        names.push_back(name);
+    }
+}
+
+size_t CsvReader::read(size_t maxRows, const std::vector<size_t>& select, double* const* cols)
+{
+    // Rows of the previous read are done with; drop them once
+    // they add up, so the unread tail is not moved every block
+    if(pos >= (1 << 20))
+    {
+        buf.erase(0, pos);
+        scan -= pos;
+        pos = 0;
+    }
+    rows.clear();
+
+    // Field index -> position in select
+    std::vector<int> slotOf;
+    for(size_t k = 0; k < select.size(); ++k)
+    {
+        if(select[k] >= slotOf.size()) slotOf.resize(select[k] + 1, -1);
+        slotOf[select[k]] = int(k);
+    }
+
+    size_t start, len;
+    while(rows.size() < maxRows && nextLine(start, len))
+    {
+        if(len == 0) continue;
+
+        size_t r = rows.size();
+        rows.push_back({start, len, lineNo});
+
+        const char* p = buf.data() + start;
+        const char* end = p + len;
+
+        for(size_t index = 0; index < slotOf.size(); ++index)
+        {
+            if(p > end)
+                throw std::runtime_error("line " + std::to_string(lineNo) + ": expected " + std::to_string(names.size()) +
+                                         " columns, found " + std::to_string(index) + ".");
+
+            const char *f, *e;
+            p = field(p, end, f, e);
+            if(slotOf[index] < 0) continue;
+
+            while(f < e && (*f == ' ' || *f == '\t')) ++f;
+            while(e > f && (e[-1] == ' ' || e[-1] == '\t')) --e;
+
+            double v;
+            if(f == e || parseDouble(f, e, v) != e)
+                throw std::runtime_error("line " + std::to_string(lineNo) + ", column " + names[index] +
+                                         ": not a number: '" + std::string(f, e) + "'");
+            cols[slotOf[index]][r] = v;
+        }
+    }
+
+    return rows.size();
+}
+
+// A CSV field, quoted if it has to be
+void appendCsvField(std::string& out, const std::string& field)
+{
+    if(field.find_first_of(",\"") == std::string::npos)
+    {
+        out += field;
+        return;
+    }
+
+    out += '"';
+    for(char c : field) out.append(c == '"' ? 2 : 1, c);
+    out += '"';
+}
+
+void writeText(FILE* out, std::string& text)
+{
+    if(fwrite(text.data(), 1, text.size(), out) != text.size())
+        throw std::runtime_error(std::string("Cannot write output: ") + strerror(errno));
+    text.clear();
+}
+
+// A block of rows fails as a whole: evaluate them one at a time
+// to find the first that fails, and why
+size_t failingRow(const Calculator::CompiledExpr& ce, const double* const* cols, size_t rows, std::string& why)
+{
+    std::vector<double> values(ce.variables().size());
+    for(size_t r = 0; r < rows; ++r)
+    {
+        for(size_t k = 0; k < values.size(); ++k) values[k] = cols[k][r];
+        try { ce.evaluate(values.data()); }
+        catch (const std::runtime_error& exc)
+        {
+            why = exc.what();
+            return r;
+        }
+    }
+    return rows;
+}
+
+// Variables of a formula to the columns that give their values
+std::vector<size_t> selectColumns(const std::vector<std::string>& vars, const std::vector<std::string>& names)
+{
+    std::vector<size_t> select;
+    for(const auto &var : vars)
+    {
+        auto it = std::find(names.begin(), names.end(), var);
+        if(it == names.end())
+            throw std::runtime_error("Unknown column: " + var);
+        select.push_back(it - names.begin());
+    }
+    return select;
+}
+
+// ----------------------------
+// Apply a compiled formula to every row of a CSV stream. Its
+// variables name columns; a block of rows is parsed into column
+// buffers and evaluated in batch, and each input line is written
+// back with the result appended as one more column
+// ----------------------------
+void evaluateCsv(const Calculator::CompiledExpr& ce, FILE* in, FILE* out, const std::string& name)
+{
+    CsvReader reader(in);
+    const auto &vars = ce.variables();
+    auto select = selectColumns(vars, reader.columns());
+
+    constexpr size_t blockRows = 4096;
+    std::vector<double> data(std::max<size_t>(vars.size(), 1) * blockRows), results(blockRows);
+    std::vector<double*> cols;
+    for(size_t k = 0; k < vars.size(); ++k) cols.push_back(&data[k * blockRows]);
+
+    std::string text = reader.headerLine() + ',';
+    appendCsvField(text, name);
+    text += '\n';
+
+    size_t rows;
+    while((rows = reader.read(blockRows, select, cols.data())) > 0)
+    {
+        try { ce.evaluateBatch(cols.data(), rows, results.data()); }
+        catch (const std::runtime_error&)
+        {
+            std::string why;
+            size_t r = failingRow(ce, cols.data(), rows, why);
+            if(r < rows) throw std::runtime_error("line " + std::to_string(reader.lineNumber(r)) + ": " + why);
+            throw;
+        }
+
+        for(size_t r = 0; r < rows; ++r)
+        {
+            text.append(reader.line(r));
+            text += ',';
+            appendNumber(text, results[r]);
+            text += '\n';
+        }
+
+        if(text.size() >= (1 << 20)) writeText(out, text);
+    }
+
+    writeText(out, text);
+}
+
+int evaluateCsv(const Calculator& calc, const std::string& formula, const std::string& path, const std::string& name)
+{
+    try
+    {
+        auto ce = calc.compile(formula);
+
+        FILE* in = path == "-" ? stdin : fopen(path.c_str(), "rb");
+        if(!in) throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+        std::unique_ptr<FILE, int (*)(FILE*)> owned(in == stdin ? nullptr : in, fclose);
+
+        evaluateCsv(ce, in, stdout, name);
+        fflush(stdout);
+    }
+    catch (const std::runtime_error& exc) { std::cerr << "Error: " << exc.what() << "\n"; return 1; }
+    return 0;
+}
+
+// ----------------------------
+// Binary column file, for batch input and output without parsing.
+// All integers and doubles are little-endian:
+//
+//   0   "CALCCOL1"
+//   8   uint64 rows
+//   16  uint32 columns, uint32 0
+//   24  per column: uint64 offset of its data, uint32 type
+//       (1 = double), uint32 name length, the name (UTF-8)
+//
+// Each column's data is `rows` doubles back to back, starting on
+// a 64-byte boundary, so a mapped file is used in place
+// ----------------------------
+class ColumnFile
+{
+    public:
+        enum Type : uint32_t { FLOAT64 = 1 };
+
+        explicit ColumnFile(const std::string& path);   // mapped where possible; "-" reads stdin
+        explicit ColumnFile(FILE* in);                  // the rest of the stream
+        ~ColumnFile();
+
+        ColumnFile(const ColumnFile&) = delete;
+        ColumnFile& operator=(const ColumnFile&) = delete;
+
+        size_t rows() const { return count; }
+        const std::vector<std::string>& columns() const { return names; }
+        const double* column(size_t k) const { return data[k]; }
+
+        static void write(FILE* out, const std::vector<std::string>& names, const std::vector<const double*>& columns, size_t rows);
+
+    private:
+        const unsigned char* base = nullptr;
+        size_t size = 0;
+        void* mapped = nullptr;                  // unmapped on destruction
+        std::vector<double> owned;               // the file, when read rather than mapped
+        std::vector<std::vector<double>> swapped;   // columns on a big-endian host
+
+        size_t count = 0;
+        std::vector<std::string> names;
+        std::vector<const double*> data;
+
+        void load(FILE* in);
+        void parse();
+};
+
+bool littleEndian()
+{
+    const uint16_t one = 1;
+    uint8_t low;
+    memcpy(&low, &one, 1);
+    return low == 1;
+}
+
+template<class T>
+void putLE(std::string& out, T v)
+{
+    for(size_t i = 0; i < sizeof(T); ++i) out += char(uint64_t(v) >> (8 * i));
+}
+
+template<class T>
+T getLE(const unsigned char* p)
+{
+    uint64_t v = 0;
+    for(size_t i = 0; i < sizeof(T); ++i) v |= uint64_t(p[i]) << (8 * i);
+    return T(v);
+}
+
+ColumnFile::ColumnFile(const std::string& path)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    if(path != "-")
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+        struct stat st;
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED)
+            {
+                mapped = p;
+                base = static_cast<const unsigned char*>(p);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+
+        if(mapped)
+        {
+            try { parse(); }
+            catch (...) { munmap(mapped, size); throw; }
+            return;
+        }
+    }
+#endif
+
+    FILE* in = path == "-" ? stdin : fopen(path.c_str(), "rb");
+    if(!in) throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    std::unique_ptr<FILE, int (*)(FILE*)> closer(in == stdin ? nullptr : in, fclose);
+    load(in);
+}
+
+ColumnFile::ColumnFile(FILE* in)
+{
+    load(in);
+}
+
+ColumnFile::~ColumnFile()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    if(mapped) munmap(mapped, size);
+#endif
+}
+
+// Read into doubles, so the columns are aligned like a mapping
+void ColumnFile::load(FILE* in)
+{
+    size_t used = 0;
+    while(true)
+    {
+        if(used == owned.size() * sizeof(double)) owned.resize(std::max<size_t>(owned.size() * 2, 1 << 16));
+
+        size_t n = fread(reinterpret_cast<char*>(owned.data()) + used, 1, owned.size() * sizeof(double) - used, in);
+        used += n;
+        if(n == 0) break;
+    }
+
+    if(ferror(in)) throw std::runtime_error(std::string("Cannot read input: ") + strerror(errno));
+
+    base = reinterpret_cast<const unsigned char*>(owned.data());
+    size = used;
+    parse();
+}
+
+void ColumnFile::parse()
+{
+    auto corrupt = [](const char* why) { return std::runtime_error(std::string("Not a column file: ") + why); };
+
+    if(size < 24 || memcmp(base, "CALCCOL1", 8) != 0) throw corrupt("no CALCCOL1 header.");
+
+    count = getLE<uint64_t>(base + 8);
+    uint32_t columns = getLE<uint32_t>(base + 16);
+
+    size_t at = 24;
+    for(uint32_t k = 0; k < columns; ++k)
+    {
+        if(size - at < 16) throw corrupt("header cut short.");
+
+        uint64_t offset = getLE<uint64_t>(base + at);
+        uint32_t type = getLE<uint32_t>(base + at + 8);
+        uint32_t len = getLE<uint32_t>(base + at + 12);
+        at += 16;
+
+        if(size - at < len) throw corrupt("header cut short.");
+        names.emplace_back(reinterpret_cast<const char*>(base + at), len);
+        at += len;
+
+        if(type != FLOAT64)
+            throw std::runtime_error("Column " + names.back() + " has unsupported type " + std::to_string(type) + ".");
+        if(offset % alignof(double) != 0 || offset > size || count > (size - offset) / sizeof(double))
+            throw corrupt("column data out of range.");
+
+        data.push_back(reinterpret_cast<const double*>(base + offset));
+    }
+
+    if(!littleEndian())
+    {
+        for(auto &col : data)
+        {
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(col);
+            swapped.emplace_back(count);
+            for(size_t r = 0; r < count; ++r)
+            {
+                uint64_t bits = getLE<uint64_t>(p + r * 8);
+                memcpy(&swapped.back()[r], &bits, 8);
+            }
+            col = swapped.back().data();
+        }
+    }
+}
+
+void ColumnFile::write(FILE* out, const std::vector<std::string>& names, const std::vector<const double*>& columns, size_t rows)
+{
+    auto align = [](size_t n) { return (n + 63) & ~size_t(63); };
+
+    size_t headerSize = 24;
+    for(const auto &name : names) headerSize += 16 + name.size();
+
+    std::string text("CALCCOL1");
+    putLE<uint64_t>(text, rows);
+    putLE<uint32_t>(text, names.size());
+    putLE<uint32_t>(text, 0);
+
+    size_t offset = align(headerSize);
+    for(const auto &name : names)
+    {
+        putLE<uint64_t>(text, offset);
+        putLE<uint32_t>(text, FLOAT64);
+        putLE<uint32_t>(text, name.size());
+        text += name;
+        offset += align(rows * sizeof(double));
+    }
+    text.resize(align(headerSize), '\0');
+    writeText(out, text);
+
+    for(const double* col : columns)
+    {
+        if(littleEndian())
+        {
+            if(fwrite(col, sizeof(double), rows, out) != rows)
+                throw std::runtime_error(std::string("Cannot write output: ") + strerror(errno));
+        }
+        else
+        {
+            for(size_t r = 0; r < rows; ++r)
+            {
+                uint64_t bits;
+                memcpy(&bits, &col[r], 8);
+                putLE<uint64_t>(text, bits);
+                if(text.size() >= (1 << 20)) writeText(out, text);
+            }
+        }
+
+        text.resize(text.size() + align(rows * sizeof(double)) - rows * sizeof(double), '\0');
+        writeText(out, text);
+    }
+}
+
+// ----------------------------
+// Apply a compiled formula to a column file: its variables point
+// straight into the input columns, and the output is the input
+// with the result as one more column
+// ----------------------------
+void evaluateColumns(const Calculator::CompiledExpr& ce, const ColumnFile& in, FILE* out, const std::string& name)
+{
+    auto select = selectColumns(ce.variables(), in.columns());
+    size_t rows = in.rows();
+    std::vector<double> results(rows);
+
+    // In blocks, so an error is found without going over every row again
+    constexpr size_t blockRows = 1 << 16;
+    std::vector<const double*> cols(select.size());
+
+    for(size_t base = 0; base < rows; base += blockRows)
+    {
+        size_t n = std::min(blockRows, rows - base);
+        for(size_t k = 0; k < select.size(); ++k) cols[k] = in.column(select[k]) + base;
+
+        try { ce.evaluateBatch(cols.data(), n, results.data() + base); }
+        catch (const std::runtime_error&)
+        {
+            std::string why;
+            size_t r = failingRow(ce, cols.data(), n, why);
+            if(r < n) throw std::runtime_error("row " + std::to_string(base + r + 1) + ": " + why);
+            throw;
+        }
+    }
+
+    auto names = in.columns();
+    names.push_back(name);
+    std::vector<const double*> columns;
+    for(size_t k = 0; k < in.columns().size(); ++k) columns.push_back(in.column(k));
+    columns.push_back(results.data());
+
+    ColumnFile::write(out, names, columns, rows);
+}
+
+// CSV whose columns are all numbers to a column file
+void csvToColumns(FILE* in, FILE* out)
+{
+    CsvReader reader(in);
+    size_t n = reader.columns().size();
+
+    std::vector<size_t> select(n);
+    for(size_t k = 0; k < n; ++k) select[k] = k;
+
+    constexpr size_t blockRows = 4096;
+    std::vector<double> block(n * blockRows);
+    std::vector<double*> cols;
+    for(size_t k = 0; k < n; ++k) cols.push_back(&block[k * blockRows]);
+
+    std::vector<std::vector<double>> data(n);
+    size_t rows, total = 0;
+    while((rows = reader.read(blockRows, select, cols.data())) > 0)
+    {
+        for(size_t k = 0; k < n; ++k) data[k].insert(data[k].end(), cols[k], cols[k] + rows);
+        total += rows;
+    }
+
+    std::vector<const double*> columns;
+    for(const auto &col : data) columns.push_back(col.data());
+    ColumnFile::write(out, reader.columns(), columns, total);
+}
+
+void columnsToCsv(const ColumnFile& in, FILE* out)
+{
+    std::string text;
+    for(size_t k = 0; k < in.columns().size(); ++k)
+    {
+        if(k) text += ',';
+        appendCsvField(text, in.columns()[k]);
+    }
+    text += '\n';
+
+    for(size_t r = 0; r < in.rows(); ++r)
+    {
+        for(size_t k = 0; k < in.columns().size(); ++k)
+        {
+            if(k) text += ',';
+            appendNumber(text, in.column(k)[r]);
+        }
+        text += '\n';
+
+        if(text.size() >= (1 << 20)) writeText(out, text);
+    }
+
+    writeText(out, text);
+}
+
+// ----------------------------
+// Command line entries: "-" is stdin or stdout
+// ----------------------------
+FILE* openOutput(const std::string& path)
+{
+    FILE* out = path == "-" ? stdout : fopen(path.c_str(), "wb");
+    if(!out) throw std::runtime_error("Cannot create " + path + ": " + strerror(errno));
+    return out;
+}
+
+void closeOutput(FILE* out)
+{
+    if((out == stdout ? fflush(out) : fclose(out)) != 0)
+        throw std::runtime_error(std::string("Cannot write output: ") + strerror(errno));
+}
+
+int evaluateColumns(const Calculator& calc, const std::string& formula, const std::string& input, const std::string& output, const std::string& name)
+{
+    try
+    {
+        auto ce = calc.compile(formula);
+        ColumnFile in(input);
+        FILE* out = openOutput(output);
+
+        try { evaluateColumns(ce, in, out, name); }
+        catch (...) { if(out != stdout) fclose(out); throw; }
+        closeOutput(out);
+    }
+    catch (const std::runtime_error& exc) { std::cerr << "Error: " << exc.what() << "\n"; return 1; }
+    return 0;
+}
+
+int convertColumns(bool toCsv, const std::string& input, const std::string& output)
+{
+    try
+    {
+        std::unique_ptr<ColumnFile> columns;
+        FILE* in = stdin;
+        if(toCsv) columns.reset(new ColumnFile(input));
+        else if(input != "-" && !(in = fopen(input.c_str(), "rb")))
+            throw std::runtime_error("Cannot open " + input + ": " + strerror(errno));
+        std::unique_ptr<FILE, int (*)(FILE*)> closer(in == stdin ? nullptr : in, fclose);
+
+        FILE* out = openOutput(output);
+        try
+        {
+            if(toCsv) columnsToCsv(*columns, out);
+            else csvToColumns(in, out);
+        }
+        catch (...) { if(out != stdout) fclose(out); throw; }
+        closeOutput(out);
+    }
+    catch (const std::runtime_error& exc) { std::cerr << "Error: " << exc.what() << "\n"; return 1; }
+    return 0;
+}
+
+// ----------------------------
+// Bounded single-producer single-consumer ring. head is written
+// only by the consumer and tail only by the producer, each on its
+// own cache line, and each side keeps its last view of the other's
+// index, so most pushes and pops touch no shared line. A side that
+// finds the ring full (or empty) waits with backoff()
+// ----------------------------
+template<class T>
+class SpscRing
+{
+    private:
+        std::vector<T> slots;
+        size_t mask;
+
+        alignas(64) std::atomic<size_t> head{0};   // next to pop
+        size_t seenTail = 0;                       // consumer's view of tail
+        alignas(64) std::atomic<size_t> tail{0};   // next to push
+        size_t seenHead = 0;                       // producer's view of head
+        alignas(64) std::atomic<bool> closed{false};
+
+        static size_t roundUp(size_t n)
+        {
+            size_t p = 2;
+            while(p < n) p *= 2;
+            return p;
+        }
+
+    public:
+        explicit SpscRing(size_t capacity) : slots(roundUp(capacity)), mask(slots.size() - 1) {}
+
+        // Producer only; waits while the ring is full
+        void push(T value)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            for(unsigned spins = 0; t - seenHead == slots.size(); backoff(spins++))
+                seenHead = head.load(std::memory_order_acquire);
+
+            slots[t & mask] = std::move(value);
+            tail.store(t + 1, std::memory_order_release);
+        }
+
+        // Consumer only; waits while the ring is empty. False once
+        // the producer has closed it and everything is popped
+        bool pop(T& value)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+            for(unsigned spins = 0; h == seenTail; backoff(spins++))
+            {
+                // closed first: a push before close() is then visible
+                bool done = closed.load(std::memory_order_acquire);
+                seenTail = tail.load(std::memory_order_acquire);
+                if(h != seenTail) break;
+                if(done) return false;
+            }
+
+            value = std::move(slots[h & mask]);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Producer: no more pushes
+        void close() { closed.store(true, std::memory_order_release); }
+};
+
+// ----------------------------
+// Streaming evaluation: one expression per line in, one "OK <value>"
+// or "ERR <message>" line out, as from the server. Reading,
+// compiling, evaluating and formatting each run on a thread of
+// their own and hand batches of lines on through SPSC rings, so
+// throughput is set by the slowest stage, and memory by the ring
+// capacity however long the input is. A batch is at most what one
+// read returned, so a slow feed gets its answers as its lines arrive
+// ----------------------------
+class Pipeline
+{
+    public:
+        struct Stats
+        {
+            size_t lines = 0;
+            double busy[4] = {};   // seconds of work: read, compile, evaluate, format
+        };
+
+        Pipeline(const Calculator& calc, size_t capacity) : calc(calc), capacity(std::max<size_t>(capacity, 2)) {}
+
+        // Until end of input; throws if the output cannot be written
+        Stats run(FILE* in, FILE* out);
+
+    private:
+        struct Line
+        {
+            std::string text;                    // the expression, then the error or exact result
+            Calculator::CompiledExpr compiled;
+            double value = 0;
+            bool failed = false;
+        };
+        using Batch = std::vector<Line>;
+
+        static constexpr size_t readSize = 1 << 16;
+        static constexpr size_t maxBatch = 256;     // lines
+        static constexpr size_t maxLine = 1 << 20;
+
+        const Calculator& calc;
+        size_t capacity;
+
+        void read(FILE* in, SpscRing<Batch>& next, double& busy);
+};
+
+void Pipeline::read(FILE* in, SpscRing<Batch>& next, double& busy)
+{
+    std::vector<char> buf(readSize);
+    std::string partial;
+    bool skipping = false;   // rest of a line over maxLine
+
+    while(true)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        ssize_t n = ::read(fileno(in), buf.data(), buf.size());
+        if(n < 0 && errno == EINTR) continue;
+#else
+        long n = long(fread(buf.data(), 1, buf.size(), in));
+#endif
+        if(n <= 0) break;
+
+        auto start = std::chrono::steady_clock::now();
+        Batch batch;
+        const char* p = buf.data();
+        const char* end = p + n;
+
+        while(const char* nl = static_cast<const char*>(memchr(p, '\n', end - p)))
+        {
+            if(!skipping)
+            {
+                partial.append(p, nl);
+                if(!partial.empty() && partial.back() == '\r') partial.pop_back();
+                batch.push_back({std::move(partial), {}, 0, false});
+                if(batch.size() == maxBatch)
+                {
+                    busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    next.push(std::move(batch));
+                    batch = Batch();
+                    start = std::chrono::steady_clock::now();
+                }
+            }
+            partial.clear();
+            skipping = false;
+            p = nl + 1;
+        }
+
+        if(!skipping) partial.append(p, end);
+        if(partial.size() > maxLine)
+        {
+            batch.push_back({"Line too long.", {}, 0, true});
+            partial.clear();
+            partial.shrink_to_fit();
+            skipping = true;
+        }
+
+        busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(!batch.empty()) next.push(std::move(batch));
+    }
+
+    if(!partial.empty() && !skipping) next.push(Batch{{std::move(partial), {}, 0, false}});
+    next.close();
+}
+
+Pipeline::Stats Pipeline::run(FILE* in, FILE* out)
+{
+    SpscRing<Batch> toCompile(capacity), toEvaluate(capacity), toFormat(capacity);
+    Stats stats;
+    bool exact = calc.getMode() != Calculator::Mode::DOUBLE;
+
+    // One stage: pop, work on every line, pass on
+    auto stage = [](SpscRing<Batch>& from, SpscRing<Batch>* to, double& busy, const std::function<void(Line&)>& work)
+    {
+        Batch batch;
+        while(from.pop(batch))
+        {
+            auto start = std::chrono::steady_clock::now();
+            for(auto &line : batch) work(line);
+            busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if(to) to->push(std::move(batch));
+        }
+        if(to) to->close();
+    };
+
+    std::thread reader([&]() { read(in, toCompile, stats.busy[0]); });
+
+    std::thread compiler(stage, std::ref(toCompile), &toEvaluate, std::ref(stats.busy[1]), [&](Line& line)
+    {
+        if(line.failed) return;
+        try { line.compiled = calc.compile(line.text); }
+        catch (const std::runtime_error& exc) { line.text = exc.what(); line.failed = true; }
+    });
+
+    std::thread evaluator(stage, std::ref(toEvaluate), &toFormat, std::ref(stats.busy[2]), [&](Line& line)
+    {
+        if(line.failed) return;
+        try
+        {
+            if(exact) line.text = line.compiled.evaluateText();
+            else line.value = line.compiled.evaluate();
+        }
+        catch (const std::runtime_error& exc) { line.text = exc.what(); line.failed = true; }
+    });
+
+    // Formatting and writing stay on this thread, a batch at a time.
+    // After a failed write the rest is still drained, so no stage is
+    // left waiting
+    std::string text, error;
+    Batch batch;
+    while(toFormat.pop(batch))
+    {
+        auto start = std::chrono::steady_clock::now();
+        for(const auto &line : batch)
+        {
+            text += line.failed ? "ERR " : "OK ";
+            if(line.failed || exact) text += line.text;
+            else text += formatResult(line.value);
+            text += '\n';
+        }
+        stats.lines += batch.size();
+        stats.busy[3] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if(error.empty())
+        {
+            try
+            {
+                writeText(out, text);
+                if(fflush(out) != 0) throw std::runtime_error(std::string("Cannot write output: ") + strerror(errno));
+            }
+            catch (const std::runtime_error& exc) { error = exc.what(); }
+        }
+        text.clear();
+    }
+
+    reader.join();
+    compiler.join();
+    evaluator.join();
+
+    if(!error.empty()) throw std::runtime_error(error);
+    return stats;
+}
+
+int runPipeline(const Calculator& calc, size_t capacity)
+{
+    try { Pipeline(calc, capacity).run(stdin, stdout); }
+    catch (const std::runtime_error& exc) { std::cerr << "Error: " << exc.what() << "\n"; return 1; }
+    return 0;
+}
+
+// ----------------------------
+// Check a file of formulas, one per line, without evaluating any.
+// all: every problem of every line as "line N, column C: message",
+// blank lines skipped. Otherwise one answer per line through
+// validate(): "OK", or "ERR C message" for the first problem at
+// column C. Exit code 1 when any line has a problem
+// ----------------------------
+int checkFormulas(const Calculator& calc, const std::string& path, bool all)
+{
+    try
+    {
+        FILE* in = path == "-" ? stdin : fopen(path.c_str(), "rb");
+        if(!in) throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+        std::unique_ptr<FILE, int (*)(FILE*)> owned(in == stdin ? nullptr : in, fclose);
+
+        std::string line, text;
+        size_t lineNo = 0, failed = 0;
+        char buf[4096];
+        bool more = true;
+
+        while(more)
+        {
+            line.clear();
+            while((more = fgets(buf, sizeof(buf), in) != nullptr))
+            {
+                line += buf;
+                if(line.back() == '\n') break;
+            }
+            if(!more && line.empty()) break;
+
+            ++lineNo;
+            while(!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+
+            if(!all)
+            {
+                auto v = calc.validate(line);
+                if(v.ok()) text += "OK\n";
+                else text += "ERR " + std::to_string(v.pos + 1) + " " + Calculator::describe(v, line) + "\n";
+                failed += !v.ok();
+            }
+            else if(line.find_first_not_of(" \t") != std::string::npos)
+            {
+                auto problems = calc.diagnose(line);
+                failed += !problems.empty();
+                for(const auto &d : problems)
+                    text += "line " + std::to_string(lineNo) + ", column " + std::to_string(d.pos + 1) + ": " + d.message + "\n";
+            }
+
+            if(text.size() >= (1 << 16)) writeText(stdout, text);
+        }
+
+        if(ferror(in)) throw std::runtime_error("Cannot read " + path + ": " + strerror(errno));
+        writeText(stdout, text);
+        fflush(stdout);
+        return failed ? 1 : 0;
+    }
+    catch (const std::runtime_error& exc) { std::cerr << "Error: " << exc.what() << "\n"; return 1; }
+}
+
+struct Application
+{
+    Calculator calc;
+    std::vector<std::pair<std::string, Calculator::IncrementalExpr>> watches;   // re-evaluated by 'let'
+
+    void run()
+    {
+        greet();
+
+        while(true)
+        {
+            std::cout << "\nEnter your expression: ";
+            calc.inputExpr();
+
+            if(calc.getExpr() == "exit")
+            {
+                std::cout << "Program finished with exit code 0.\n\n";
+                break;
+            }
+
+            if(calc.getExpr() == "help")
+            {
+                std::cout << "\nEnter any mathematical expression using numbers and any of the following operations: (), %, ^, *, /, +, -.";
+                std::cout << "\nFunctions: sqrt, exp, log, sin, cos, abs, min(a, b), max(a, b). Type 'let x = 2' to define a variable.";
+                std::cout << "\nComparisons (<, >, <=, >=, ==, !=) give 1 or 0; 'a && b', 'a || b' and 'c ? x : y' skip the unused side.";
+                std::cout << "\nAggregations: sum(i, 1, 100, 1/i^2), and product, min, max of the same form, run as one loop.";
+                std::cout << "\nType 'def f(a, b) = a * b + 1' to define a function; calls are inlined when compiled.";
+                std::cout << "\nType 'watch <expression>' to keep it up to date: each 'let' recomputes only the parts that use the variable.";
+                std::cout << "\nType 'grad <expression>' for its value and derivative with respect to every variable.";
+                std::cout << "\nType 'd/dx <expression>' for the derivative as a formula, then its value.";
+                std::cout << "\nType 'check <expression>' to list every problem in it at once, each marked under the text.";
+                std::cout << "\nType 'mode decimal' for exact decimal arithmetic, 'mode rational' for exact fractions, 'mode double' to switch back.";
+                std::cout << "\n'mode interval' gives guaranteed bounds; write uncertain inputs as [lo, hi].";
+                std::cout << "\nIn decimal mode 'precision N' sets significant digits and 'rounding half_even|half_up|half_down|down|up|ceiling|floor' the rounding.";
+                std::cout << "\nType 'exit' to close program.\n";
                 continue;
             }
 
-            try
+            try
+            {
+                if(command(calc.getExpr())) continue;
+
+                calc.evaluateExpr();
+                calc.displayResult();
+            }
+            catch (const std::runtime_error& exc) { std::cerr << "Error: " << exc.what() << "\n"; }
+        }
+    }
+
+    // ----------------------------
+    // Settings commands: mode, precision, rounding, let, def, watch, grad, d/dx, check
+    // Returns false when the line is an expression
+    // ----------------------------
+    bool command(const std::string& line)
+    {
+        size_t space = line.find(' ');
+        std::string name = line.substr(0, space);
+        std::string arg = space == std::string::npos ? "" : line.substr(space + 1);
+
+        if(name == "let")
+        {
+            size_t eq = arg.find('=');
+            if(eq == std::string::npos)
+                throw std::runtime_error("Expected: let <name> = <expression>");
+
+            std::string var = arg.substr(0, eq);
+            var.erase(var.find_last_not_of(' ') + 1);
+            var.erase(0, var.find_first_not_of(' '));
+
+            if(var.empty() || !(isalpha(var[0]) || var[0] == '_') ||
+               !std::all_of(var.begin(), var.end(), [](char ch) { return isalnum(ch) || ch == '_'; }))
+                throw std::runtime_error("Invalid variable name: " + var);
+
+            double value = calc.evaluate(std::string_view(arg).substr(eq + 1));
+            calc.setVariable(var, value);
+            std::cout << var << " = " << value << "\n";
+
+            // Watched expressions recompute only what depends on var
+            for(auto &[src, ie] : watches)
+            {
+                const auto &used = ie.variables();
+                if(std::find(used.begin(), used.end(), var) == used.end()) continue;
+
+                try
+                {
+                    double r = ie.set(var, value);
+                    std::cout << "  " << src << " = " << formatResult(r) << " (" << ie.lastRecomputed() << " of " << ie.nodeCount() << " nodes recomputed)\n";
+                }
+                catch (const std::runtime_error& exc) { std::cout << "  " << src << ": " << exc.what() << "\n"; }
+            }
+            return true;
+        }
+
+        if(name == "grad")
+        {
+            auto ce = calc.compile(arg);
+            std::vector<double> grad(ce.variables().size());
+            double value = ce.gradient(grad.data());
+
+            std::cout << arg << " = " << formatResult(value) << "\n";
+            for(size_t k = 0; k < grad.size(); ++k)
+                std::cout << "  d/d" << ce.variables()[k] << " = " << formatResult(grad[k]) << "\n";
+            return true;
+        }
+
+        if(name.rfind("d/d", 0) == 0 && name.size() > 3)
+        {
+            std::string var = name.substr(3);
+            std::string text = calc.derivative(arg, var);
+            std::cout << name << " " << arg << " = " << text << "\n";
+
+            std::cout << "  = " << calc.compile(text).evaluateText() << "\n";
+            return true;
+        }
+
+        if(name == "check")
+        {
+            auto problems = calc.diagnose(arg);
+            if(problems.empty()) std::cout << "No problems found.\n";
+            else std::cout << arg << "\n";
+
+            for(const auto &d : problems)
+                std::cout << std::string(d.pos, ' ') << std::string(std::max<size_t>(d.len, 1), '^') << " " << d.message << "\n";
+            return true;
+        }
+
+        if(name == "watch")
+        {
+            watches.emplace_back(arg, calc.compileIncremental(arg));
+            std::cout << "Watching " << arg << "\n";
+
+            double r = watches.back().second.value();
+            std::cout << "  " << arg << " = " << formatResult(r) << "\n";
+            return true;
+        }
+
+        if(name == "def")
+        {
+            calc.define(arg);
+            std::cout << "Defined " << arg.substr(0, arg.find('=')) << "\n";
+            return true;
+        }
+
+        if(name == "mode")
+        {
+            if(arg == "double") calc.setMode(Calculator::Mode::DOUBLE);
+            else if(arg == "decimal") calc.setMode(Calculator::Mode::DECIMAL);
+            else if(arg == "rational") calc.setMode(Calculator::Mode::RATIONAL);
+            else if(arg == "interval") calc.setMode(Calculator::Mode::INTERVAL);
+            else throw std::runtime_error("Unknown mode: " + arg);
+
+            std::cout << "Mode: " << arg << "\n";
+            return true;
+        }
+
+        if(name == "precision")
+        {
+            int digits = std::atoi(arg.c_str());
+            if(digits < 1)
+                throw std::runtime_error("Precision must be a positive number of digits.");
+
+            calc.decimalContext().precision = digits;
+            std::cout << "Precision: " << digits << " significant digits\n";
+            return true;
+        }
+
+        if(name == "rounding")
+        {
+            static const std::pair<const char*, Rounding> names[] =
+            {
+                {"half_even", Rounding::HALF_EVEN}, {"half_up", Rounding::HALF_UP}, {"half_down", Rounding::HALF_DOWN},
+                {"down", Rounding::DOWN}, {"up", Rounding::UP}, {"ceiling", Rounding::CEILING}, {"floor", Rounding::FLOOR},
+            };
+
+            for(const auto &n : names)
+            {
+                if(arg == n.first)
+                {
+                    calc.decimalContext().rounding = n.second;
+                    std::cout << "Rounding: " << arg << "\n";
+                    return true;
+                }
+            }
+            throw std::runtime_error("Unknown rounding: " + arg);
+        }
+
+        return false;
+    }
+
+    void greet()
+    {
+        std::cout << "\n------ Welcome to Calculator 2.0 ------\n";
+        std::cout << "Available operations (PEMDAS): (), %, ^, *, /, +, -. Negative numbers supported!\n";
+        std::cout << "Type 'exit' to close program. Type 'help' for hints.\n";
+    }
+
+    // ----------------------------
+    // Hammer one shared compiled expression and one shared
+    // const Calculator from many threads (build with -fsanitize=thread).
+    // The expression keeps its variables, an aggregate and calls after
+    // folding; x and y come through evaluate(values), each thread
+    // walking the input table from its own offset, and every result
+    // is checked against one computed before the threads start
+    // ----------------------------
+    int stress(unsigned threads, unsigned iterations)
+    {
+        const std::string src = "sum(i, 1, 8, x^i / i) + max(y, sqrt(x * y)) * exp(-y) - 3^2^3";
+        const Calculator shared;
+        const Calculator::CompiledExpr compiled = shared.compile(src);
+
+        const auto &names = compiled.variables();
+        if(names.size() != 2)
+            throw std::runtime_error("Stress expression must keep its two variables.");
+
+        constexpr size_t inputs = 64;
+        std::vector<std::vector<double>> values(inputs, std::vector<double>(2));
+        std::vector<double> expected(inputs);
+        for(size_t k = 0; k < inputs; ++k)
+        {
+            double x = 0.1 + 0.8 * k / inputs, y = 1 + 3.0 * ((k * 7) % inputs) / inputs;
+            values[k][0] = names[0] == "x" ? x : y;
+            values[k][1] = names[0] == "x" ? y : x;
+            expected[k] = compiled.evaluate(values[k].data());
+        }
+
+        std::atomic<unsigned long> mismatches{0};
+        std::vector<std::thread> workers;
+        auto start = std::chrono::steady_clock::now();
+
+        for(unsigned t = 0; t < threads; ++t)
+        {
+            workers.emplace_back([&, t]()
+            {
+                for(unsigned i = 0; i < iterations; ++i)
+                {
+                    size_t k = (t * 13 + i) % inputs;
+                    if(compiled.evaluate(values[k].data()) != expected[k]) ++mismatches;
+                    if(i % 16 == 0 && shared.compile(src).evaluate(values[k].data()) != expected[k]) ++mismatches;
+                }
+            });
+        }
+
+        for(auto &w : workers) w.join();
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Stress: " << threads << " threads x " << iterations << " evaluations of " << src
+                  << " over " << inputs << " inputs in " << elapsed.count() << "s, mismatches: " << mismatches << "\n";
+
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    // ----------------------------
+    // Random formulas through validate() and through compile() and
+    // evaluate(): both must accept or both reject. Errors only
+    // evaluation can find (division by zero, an empty range) count
+    // as accepted; those reading "Invalid expression" do not. Half
+    // the formulas are well formed, half have a piece inserted or
+    // removed
+    // ----------------------------
+    int fuzzValidate(unsigned iterations, uint64_t seed)
+    {
+        auto next = [&]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return seed; };
+
+        const char* atoms[] = {"x", "y", "2", "0.5", "1.25", "i"};
+        const char* ops[] = {" + ", " - ", "*", "/", "^", " < ", " <= ", " == ", " != ", " && ", " || "};
+        const char* calls[] = {"sqrt(", "abs(", "exp(", "max(", "sum(i, 1, 3, ", "min(i, 1, 3, "};
+        const char* pieces[] = {"+", "-", "*", "^", "%", "<", "==", "&&", "?", ":", "(", ")", ",", "x", "2", "i", "sqrt("};
+
+        std::function<void(std::string&, int)> formula = [&](std::string& s, int depth)
+        {
+            switch(depth > 3 ? 0 : next() % 8)
+            {
+                case 0: case 1: s += atoms[next() % 6]; break;
+                case 2: formula(s, depth + 1); s += ops[next() % 11]; formula(s, depth + 1); break;
+                case 3: s += "("; formula(s, depth + 1); s += " ? "; formula(s, depth + 1); s += " : "; formula(s, depth + 1); s += ")"; break;
+                case 4:
+                {
+                    size_t k = next() % 6;
+                    s += calls[k];
+                    formula(s, depth + 1);
+                    if(k == 3) { s += ", "; formula(s, depth + 1); }
+                    s += ")";
+                    break;
+                }
+                case 5: s += "-"; formula(s, depth + 1); break;
+                case 6: formula(s, depth + 1); s += "%"; break;
+                default: s += "("; formula(s, depth + 1); s += ")"; break;
+            }
+        };
+
+        Calculator c;
+        std::vector<double> zeros(8);
+        unsigned mismatches = 0, accepted = 0;
+        std::string s;
+
+        for(unsigned n = 0; n < iterations; ++n)
+        {
+            s.clear();
+            formula(s, 0);
+            if(next() % 2)
+                for(int edits = 1 + next() % 2; edits > 0; --edits)
+                {
+                    size_t at = next() % (s.size() + 1);
+                    if(next() % 2 && at < s.size()) s.erase(at, 1);
+                    else s.insert(at, pieces[next() % 17]);
+                }
+
+            bool valid = c.validate(s).ok(), compiled = true;
+            std::string error;
+            try
+            {
+                auto ce = c.compile(s);
+                zeros.resize(std::max(zeros.size(), ce.variables().size()));
+                try { ce.evaluate(zeros.data()); }
+                catch (const std::runtime_error& exc) { if(std::string(exc.what()).rfind("Invalid expression", 0) == 0) throw; }
+            }
+            catch (const std::runtime_error& exc)
+            {
+                compiled = false;
+                error = exc.what();
+            }
+
+            accepted += valid && compiled;
+            if(valid != compiled && ++mismatches <= 5)
+            {
+                Calculator::Validation v = c.validate(s);
+                std::cout << "Mismatch on \"" << s << "\": validate() " << (valid ? "accepts" : "says \"" + Calculator::describe(v, s) + "\"")
+                          << ", compile " << (compiled ? "accepts" : "says \"" + error + "\"") << "\n";
+            }
+        }
+
+        std::cout << "Validate fuzz: " << iterations << " formulas, " << accepted << " accepted by both, mismatches: " << mismatches << "\n";
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    // ----------------------------
+    // Random inputs through tokenize() with and without the SSE2 runs:
+    // the same tokens, or the same error, every time. Inputs are built
+    // from runs long enough to cross 16-byte blocks, of every class
+    // the lexer tells apart, plus arbitrary bytes
+    // ----------------------------
+    int fuzzLexer(unsigned iterations, uint64_t seed)
+    {
+        auto next = [&]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return seed; };
+        auto pick = [&](const char* from) { return from[next() % strlen(from)]; };
+
+        // Interval mode, so the bracketed literals among the pieces lex
+        Calculator lexer;
+        lexer.setMode(Calculator::Mode::INTERVAL);
+
+        auto tokensOf = [&](const std::string& s, bool simd, std::string& error)
+        {
+            try { return lexer.tokenize(s, simd); }
+            catch (const std::exception& exc) { error = exc.what(); }
+            return std::vector<Calculator::Token>();
+        };
+
+        auto same = [](const Calculator::Token& a, const Calculator::Token& b)
+        {
+            return a.type == b.type && memcmp(&a.value, &b.value, sizeof(double)) == 0 && a.op == b.op &&
+                   a.pos == b.pos && a.len == b.len && a.index == b.index;
+        };
+
+        unsigned mismatches = 0;
+        size_t bytes = 0, tokens = 0;
+        std::string s;
+
+        for(unsigned n = 0; n < iterations; ++n)
+        {
+            s.clear();
+            for(unsigned pieces = 1 + next() % 40; pieces > 0; --pieces)
+            {
+                size_t run = next() % 8 == 0 ? 1 + next() % 40 : 1 + next() % 3;
+                switch(next() % 16)
+                {
+                    case 0: case 1: case 2: while(run--) s += pick(" \t\n\v\f\r "); break;
+                    case 3: case 4: while(run--) s += next() % 24 ? pick("0123456789") : '.'; break;
+                    case 5: case 6: while(run--) s += pick("abcxyzXYZ_019"); break;
+                    case 7: case 8: case 9: s += pick("+-*/^%?:<>,)"); break;
+                    case 10: s += pick("<>=!"); s += '='; break;
+                    case 11: s += next() % 2 ? "&&" : "||"; break;
+                    case 12: s += next() % 2 ? " sqrt" : " sum"; while(run--) s += ' '; s += "(i, 1, 2, i)"; break;
+                    case 13: s += " [1.5, 2.5]"; if(next() % 8 == 0) s.resize(s.size() - next() % 4); break;
+                    case 14: s += " ("; break;
+
+                    // Lexical errors: a stray byte, a lone = ! & |, a second '.'
+                    default: if(next() % 4 == 0) s += next() % 4 ? pick("=!&|.$") : char(next()); break;
+                }
+            }
+
+            std::string errorSimd, errorScalar;
+            auto a = tokensOf(s, true, errorSimd), b = tokensOf(s, false, errorScalar);
+            bool ok = errorSimd == errorScalar && a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), same);
+
+            bytes += s.size();
+            tokens += a.size();
+            if(!ok && ++mismatches <= 5)
+                std::cout << "Mismatch on \"" << s << "\": " << a.size() << " vs " << b.size() << " tokens, errors \""
+                          << errorSimd << "\" vs \"" << errorScalar << "\"\n";
+        }
+
+        std::cout << "Lexer fuzz: " << iterations << " inputs, " << bytes << " bytes, " << tokens << " tokens, "
+#ifdef __SSE2__
+                  << "SSE2 against scalar"
+#else
+                  << "no SSE2 in this build, scalar against itself"
+#endif
+                  << ", mismatches: " << mismatches << "\n";
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    // ----------------------------
+    // Decimal mode against the double path on the same compiled expressions
+    // ----------------------------
+    int bench()
+    {
+        benchModes();
+        benchFunctions();
+        benchProgram();
+        benchGradient();
+        benchAggregate();
+        benchCsv();
+        benchPipeline();
+        benchQueue();
+        benchDiagnose();
+        benchValidate();
+        benchLexer();
+#if defined(__cpp_impl_coroutine)
+        benchAsync();
+#endif
+        return 0;
+    }
+
+    void benchModes()
+    {
+        const char* exprs[] =
+        {
+            "0.1 + 0.2",
+            "19.99 * 3 + 4.50 - 10%",
+            "(1234.5678 / 3) * 1.0825",
+            "1.0001^365",
+            "-3 + 5 - (8^2 + 2)",
+        };
+
+        const unsigned iterations = 200000;
+        Calculator c, exact;
+        exact.setMode(Calculator::Mode::DECIMAL);   // compiled without double constant folding
+
+        auto time = [&](auto&& fn)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for(unsigned i = 0; i < iterations; ++i) fn();
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count() / iterations;
+        };
+
+        std::cout << "Expression                         double ns   decimal(28) ns   decimal(60) ns   rational ns   interval ns   decimal result\n";
+
+        for(const char* src : exprs)
+        {
+            auto ce = c.compile(src);
+            auto exactCe = exact.compile(src);
+            const auto &code = exactCe.code();
+            DecimalContext narrow, wide;
+            wide.precision = 60;
+
+            double sink = 0;
+            double tDouble = time([&]() { sink += ce.evaluate(); });
+            double tNarrow = time([&]() { sink += Calculator::evaluatePostfixAs(code, src, DecimalArith(narrow)).exp; });
+            double tWide = time([&]() { sink += Calculator::evaluatePostfixAs(code, src, DecimalArith(wide)).exp; });
+            double tRational = time([&]() { sink += Calculator::evaluatePostfixAs(code, src, RationalArith()).den.sign(); });
+            double tInterval = time([&]() { sink += Calculator::evaluatePostfixAs(code, src, IntervalArith()).hi; });
+
+            std::string text = DecimalArith::format(Calculator::evaluatePostfixAs(code, src, DecimalArith(narrow)));
+
+            printf("%-34s %9.1f   %14.1f   %14.1f   %11.1f   %11.1f   %s%s\n", src, tDouble, tNarrow, tWide, tRational, tInterval, text.c_str(), sink == 0.5 ? " " : "");
+        }
+    }
+
+    // ----------------------------
+    // Batch kernels: accuracy against libm, then a function-heavy
+    // formula per row versus in batch
+    // ----------------------------
+    void benchFunctions()
+    {
+        auto ulps = [](double a, double b)
+        {
+            if(a == b || (a != a && b != b)) return 0.0;
+            int64_t ia, ib;
+            memcpy(&ia, &a, 8);
+            memcpy(&ib, &b, 8);
+            if(ia < 0) ia = std::numeric_limits<int64_t>::min() - ia;
+            if(ib < 0) ib = std::numeric_limits<int64_t>::min() - ib;
+            return double(ia > ib ? uint64_t(ia) - uint64_t(ib) : uint64_t(ib) - uint64_t(ia));
+        };
+
+        struct Domain { const char* fn; double lo, hi; bool logScale; };
+        const Domain domains[] =
+        {
+            {"exp", -740, 709, false}, {"exp", 709, 709.782712893384, false}, {"exp", -745.1332191019412, -740, false},
+            {"log", -300, 300, true}, {"sin", -10, 10, false},
+            {"sin", -1e5, 1e5, false}, {"cos", -10, 10, false}, {"cos", -1e5, 1e5, false}, {"sqrt", 0, 1e10, false},
+        };
+
+        const size_t samples = 1 << 20;
+        std::vector<double> in(samples), out(samples);
+        uint64_t seed = 88172645463325252ULL;
+        auto uniform = [&]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return (seed >> 11) * (1.0 / 9007199254740992.0); };
+
+        std::cout << "\nFunction   domain                  max ulp vs libm   batch ns/value   scalar ns/value\n";
+
+        for(const auto &d : domains)
+        {
+            const auto &fn = builtinFunctions()[findBuiltin(d.fn)];
+            for(auto &x : in) x = d.logScale ? std::pow(10.0, d.lo + (d.hi - d.lo) * uniform()) : d.lo + (d.hi - d.lo) * uniform();
+
+            const double* args[1] = {in.data()};
+            auto start = std::chrono::steady_clock::now();
+            fn.batch(args, out.data(), samples);
+            std::chrono::duration<double, std::nano> tBatch = std::chrono::steady_clock::now() - start;
+
+            double worst = 0, sink = 0;
+            start = std::chrono::steady_clock::now();
+            for(size_t i = 0; i < samples; ++i) sink += fn.scalar(&in[i]);
+            std::chrono::duration<double, std::nano> tScalar = std::chrono::steady_clock::now() - start;
+
+            for(size_t i = 0; i < samples; ++i) worst = std::max(worst, ulps(out[i], fn.scalar(&in[i])));
+
+            char range[32];
+            snprintf(range, sizeof(range), d.logScale ? "[1e%g, 1e%g]" : "[%g, %g]", d.lo, d.hi);
+            printf("%-10s %-23s %15.0f   %14.2f   %15.2f%s\n", d.fn, range, worst, tBatch.count() / samples, tScalar.count() / samples, sink == 0.5 ? " " : "");
+        }
+
+        const char* src = "sqrt(x^2 + y^2) + exp(-x) * sin(y) + log(1 + abs(x)) + max(cos(x), 0.5)";
+        Calculator c;
+        auto ce = c.compile(src);
+
+        const size_t rows = 1 << 20;
+        std::vector<double> xs(rows), ys(rows), perRow(rows), batch(rows);
+        for(size_t i = 0; i < rows; ++i) { xs[i] = -5 + 10 * uniform(); ys[i] = -50 + 100 * uniform(); }
+
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < rows; ++i)
+        {
+            double values[2] = {xs[i], ys[i]};
+            perRow[i] = ce.evaluate(values);
+        }
+        std::chrono::duration<double, std::nano> tRow = std::chrono::steady_clock::now() - start;
+
+        const double* columns[2] = {xs.data(), ys.data()};
+        start = std::chrono::steady_clock::now();
+        ce.evaluateBatch(columns, rows, batch.data());
+        std::chrono::duration<double, std::nano> tBatch = std::chrono::steady_clock::now() - start;
+
+        double diff = 0;
+        for(size_t i = 0; i < rows; ++i) diff = std::max(diff, std::fabs(perRow[i] - batch[i]) / std::max(1.0, std::fabs(perRow[i])));
+
+        std::cout << "\n" << src << "\n";
+        printf("per row: %.1f ns/row, batch: %.1f ns/row, max relative difference %.3g\n", tRow.count() / rows, tBatch.count() / rows, diff);
+    }
+
+    // ----------------------------
+    // A group of related formulas on the same row: each compiled
+    // on its own versus one program sharing their subexpressions
+    // ----------------------------
+    void benchProgram()
+    {
+        std::vector<std::string> sources;
+        for(int k = 1; k <= 100; ++k)
+        {
+            std::string n = std::to_string(k);
+            sources.push_back("sqrt(x^2 + y^2) * " + n + " + exp(-z) * (x + y) - sin(x * y) / (" + n + " + abs(z))");
+        }
+
+        Calculator c;
+        std::vector<Calculator::CompiledExpr> separate;
+        for(const auto &src : sources) separate.push_back(c.compile(src));
+        auto prog = c.compileProgram(sources);
+
+        const size_t rows = 20000;
+        uint64_t seed = 88172645463325252ULL;
+        auto uniform = [&]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return (seed >> 11) * (1.0 / 9007199254740992.0); };
+
+        std::vector<double> xs(rows), ys(rows), zs(rows);
+        for(size_t i = 0; i < rows; ++i) { xs[i] = -5 + 10 * uniform(); ys[i] = -5 + 10 * uniform(); zs[i] = -5 + 10 * uniform(); }
+
+        std::vector<double> a(sources.size() * rows), b(a.size()), batch(a.size());
+
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < rows; ++i)
+        {
+            double values[3] = {xs[i], ys[i], zs[i]};
+            for(size_t k = 0; k < separate.size(); ++k) a[i * sources.size() + k] = separate[k].evaluate(values);
+        }
+        std::chrono::duration<double, std::nano> tSeparate = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < rows; ++i)
+        {
+            double values[3] = {xs[i], ys[i], zs[i]};
+            prog.evaluate(&b[i * sources.size()], values);
+        }
+        std::chrono::duration<double, std::nano> tProgram = std::chrono::steady_clock::now() - start;
+
+        const double* columns[3] = {xs.data(), ys.data(), zs.data()};
+        std::vector<double*> outs;
+        for(size_t k = 0; k < sources.size(); ++k) outs.push_back(&batch[k * rows]);
+
+        start = std::chrono::steady_clock::now();
+        prog.evaluateBatch(columns, rows, outs.data());
+        std::chrono::duration<double, std::nano> tBatch = std::chrono::steady_clock::now() - start;
+
+        double diff = 0;
+        for(size_t i = 0; i < rows; ++i)
+            for(size_t k = 0; k < sources.size(); ++k)
+            {
+                double ref = a[i * sources.size() + k];
+                diff = std::max({diff, std::fabs(ref - b[i * sources.size() + k]), std::fabs(ref - batch[k * rows + i]) / std::max(1.0, std::fabs(ref))});
+            }
+
+        std::cout << "\n" << sources.size() << " formulas like " << sources[0] << "\n";
+        printf("separate: %.1f ns/row, program: %.1f ns/row, program batch: %.1f ns/row, %zu operations shared, max difference %.3g\n",
+               tSeparate.count() / rows, tProgram.count() / rows, tBatch.count() / rows, prog.eliminatedOps(), diff);
+    }
+
+    // ----------------------------
+    // Full gradient of a formula in many variables: central finite
+    // differences (2N evaluations), forward mode and reverse mode
+    // ----------------------------
+    void benchGradient()
+    {
+        const int n = 200;
+        std::string src;
+        for(int i = 0; i < n; ++i)
+        {
+            std::string x = "x" + std::to_string(i), next = "x" + std::to_string((i + 1) % n);
+            src += (i ? " + " : "") + ("sin(" + x + ") * " + next + " + sqrt(1 + " + x + " * " + x + ")");
+        }
+
+        Calculator c;
+        auto ce = c.compile(src);
+        size_t vars = ce.variables().size();
+
+        uint64_t seed = 88172645463325252ULL;
+        auto uniform = [&]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return (seed >> 11) * (1.0 / 9007199254740992.0); };
+
+        std::vector<double> x(vars), fd(vars), fwd(vars), rev(vars);
+        for(auto &v : x) v = -2 + 4 * uniform();
+
+        auto time = [](unsigned iterations, auto&& fn)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for(unsigned i = 0; i < iterations; ++i) fn();
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count() / iterations;
+        };
+
+        double tFd = time(20, [&]()
+        {
+            std::vector<double> p = x;
+            for(size_t k = 0; k < vars; ++k)
             {
-                calc.evaluateExpr();
-                calc.displayResult();
+                double h = 1e-6 * std::max(1.0, std::fabs(x[k]));
+                p[k] = x[k] + h;
+                double up = ce.evaluate(p.data());
+                p[k] = x[k] - h;
+                double down = ce.evaluate(p.data());
+                p[k] = x[k];
+                fd[k] = (up - down) / (2 * h);
             }
-            catch (const std::runtime_error& exc) { std::cerr << "Error: " << exc.what() << "\n"; }
+        });
+        double tFwd = time(20, [&]() { ce.gradient(fwd.data(), x.data()); });
+        double tRev = time(2000, [&]() { ce.reverseGradient(rev.data(), x.data()); });
+        double tEval = time(2000, [&]() { ce.evaluate(x.data()); });
+
+        double dFd = 0, dFwd = 0;
+        for(size_t k = 0; k < vars; ++k)
+        {
+            dFd = std::max(dFd, std::fabs(fd[k] - rev[k]));
+            dFwd = std::max(dFwd, std::fabs(fwd[k] - rev[k]));
         }
+
+        std::cout << "\nGradient of a formula in " << vars << " variables (" << ce.code().size() << " tokens)\n";
+        printf("one evaluation: %.1f us, finite differences: %.1f us, forward mode: %.1f us, reverse mode: %.1f us\n", tEval, tFd, tFwd, tRev);
+        printf("max difference from reverse mode: finite differences %.3g, forward mode %.3g\n", dFd, dFwd);
     }
 
-    void greet()
+    // ----------------------------
+    // sum(i, 1, n, 1/i^2) as one compiled loop against one expression
+    // per term, and compensated against naive summation
+    // ----------------------------
+    void benchAggregate()
     {
-        std::cout << "\n------ Welcome to Calculator 2.0 ------\n";
-        std::cout << "Available operations (PEMDAS): (), %, ^, *, /, +, -. Negative numbers supported!\n";
-        std::cout << "Type 'exit' to close program. Type 'help' for hints.\n";
+        const int terms = 1000000, separate = 100000;
+        Calculator c;
+
+        auto start = std::chrono::steady_clock::now();
+        double sink = 0;
+        for(int i = 1; i <= separate; ++i) sink += c.evaluate("1/" + std::to_string(i) + "^2");
+        std::chrono::duration<double, std::nano> tSeparate = std::chrono::steady_clock::now() - start;
+
+        auto ce = c.compile("sum(i, 1, " + std::to_string(terms) + ", 1/i^2)");
+        start = std::chrono::steady_clock::now();
+        double sum = ce.evaluate();
+        std::chrono::duration<double, std::nano> tLoop = std::chrono::steady_clock::now() - start;
+
+        // Reference: smallest terms first, which loses almost nothing
+        double reference = 0, plain = 0;
+        for(int i = terms; i >= 1; --i) reference += 1 / (double(i) * i);
+        for(int i = 1; i <= terms; ++i) plain += 1 / (double(i) * i);
+
+        std::cout << "\nsum(i, 1, " << terms << ", 1/i^2)\n";
+        printf("one expression per term: %.1f ns/term, compiled loop: %.2f ns/term (%u threads)%s\n",
+               tSeparate.count() / separate, tLoop.count() / terms, std::max(1u, std::thread::hardware_concurrency()), sink == 0.5 ? " " : "");
+        printf("error against smallest-first: compensated %.3g, naive in order %.3g\n", std::fabs(sum - reference), std::fabs(plain - reference));
+
+        double tenth = c.evaluate("sum(i, 1, 10000000, 0.1)"), plainTenth = 0;
+        for(int i = 0; i < 10000000; ++i) plainTenth += 0.1;
+        printf("sum(i, 1, 10000000, 0.1): compensated %.17g, naive %.17g\n", tenth, plainTenth);
+    }
+
+    // ----------------------------
+    // CSV mode: the float parser against strtod, then a formula over
+    // a generated file against splicing each row into the text
+    // ----------------------------
+    void benchCsv()
+    {
+        const size_t values = 1 << 20;
+        uint64_t seed = 88172645463325252ULL;
+        auto next = [&]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return seed; };
+
+        std::string text;
+        std::vector<size_t> starts;
+        const char* formats[] = {"%.2f", "%.6f", "%.17g", "%g", "%.3e"};
+        for(size_t i = 0; i < values; ++i)
+        {
+            char buf[40];
+            double v = (next() >> 11) * (1.0 / 9007199254740992.0) * std::pow(10.0, double(next() % 20) - 10);
+            starts.push_back(text.size());
+            text.append(buf, snprintf(buf, sizeof(buf), formats[i % 5], i % 3 ? v : -v));
+            text += '\0';
+        }
+        starts.push_back(text.size());
+
+        size_t mismatches = 0;
+        double sink = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < values; ++i)
+        {
+            double v;
+            parseDouble(text.data() + starts[i], text.data() + starts[i + 1] - 1, v);
+            sink += v;
+        }
+        std::chrono::duration<double, std::nano> tFast = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < values; ++i) sink += strtod(text.data() + starts[i], nullptr);
+        std::chrono::duration<double, std::nano> tStrtod = std::chrono::steady_clock::now() - start;
+
+        for(size_t i = 0; i < values; ++i)
+        {
+            double v;
+            parseDouble(text.data() + starts[i], text.data() + starts[i + 1] - 1, v);
+            double ref = strtod(text.data() + starts[i], nullptr);
+            if(memcmp(&v, &ref, sizeof(v)) != 0) ++mismatches;
+        }
+
+        printf("\nParse: %.1f ns/value, strtod %.1f ns/value, %zu of %zu differ%s\n",
+               tFast.count() / values, tStrtod.count() / values, mismatches, values, sink == 0.5 ? " " : "");
+
+        const size_t rows = 1000000, spliced = 100000;
+        FILE* in = tmpfile();
+        FILE* out = tmpfile();
+        if(!in || !out) return;
+
+        std::string csv = "id,x,y,z\n";
+        for(size_t i = 0; i < rows; ++i)
+        {
+            char buf[96];
+            csv.append(buf, snprintf(buf, sizeof(buf), "%zu,%.6f,%.3f,%.4f\n", i, (next() % 2000000) / 1e5 - 10, (next() % 100000) / 1e3, (next() % 1000000) / 7.0));
+        }
+        fwrite(csv.data(), 1, csv.size(), in);
+        rewind(in);
+
+        const std::string formula = "x * y + sqrt(z)";
+        Calculator c;
+        auto ce = c.compile(formula);
+
+        start = std::chrono::steady_clock::now();
+        evaluateCsv(ce, in, out, "r");
+        fflush(out);
+        std::chrono::duration<double, std::nano> tCsv = std::chrono::steady_clock::now() - start;
+
+        // What the per-row script does: put the values into the text, evaluate that
+        CsvReader reader((rewind(in), in));
+        std::vector<double> data(3 * 4096);
+        double* cols[3] = {&data[0], &data[4096], &data[8192]};
+        start = std::chrono::steady_clock::now();
+        for(size_t done = 0; done < spliced;)
+        {
+            size_t n = reader.read(std::min<size_t>(4096, spliced - done), {1, 2, 3}, cols);
+            for(size_t r = 0; r < n; ++r)
+            {
+                std::string_view line = reader.line(r);
+                size_t a = line.find(',') + 1, b = line.find(',', a) + 1, d = line.find(',', b) + 1;
+                std::string row = "(" + std::string(line.substr(a, b - a - 1)) + ") * (" + std::string(line.substr(b, d - b - 1)) +
+                                  ") + sqrt(" + std::string(line.substr(d)) + ")";
+                sink += c.evaluate(row);
+            }
+            done += n;
+        }
+        std::chrono::duration<double, std::nano> tSpliced = std::chrono::steady_clock::now() - start;
+
+        printf("CSV %s over %zu rows: %.1f ns/row (%.0f MB/s in), spliced into the text per row: %.1f ns/row%s\n",
+               formula.c_str(), rows, tCsv.count() / rows, csv.size() / (tCsv.count() / 1e3), tSpliced.count() / spliced, sink == 0.5 ? " " : "");
+
+        // The same rows as a column file: loaded, evaluated, written back
+        FILE* binary = tmpfile();
+        if(!binary) return;
+        rewind(in);
+        csvToColumns(in, binary);
+        rewind(binary);
+        rewind(out);
+
+        start = std::chrono::steady_clock::now();
+        ColumnFile columns(binary);
+        auto loaded = std::chrono::steady_clock::now();
+        evaluateColumns(ce, columns, out, "r");
+        fflush(out);
+        std::chrono::duration<double, std::nano> tLoad = loaded - start, tBinary = std::chrono::steady_clock::now() - start;
+
+        printf("Column file: %.1f ns/row, of which %.1f reading it in; %.1fx faster than CSV\n",
+               tBinary.count() / rows, tLoad.count() / rows, tCsv.count() / tBinary.count());
+
+        fclose(binary);
+        fclose(in);
+        fclose(out);
+    }
+
+    // ----------------------------
+    // Pipelined stream against the same lines done one after another
+    // ----------------------------
+    void benchPipeline()
+    {
+        const size_t lines = 300000;
+        FILE* in = tmpfile();
+        FILE* out = tmpfile();
+        if(!in || !out) return;
+
+        std::string text;
+        for(size_t i = 0; i < lines; ++i)
+            text += "3^2^3 - 128 + (10^3 - 9 * 5) / " + std::to_string(i % 97 + 1) + " + sqrt(" + std::to_string(i) + ")\n";
+        fwrite(text.data(), 1, text.size(), in);
+        rewind(in);
+
+        Calculator c;
+        auto start = std::chrono::steady_clock::now();
+        std::string results;
+        for(size_t begin = 0, nl; (nl = text.find('\n', begin)) != std::string::npos; begin = nl + 1)
+        {
+            results += "OK " + c.compile(std::string_view(text).substr(begin, nl - begin)).evaluateText() + "\n";
+            if(results.size() >= (1 << 16)) writeText(out, results);
+        }
+        writeText(out, results);
+        std::chrono::duration<double, std::nano> tSequential = std::chrono::steady_clock::now() - start;
+
+        rewind(out);
+        start = std::chrono::steady_clock::now();
+        auto stats = Pipeline(c, 16).run(in, out);
+        std::chrono::duration<double, std::nano> tPipeline = std::chrono::steady_clock::now() - start;
+
+        printf("\nPipeline over %zu lines: %.1f ns/line, one thread %.1f ns/line; stage work read %.1f, compile %.1f, evaluate %.1f, format %.1f ns/line\n",
+               stats.lines, tPipeline.count() / lines, tSequential.count() / lines,
+               stats.busy[0] * 1e9 / lines, stats.busy[1] * 1e9 / lines, stats.busy[2] * 1e9 / lines, stats.busy[3] * 1e9 / lines);
+
+        fclose(in);
+        fclose(out);
+    }
+
+    // ----------------------------
+    // MpmcQueue against a mutex and condition variable queue, with
+    // producers and consumers contending; every item is checked off
+    // ----------------------------
+    void benchQueue()
+    {
+        struct LockedQueue
+        {
+            std::deque<uint64_t> items;
+            std::mutex mtx;
+            std::condition_variable notEmpty, notFull;
+            size_t capacity;
+            bool closed = false;
+
+            explicit LockedQueue(size_t capacity) : capacity(capacity) {}
+
+            void push(uint64_t v)
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                notFull.wait(lock, [&]() { return items.size() < capacity; });
+                items.push_back(v);
+                lock.unlock();
+                notEmpty.notify_one();
+            }
+
+            bool pop(uint64_t& v)
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                notEmpty.wait(lock, [&]() { return closed || !items.empty(); });
+                if(items.empty()) return false;
+                v = items.front();
+                items.pop_front();
+                lock.unlock();
+                notFull.notify_one();
+                return true;
+            }
+
+            void close()
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                closed = true;
+                notEmpty.notify_all();
+            }
+        };
+
+        const uint64_t items = 1 << 21;
+        const size_t batch = 32;
+
+        // ns per item, and whether the consumers saw every item once
+        auto run = [&](unsigned producers, unsigned consumers, auto& queue, auto push, auto pop)
+        {
+            std::atomic<uint64_t> total{0};
+            std::vector<std::thread> takers, feeders;
+            uint64_t share = items / producers;
+            auto start = std::chrono::steady_clock::now();
+
+            for(unsigned c = 0; c < consumers; ++c)
+                takers.emplace_back([&]() { total += pop(queue); });
+            for(unsigned p = 0; p < producers; ++p)
+                feeders.emplace_back([&, p]() { push(queue, p * share + 1, (p + 1) * share); });
+
+            for(auto &t : feeders) t.join();
+            queue.close();
+            for(auto &t : takers) t.join();
+
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            uint64_t n = share * producers;
+            return std::make_pair(elapsed.count() / n, total == n * (n + 1) / 2);
+        };
+
+        auto pushOne = [](auto& q, uint64_t from, uint64_t to) { for(uint64_t v = from; v <= to; ++v) q.push(v); };
+        auto popOne = [](auto& q) { uint64_t v, sum = 0; while(q.pop(v)) sum += v; return sum; };
+        auto pushMany = [&](MpmcQueue<uint64_t>& q, uint64_t from, uint64_t to)
+        {
+            uint64_t buf[64];
+            for(uint64_t v = from; v <= to; v += batch)
+            {
+                size_t n = 0;
+                for(uint64_t w = v; w < v + batch && w <= to; ++w) buf[n++] = w;
+                q.push(buf, n);
+            }
+        };
+        auto popMany = [&](MpmcQueue<uint64_t>& q)
+        {
+            uint64_t buf[64], sum = 0;
+            while(size_t n = q.pop(buf, batch))
+                for(size_t i = 0; i < n; ++i) sum += buf[i];
+            return sum;
+        };
+
+        std::cout << "\nQueue, producers x consumers   mutex+cv ns/item   lock-free ns/item   lock-free in batches of " << batch << "   every item once\n";
+        for(auto [p, c] : {std::make_pair(1u, 1u), std::make_pair(2u, 2u), std::make_pair(4u, 4u), std::make_pair(8u, 2u)})
+        {
+            LockedQueue locked(1024);
+            MpmcQueue<uint64_t> single(1024), batched(1024);
+
+            auto a = run(p, c, locked, pushOne, popOne);
+            auto b = run(p, c, single, pushOne, popOne);
+            auto d = run(p, c, batched, pushMany, popMany);
+
+            printf("%2u x %-2u                       %16.1f   %17.1f   %27.1f   %s\n", p, c, a.first, b.first, d.first,
+                   a.second && b.second && d.second ? "yes" : "NO");
+        }
+    }
+
+    // ----------------------------
+    // diagnose() against compile() on the same formulas: well-formed
+    // ones, and a long one with a mistake every tenth term, where
+    // compile() stops at the first and diagnose() lists them all
+    // ----------------------------
+    void benchDiagnose()
+    {
+        const Calculator c;
+        const char* shortOnes[] = {"3^2^3 - 128 + (10^3 - 9 * 5)", "sqrt(x^2 + y^2) / max(x, y)", "x > 0 ? log(x) : -x", "sum(i, 1, 100, 1/i^2)"};
+        const int reps = 200000;
+
+        std::string valid, broken;
+        const char* mistakes[] = {"(x + * 2)", "foo(x)", "1..5", "sqrt(x, y)", "(x $ 2)"};
+        for(int k = 0; k < 2000; ++k)
+        {
+            std::string term = "sqrt(x + " + std::to_string(k) + ") * (y - 1.5) / max(x, " + std::to_string(k % 7) + ")";
+            valid += (k ? " + " : "") + term;
+            broken += (k ? " + " : "") + (k % 10 == 5 ? std::string(mistakes[k / 10 % 5]) : term);
+        }
+
+        auto time = [](int n, auto&& f)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for(int r = 0; r < n; ++r) f();
+            std::chrono::duration<double, std::nano> t = std::chrono::steady_clock::now() - start;
+            return t.count() / n;
+        };
+
+        size_t sink = 0;
+        double tCompile = time(reps, [&]() { for(auto s : shortOnes) sink += c.compile(s).code().size(); }) / 4;
+        double tDiagnose = time(reps, [&]() { for(auto s : shortOnes) sink += c.diagnose(s).size(); }) / 4;
+        printf("\ndiagnose, short formulas: %.0f ns each, compile: %.0f ns\n", tDiagnose, tCompile);
+
+        tCompile = time(20, [&]() { sink += c.compile(valid).code().size(); });
+        tDiagnose = time(20, [&]() { sink += c.diagnose(valid).size(); });
+        printf("diagnose, %zu-byte formula: %.1f us, compile: %.1f us\n", valid.size(), tDiagnose / 1000, tCompile / 1000);
+
+        std::string first;
+        size_t found = 0;
+        double tAll = time(20, [&]() { found = c.diagnose(broken).size(); });
+        double tFirst = time(20, [&]() { try { c.compile(broken); } catch (const std::runtime_error& exc) { first = exc.what(); } });
+        printf("with a mistake every tenth term: %zu problems in %.1f us; compile stops at the first (%s) after %.1f us%s\n",
+               found, tAll / 1000, first.c_str(), tFirst / 1000, sink ? "" : " ");
+    }
+
+    // ----------------------------
+    // tokenize() on 1 MB of 4 KB expressions, SSE2 runs against the
+    // scalar table: operators, a token every byte or two, which
+    // measures the per-token dispatch; compact, where most runs end
+    // within the two bytes tried one at a time; laid out, with long
+    // names and numbers; and wide, indented by runs of 40 to 60
+    // spaces. Expressions of 4 KB keep the token vectors in reused
+    // memory, so page faults do not swamp the lexer. Best of 10
+    // ----------------------------
+    void benchLexer()
+    {
+        auto build = [](const std::function<std::string(int)>& term, const std::string& sep)
+        {
+            std::vector<std::string> exprs(1);
+            size_t bytes = 0;
+            for(int k = 0; bytes < (1 << 20); ++k)
+            {
+                if(exprs.back().size() >= 4096) exprs.emplace_back();
+                std::string piece = (exprs.back().empty() ? "" : sep) + term(k);
+                exprs.back() += piece;
+                bytes += piece.size();
+            }
+            return exprs;
+        };
+
+        auto dense = build([](int) { return std::string("-(x1+2)*-y<=3&&z!=4||-a%-b^2/c>=d?e:(f,g)"); }, "+");
+        auto compact = build([](int k) { return std::to_string(k % 97) + " * x / (y - 1.5)"; }, " + ");
+        auto laidOut = build([](int k)
+        {
+            return "coefficient_" + std::to_string(k % 97) + "   *   3.1415926535897932" + std::to_string(k) +
+                   "   /   (distance_from_origin   -   1.5)";
+        }, "\n    + ");
+        auto wide = build([](int k)
+        {
+            return "a_rather_long_variable_name_" + std::to_string(k % 97) + std::string(40, ' ') + "* 1234567890.1234567890123456789";
+        }, "\n" + std::string(60, ' ') + "+ ");
+
+        std::cout << "\ntokenize, MB/s with SSE2 runs / scalar table:";
+        for(auto [name, exprs] : {std::pair{"operators", &dense}, {"compact", &compact}, {"laid out", &laidOut}, {"wide", &wide}})
+        {
+            size_t bytes = 0;
+            for(const auto &e : *exprs) bytes += e.size();
+
+            double best[2] = {1e9, 1e9};
+            for(int r = 0; r < 20; ++r)
+            {
+                auto start = std::chrono::steady_clock::now();
+                for(const auto &e : *exprs) calc.tokenize(e, r % 2);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                best[r % 2] = std::min(best[r % 2], elapsed.count());
+            }
+            printf(" %s %.0f / %.0f (%.2fx);", name, bytes / best[1] / 1e6, bytes / best[0] / 1e6, best[0] / best[1]);
+        }
+#ifndef __SSE2__
+        std::cout << " no SSE2 in this build";
+#endif
+        std::cout << "\n";
+    }
+
+    // ----------------------------
+    // validate() over generated formulas, a tenth of them broken,
+    // against compiling and evaluating each the way evaluateExpr()
+    // does (without its debug trace)
+    // ----------------------------
+    void benchValidate()
+    {
+        Calculator c;
+        c.setVariable("x", 1.5);
+        c.setVariable("y", 2.5);
+
+        uint64_t seed = 88172645463325252ULL;
+        auto next = [&]() { seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; return seed; };
+
+        const char* atoms[] = {"x", "y", "2", "3.25", "sqrt(x)", "max(x, y)", "(x - 1)", "log(y + 1)", "abs(-y)"};
+        const char* ops[] = {" + ", " - ", " * ", " / ", "^"};
+        const char* mistakes[] = {" * * ", " $ ", ", ", ")", " 2 "};
+
+        std::vector<std::string> formulas(100000);
+        size_t bytes = 0;
+        for(size_t k = 0; k < formulas.size(); ++k)
+        {
+            auto &f = formulas[k];
+            size_t terms = 3 + next() % 10, broken = k % 10 == 0 ? 1 + next() % (terms - 1) : terms;
+            for(size_t j = 0; j < terms; ++j)
+            {
+                if(j) f += j == broken ? mistakes[next() % 5] : ops[next() % 5];
+                f += atoms[next() % 9];
+            }
+            bytes += f.size();
+        }
+
+        size_t valid = 0, evaluated = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(const auto &f : formulas) valid += c.validate(f).ok();
+        std::chrono::duration<double, std::nano> tValidate = std::chrono::steady_clock::now() - start;
+
+        double sink = 0;
+        start = std::chrono::steady_clock::now();
+        for(const auto &f : formulas)
+        {
+            try { sink += c.evaluate(f); ++evaluated; }
+            catch (const std::runtime_error&) {}
+        }
+        std::chrono::duration<double, std::nano> tEvaluate = std::chrono::steady_clock::now() - start;
+
+        printf("\nvalidate, %zu formulas of %.0f bytes on average: %.0f ns each, compile and evaluate: %.0f ns (%.1fx)\n",
+               formulas.size(), double(bytes) / formulas.size(), tValidate.count() / formulas.size(),
+               tEvaluate.count() / formulas.size(), tEvaluate.count() / tValidate.count());
+        printf("well-formed: %zu by validate, %zu evaluate without error (the rest divide by zero)%s\n", valid, evaluated, sink == 0.5 ? " " : "");
+    }
+
+#if defined(__cpp_impl_coroutine)
+    // ----------------------------
+    // Coroutine API: awaiting evaluations on the pool against direct
+    // calls, and a streamed batch against one evaluateBatch()
+    // ----------------------------
+    void benchAsync()
+    {
+        ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        Calculator c;
+        const int evaluations = 20000;
+        const std::string src = "3^2^3 - 128 + (10^3 - 9 * 5)";
+
+        auto start = std::chrono::steady_clock::now();
+        double direct = 0;
+        for(int i = 0; i < evaluations; ++i) direct += std::stod(c.evaluateText(src));
+        std::chrono::duration<double, std::nano> tDirect = std::chrono::steady_clock::now() - start;
+
+        auto many = [&]() -> Task<double>
+        {
+            double sum = 0;
+            for(int i = 0; i < evaluations; ++i) sum += std::stod(co_await evaluateAsync(c, pool, src));
+            co_return sum;
+        };
+        start = std::chrono::steady_clock::now();
+        double awaited = syncWait(many());
+        std::chrono::duration<double, std::nano> tAwait = std::chrono::steady_clock::now() - start;
+
+        const size_t rows = 1 << 20;
+        std::vector<double> xs(rows), whole(rows);
+        for(size_t i = 0; i < rows; ++i) xs[i] = double(i) / rows;
+        auto ce = c.compile("sqrt(x) * exp(-x) + x^2");
+        const double* cols[] = {xs.data()};
+
+        start = std::chrono::steady_clock::now();
+        ce.evaluateBatch(cols, rows, whole.data());
+        std::chrono::duration<double, std::nano> tBatch = std::chrono::steady_clock::now() - start;
+
+        auto stream = [&]() -> Task<size_t>
+        {
+            auto gen = evaluateBatchAsync(ce, pool, {xs.data()}, rows);
+            size_t seen = 0, same = 0;
+            while(auto block = co_await gen.next())
+            {
+                for(size_t i = 0; i < block->size(); ++i) same += (*block)[i] == whole[seen + i];
+                seen += block->size();
+            }
+            co_return seen == rows ? same : 0;
+        };
+        start = std::chrono::steady_clock::now();
+        size_t same = syncWait(stream());
+        std::chrono::duration<double, std::nano> tStream = std::chrono::steady_clock::now() - start;
+
+        printf("\nAwaited on the pool: %.1f ns/evaluation, direct %.1f ns (%s); streamed batch %.2f ns/row, one call %.2f ns/row, %zu of %zu rows equal\n",
+               tAwait.count() / evaluations, tDirect.count() / evaluations, awaited == direct ? "same sum" : "DIFFERENT sum",
+               tStream.count() / rows, tBatch.count() / rows, same, rows);
+    }
+#endif
+
+    // --csv "<formula>" <file or -> [column name]
+    int csv(const std::string& formula, const std::string& path, const std::string& name)
+    {
+        return evaluateCsv(calc, formula, path, name);
+    }
+
+    // --columns "<formula>" <column file> <output column file> [column name]
+    int columns(const std::string& formula, const std::string& input, const std::string& output, const std::string& name)
+    {
+        return evaluateColumns(calc, formula, input, output, name);
+    }
+
+    // --to-columns <csv> <column file>, --to-csv <column file> [csv]
+    int convert(bool toCsv, const std::string& input, const std::string& output)
+    {
+        return convertColumns(toCsv, input, output);
+    }
+
+    // --pipe [ring capacity in batches]: expressions on stdin, results on stdout
+    int pipe(size_t capacity)
+    {
+        return runPipeline(calc, capacity);
+    }
+
+    // --check <file|->: every problem in every line; --validate <file|->: OK or
+    // the first problem, line for line. Nothing is evaluated
+    int check(const std::string& path, bool all)
+    {
+        return checkFormulas(calc, path, all);
+    }
+
+    int serve(const std::string& path, unsigned workers)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        try
+        {
+            Server server(calc, workers);
+            server.listen(path);
+            std::cout << "Serving on " << path << " with " << workers << " workers\n";
+            server.run();
+        }
+        catch (const std::runtime_error& exc) { std::cerr << "Error: " << exc.what() << "\n"; return 1; }
+        return 0;
+#else
+        (void)path; (void)workers;
+        std::cerr << "Error: server mode needs Unix domain sockets.\n";
+        return 1;
+#endif
+    }
+
+    int loadgen(const std::string& path, unsigned connections, unsigned requests, unsigned depth)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        return ::loadgen(path, connections, requests, depth);
+#else
+        (void)path; (void)connections; (void)requests; (void)depth;
+        std::cerr << "Error: load generator needs Unix domain sockets.\n";
+        return 1;
+#endif
     }
 };
 
-int main()
+int main(int argc, char** argv)
 {
     Application app;
+
+    if(argc > 1 && std::string(argv[1]) == "--stress")
+    {
+        unsigned threads = argc > 2 ? std::stoul(argv[2]) : 8;
+        unsigned iterations = argc > 3 ? std::stoul(argv[3]) : 100000;
+        return app.stress(threads, iterations);
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "--bench")
+        return app.bench();
+
+    if(argc > 1 && std::string(argv[1]) == "--fuzz-lexer")
+    {
+        unsigned iterations = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        uint64_t seed = argc > 3 ? std::stoull(argv[3]) : 88172645463325252ULL;
+        return app.fuzzLexer(iterations, seed ? seed : 1);
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "--fuzz-validate")
+    {
+        unsigned iterations = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        uint64_t seed = argc > 3 ? std::stoull(argv[3]) : 88172645463325252ULL;
+        return app.fuzzValidate(iterations, seed ? seed : 1);
+    }
+
+    if(argc > 3 && std::string(argv[1]) == "--csv")
+        return app.csv(argv[2], argv[3], argc > 4 ? argv[4] : "result");
+
+    if(argc > 4 && std::string(argv[1]) == "--columns")
+        return app.columns(argv[2], argv[3], argv[4], argc > 5 ? argv[5] : "result");
+
+    if(argc > 3 && std::string(argv[1]) == "--to-columns")
+        return app.convert(false, argv[2], argv[3]);
+
+    if(argc > 2 && std::string(argv[1]) == "--to-csv")
+        return app.convert(true, argv[2], argc > 3 ? argv[3] : "-");
+
+    if(argc > 2 && std::string(argv[1]) == "--check")
+        return app.check(argv[2], true);
+
+    if(argc > 2 && std::string(argv[1]) == "--validate")
+        return app.check(argv[2], false);
+
+    if(argc > 1 && std::string(argv[1]) == "--pipe")
+        return app.pipe(argc > 2 ? std::stoul(argv[2]) : 16);
+
+    if(argc > 2 && std::string(argv[1]) == "--serve")
+    {
+        unsigned workers = argc > 3 ? std::stoul(argv[3]) : std::thread::hardware_concurrency();
+        return app.serve(argv[2], workers);
+    }
+
+    if(argc > 2 && std::string(argv[1]) == "--loadgen")
+    {
+        unsigned connections = argc > 3 ? std::stoul(argv[3]) : 4;
+        unsigned requests = argc > 4 ? std::stoul(argv[4]) : 100000;
+        unsigned depth = argc > 5 ? std::stoul(argv[5]) : 32;
+        return app.loadgen(argv[2], connections, requests, depth);
+    }
+
     app.run();
     return 0;
 }